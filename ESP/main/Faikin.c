@@ -9,11 +9,17 @@ static const char TAG[] = "Faikin";
 #include <driver/gpio.h>
 #include <driver/uart.h>
 #include "esp_http_server.h"
-#include <math.h>
 #include "mdns.h"
 #include "cn_wired.h"
 #include "cn_wired_driver.h"
 #include "daikin_s21.h"
+#include "s21_engine.h"
+#include "bus_stats.h"
+#include "ac_stats.h"
+#include "ac_history.h"
+#include "json_arena.h"
+#include "poll_sched.h"
+#include "lwip/netdb.h"
 
 // Macros for setting values
 // They set new values for parameters inside the big "daikin" state struct
@@ -24,60 +30,8 @@ static const char TAG[] = "Faikin";
 #define	daikin_set_e(name,value)	daikin_set_enum(#name,&daikin.name,CONTROL_##name,value,CONTROL_##name##_VALUES)
 #define	daikin_set_t(name,value)	daikin_set_temp(#name,&daikin.name,CONTROL_##name,value)
 
-typedef struct poll_s
-{
-   uint8_t ack:1;               //      We got an ACK so this is valid
-   uint8_t nak:2;               //      Count of NAKs in a row - if too many we set bad
-   uint8_t bad:1;               //      Too many NAKs, assume not supported
-} poll_t;
-struct
-{                               // Status of S21 messages that get a valid response - this is a count of NAKs, so 0 means working...
-   poll_t FY00;
-   poll_t F1;
-   poll_t F2;
-   poll_t F3;
-   poll_t F4;
-   poll_t F5;
-   poll_t F6;
-   poll_t F7;
-   poll_t F8;
-   poll_t F9;
-   poll_t FA;
-   poll_t FB;
-   poll_t FC;
-   poll_t FG;
-   poll_t FK;
-   poll_t FN;
-   poll_t FM;
-   poll_t FP;
-   poll_t FQ;
-   poll_t FS;
-   poll_t FT;
-   poll_t RD;
-   poll_t RG;
-   poll_t RI;
-   poll_t RM;
-   poll_t RL;
-   poll_t RN;
-   poll_t RH;
-   poll_t RX;
-   poll_t Ra;
-   poll_t Rd;
-   uint8_t rgfan:1;             // Use RG for fan
-} s21 = { 0 };
-
 // Settings (RevK library used by MQTT setting command)
 
-enum
-{                               // Number the control fields
-#define	b(name)		CONTROL_##name##_pos,
-#define	t(name)		b(name)
-#define	r(name)		b(name)
-#define	i(name)		b(name)
-#define	e(name,values)	b(name)
-#define	s(name,len)	b(name)
-#include "acextras.m"
-};
 #define	b(name)		const uint64_t CONTROL_##name=(1ULL<<CONTROL_##name##_pos);
 #define	t(name)		b(name)
 #define	r(name)		b(name)
@@ -137,6 +91,8 @@ struct
 static httpd_handle_t webserver = NULL;
 static uint8_t protocol_set = 0;        // protocol confirmed
 static uint8_t proto = 0;
+static int proto_tries = 0;     // Protocols tried while detecting
+static int64_t detect_start = 0;        // When detection started (us)
 
 static int
 uart_enabled (void)
@@ -254,18 +210,21 @@ struct
    SemaphoreHandle_t mutex;     // Control changes
    uint64_t control_changed;    // Which control fields are being set
    uint64_t status_known;       // Which fields we know, and hence can control
+   uint64_t status_dirty;       // Which fields have changed since status was last sent
    uint8_t control_count;       // How many times we have tried to change control and not worked yet
-   uint32_t statscount;         // Count for b() i(), etc.
-#define	b(name)		uint8_t	name;uint32_t total##name;
-#define	t(name)		float name;float min##name;float total##name;float max##name;uint32_t count##name;
-#define	r(name)		float min##name;float max##name;
-#define	i(name)		int name;int min##name;int total##name;int max##name;
+   // Live values, grouped by size so they pack. Stats are separate, see ac_stats.h
+#define	i(name)		int name;
+#include "acextras.m"
+#define	t(name)		ctemp_t name;
+#define	r(name)		ctemp_t min##name;ctemp_t max##name;
+#include "acextras.m"
+#define	b(name)		uint8_t	name;
 #define	e(name,values)	uint8_t name;
 #define	s(name,len)	char name[len];
 #include "acextras.m"
-   float env_prev;              // Predictive, last period value
-   float env_delta;             // Predictive, diff to last
-   float env_delta_prev;        // Predictive, previous diff
+   ctemp_t env_prev;            // Predictive, last period value
+   ctemp_t env_delta;           // Predictive, diff to last
+   ctemp_t env_delta_prev;      // Predictive, previous diff
    uint32_t controlvalid;       // uptime to which auto mode is valid
    uint32_t sample;             // Last uptime sampled
    uint32_t countApproaching,
@@ -280,15 +239,17 @@ struct
    uint8_t status_changed:1;    // Status has changed
    uint8_t mode_changed:1;      // Status or control has changed for enum or bool
    uint8_t status_report:1;     // Send status report
+   uint8_t status_extras:1;     // Auto settings, BLE or remote changed since status was last sent
    uint8_t ha_send:1;           // Send HA config
    uint8_t remote:1;            // Remote control via MQTT
    uint8_t hysteresis:1;        // Thermostat hysteresis state
    uint8_t cnresend:2;          // Resends
    uint8_t action:3;            // hvac_action
-   uint8_t protocol_major;      // Protocol version
-   uint8_t protocol_minor;
 } daikin = { 0 };
 
+static ac_stats_t stats;        // For environment logging
+static ac_history_t *history = NULL;    // Per-minute, for /history, unless nohistory
+
 enum
 {
    HVAC_OFF,
@@ -301,6 +262,70 @@ enum
 };
 const char *const hvac_action[] = { "off", "preheating", "heating", "cooling", "drying", "fan", "idle" };
 
+TaskHandle_t daikin_task = NULL;       // Main loop, woken up when controls change
+
+static void
+daikin_control_wake (void)
+{                               // Wake main loop, so that the change goes to the AC right away
+   if (daikin_task)
+      xTaskNotifyGive (daikin_task);
+}
+
+// Temperatures are ctemp_t, 0.01C. These convert at the edges, where they come and go as decimal text
+
+#define	CTEMP_SETTING(name)	((int) (name) * CTEMP (1) / name##_scale)       // Setting with .decimal
+
+static int
+ctemp_round (int t, int step)
+{                               // Round to a multiple of step, halves away from zero, like lroundf()
+   return (t + (t < 0 ? -step / 2 : step / 2)) / step * step;
+}
+
+static int
+ctemp_parse (const char *v)
+{                               // Decimal text to 0.01C, CTEMP_NONE if not a number
+   int neg = 0,
+      t = 0,
+      scale = 10;
+   if (*v == '-' || *v == '+')
+      neg = (*v++ == '-');
+   if (!isdigit ((int) *v) && (*v != '.' || !isdigit ((int) v[1])))
+      return CTEMP_NONE;
+   while (isdigit ((int) *v) && t < CTEMP (1000))
+      t = t * 10 + *v++ - '0';
+   t *= CTEMP (1);
+   if (*v == '.')
+      while (isdigit ((int) *++v) && scale >= 0)
+      {
+         if (scale)
+            t += (*v - '0') * scale;
+         else if (*v >= '5')
+            t++;                // Round on third digit
+         scale = (scale ? scale / 10 : -1);
+      }
+   if (t >= -CTEMP_NONE || *v == 'e' || *v == 'E')
+      return CTEMP_NONE;        // Out of range, or exponent, which we don't do
+   return neg ? -t : t;
+}
+
+static void
+jo_centi (jo_t j, const char *tag, int v, int places)
+{                               // Add a value in hundredths, e.g. ctemp_t, with 1 or 2 decimal places
+   if (places == 1)
+      v = ctemp_round (v, 10) / 10;
+   int d = (places == 1 ? 10 : 100);
+   jo_litf (j, tag, "%s%d.%0*d", v < 0 ? "-" : "", abs (v) / d, places, abs (v) % d);
+}
+
+static void
+ja_centi (ja_t * j, const char *tag, int v, int places)
+{                               // As jo_centi(), in an arena
+   if (places == 1)
+      v = ctemp_round (v, 10) / 10;
+   int d = (places == 1 ? 10 : 100);
+   ja_litf (j, tag, "%s%d.%0*d", v < 0 ? "-" : "", abs (v) / d, places, abs (v) % d);
+}
+
 const char *
 daikin_set_value (const char *name, uint8_t * ptr, uint64_t flag, uint8_t value)
 {                               // Setting a value (uint8_t)
@@ -311,8 +336,10 @@ daikin_set_value (const char *name, uint8_t * ptr, uint64_t flag, uint8_t value)
    xSemaphoreTake (daikin.mutex, portMAX_DELAY);
    *ptr = value;
    daikin.control_changed |= flag;
+   daikin.status_dirty |= flag;
    daikin.mode_changed = 1;
    xSemaphoreGive (daikin.mutex);
+   daikin_control_wake ();
    return NULL;
 }
 
@@ -325,9 +352,11 @@ daikin_set_int (const char *name, int *ptr, uint64_t flag, int value)
       return "Setting cannot be controlled";
    xSemaphoreTake (daikin.mutex, portMAX_DELAY);
    daikin.control_changed |= flag;
+   daikin.status_dirty |= flag;
    daikin.mode_changed = 1;
    *ptr = value;
    xSemaphoreGive (daikin.mutex);
+   daikin_control_wake ();
    return NULL;
 }
 
@@ -346,19 +375,23 @@ daikin_set_enum (const char *name, uint8_t * ptr, uint64_t flag, char *value, co
 }
 
 const char *
-daikin_set_temp (const char *name, float *ptr, uint64_t flag, float value)
-{                               // Setting a value (float)
+daikin_set_temp (const char *name, ctemp_t * ptr, uint64_t flag, int value)
+{                               // Setting a value (temperature)
+   if (value == CTEMP_NONE)
+      return "Expecting temperature";
    if (*ptr == value)
       return NULL;              // No change
    if (proto_type () == PROTO_TYPE_CN_WIRED)
-      value = roundf (value);   // CN_WIRED only does 1C steps
+      value = ctemp_round (value, CTEMP (1));   // CN_WIRED only does 1C steps
    else if (proto_type () == PROTO_TYPE_S21)
-      value = roundf (value * 2.0) / 2.0;       // S21 only does 0.5C steps
+      value = ctemp_round (value, CTEMP (0.5)); // S21 only does 0.5C steps
    xSemaphoreTake (daikin.mutex, portMAX_DELAY);
    *ptr = value;
    daikin.control_changed |= flag;
+   daikin.status_dirty |= flag;
    daikin.mode_changed = 1;
    xSemaphoreGive (daikin.mutex);
+   daikin_control_wake ();
    return NULL;
 }
 
@@ -370,6 +403,7 @@ set_uint8 (const char *name, uint8_t * ptr, uint64_t flag, uint8_t val)
    {
       daikin.status_known |= flag;
       daikin.status_changed = 1;
+      daikin.status_dirty |= flag;
    }
    if (*ptr == val)
    {                            // No change
@@ -377,11 +411,13 @@ set_uint8 (const char *name, uint8_t * ptr, uint64_t flag, uint8_t val)
       {
          daikin.control_changed &= ~flag;
          daikin.status_changed = 1;
+         daikin.status_dirty |= flag;
       }
    } else if (!(daikin.control_changed & flag))
    {                            // Changed (and not something we are trying to set)
       *ptr = val;
       daikin.status_changed = 1;
+      daikin.status_dirty |= flag;
       daikin.mode_changed = 1;
    }
    xSemaphoreGive (daikin.mutex);
@@ -395,6 +431,7 @@ set_int (const char *name, int *ptr, uint64_t flag, int val)
    {
       daikin.status_known |= flag;
       daikin.status_changed = 1;
+      daikin.status_dirty |= flag;
    }
    if (*ptr == val)
    {                            // No change
@@ -402,36 +439,43 @@ set_int (const char *name, int *ptr, uint64_t flag, int val)
       {
          daikin.control_changed &= ~flag;
          daikin.status_changed = 1;
+         daikin.status_dirty |= flag;
       }
    } else if (!(daikin.control_changed & flag))
    {                            // Changed (and not something we are trying to set)
       if (*ptr / 10 != val / 10)
+      {
          daikin.status_changed = 1;
+         daikin.status_dirty |= flag;
+      }
       *ptr = val;
    }
    xSemaphoreGive (daikin.mutex);
 }
 
 void
-set_float (const char *name, float *ptr, uint64_t flag, float val)
+set_temp (const char *name, ctemp_t * ptr, uint64_t flag, int val)
 {                               // Updating status
    xSemaphoreTake (daikin.mutex, portMAX_DELAY);
    if (!(daikin.status_known & flag))
    {
       daikin.status_known |= flag;
       daikin.status_changed = 1;
+      daikin.status_dirty |= flag;
    }
-   if (lroundf (*ptr * 10) == lroundf (val * 10))
+   if (ctemp_round (*ptr, CTEMP (0.1)) == ctemp_round (val, CTEMP (0.1)))
    {                            // No change (allow within 0.1C)
       if (daikin.control_changed & flag)
       {
          daikin.control_changed &= ~flag;
          daikin.status_changed = 1;
+         daikin.status_dirty |= flag;
       }
    } else if (!(daikin.control_changed & flag))
    {                            // Changed (and not something we are trying to set)
       *ptr = val;
       daikin.status_changed = 1;
+      daikin.status_dirty |= flag;
       if (flag == CONTROL_temp)
          daikin.mode_changed = 1;
    }
@@ -441,277 +485,83 @@ set_float (const char *name, float *ptr, uint64_t flag, float val)
 // These macros are used to report incoming status values from the AC
 #define report_uint8(name,val) set_uint8(#name,&daikin.name,CONTROL_##name,val)
 #define report_int(name,val) set_int(#name,&daikin.name,CONTROL_##name,val)
-#define report_float(name,val) set_float(#name,&daikin.name,CONTROL_##name,val)
+#define report_temp(name,val) set_temp(#name,&daikin.name,CONTROL_##name,val)
 #define report_bool(name,val) report_uint8(name, (val ? 1 : 0))
 
+static void
+jo_comms (jo_t j)
+{
+   jo_string (j, "protocol", b.loopback ? "loopback" : proto_name ());
+}
+
 jo_t
 jo_comms_alloc (void)
 {
    jo_t j = jo_object_alloc ();
-   jo_string (j, "protocol", b.loopback ? "loopback" : proto_name ());
+   jo_comms (j);
    return j;
 }
 
-jo_t s21debug = NULL;
-
-enum
-{
-   RES_OK,
-   RES_NAK,
-   RES_NOACK,
-   RES_BAD,
-   RES_WAIT,
-   RES_TIMEOUT
-};
-
-static int
-check_length (const uint8_t * cmd, int cmd_len, int len, int required, const uint8_t * payload)
+static void
+ja_protocol (ja_t * j)
 {
-   if (len >= required)
-      return 1;
+   ja_string (j, "protocol", b.loopback ? "loopback" : proto_name ());
+}
 
-   jo_t j = jo_comms_alloc ();
-   jo_stringf (j, "badlength", "%d", len);
-   jo_stringf (j, "expected", "%d", required);
-   jo_stringn (j, "command", (const char *)cmd, cmd_len);
-   jo_base16 (j, "data", payload, len);
-   revk_error ("comms", &j);
+static ja_t *
+ja_comms (void)
+{                               // As jo_comms_alloc(), but in its preallocated buffer
+   ja_t *j = ja_start (JSON_ARENA_COMMS);
+   if (j)
+      ja_protocol (j);
+   return j;
+}
 
-   return 0;
+static void
+ja_send (const char *prefix, int retain, const char *suffix, ja_t * j, int clients)
+{                               // Send a message built in an arena, and free the arena for the next
+   if (!j)
+      return;
+   revk_mqtt_send_payload_clients (prefix, retain, suffix, ja_finish (j), clients);
+   ja_done (j);
 }
 
+// As revk_state/revk_info/revk_error, for messages built in an arena
+#define ja_state(t,j) ja_send(topicstate,1,t,j,1)
+#define ja_info(t,j) ja_send(topicinfo,0,t,j,1)
+#define ja_error(t,j) ja_send(topicerror,0,t,j,1)
+
+jo_t s21debug = NULL;
+
 static void
 comm_timeout (uint8_t * buf, int rxlen)
 {
    daikin.talking = 0;
    b.loopback = 0;
-   jo_t j = jo_comms_alloc ();
-   jo_bool (j, "timeout", 1);
+   ja_t *j = ja_comms ();
+   ja_bool (j, "timeout", 1);
    if (rxlen)
-      jo_base16 (j, "data", buf, rxlen);
-   revk_error ("comms", &j);
+      ja_base16 (j, "data", buf, rxlen);
+   ja_error ("comms", j);
 }
 
 static void
 comm_badcrc (uint8_t c, const uint8_t * buf, int rxlen)
 {
-   jo_t j = jo_comms_alloc ();
-   jo_stringf (j, "badsum", "%02X", c);
-   jo_base16 (j, "data", buf, rxlen);
-   revk_error ("comms", &j);
-}
-
-static int
-daikin_s21_v3_response (const uint8_t * cmd_buf, int len, uint8_t * payload)
-{
-   if (cmd_buf[0] == 'G' && cmd_buf[1] == 'Y' && cmd_buf[3] == '0')
-   {
-      switch (cmd_buf[2])
-      {
-      case '0': // GY00 - protocol version, v3+
-         if (check_length (cmd_buf, S21_V3_COMMAND_LEN, len, S21_PAYLOAD_LEN, payload)) {
-            daikin.protocol_major = (payload[2] & S21_SHIELD_MASK) + (payload[3] & S21_SHIELD_MASK) * 10;
-            daikin.protocol_minor = (payload[0] & S21_SHIELD_MASK) + (payload[1] & S21_SHIELD_MASK) * 10;
-         }
-         break;
-      }
-   }
-
-   return RES_OK;
-}
-
-// Decode S21 response payload
-int
-daikin_s21_response (const uint8_t * cmd_buf, int len, uint8_t * payload)
-{
-   uint8_t cmd = cmd_buf[0];
-   uint8_t cmd2 = cmd_buf[1];
-
-   if (len >= 1 && s21debug)
-   {
-      char tag[3] = { cmd, cmd2 };
-      if (debughex)
-         jo_base16 (s21debug, tag, payload, len);
-      else
-         jo_stringn (s21debug, tag, (char *) payload, len);
-   }
-   // Remember to add to polling if we add more handlers
-   if (cmd == 'G')
-      switch (cmd2)
-      {
-      case '1':                // 'G1' - basic status
-         if (check_length (cmd_buf, S21_COMMAND_LEN, len, S21_PAYLOAD_LEN, payload))
-         {
-            report_uint8 (online, 1);
-            report_bool (power, payload[0] == '1');
-            report_uint8 (mode, "30721003"[payload[1] & 0x7] - '0');    // FHCA456D mapped from AXDCHXF
-            report_uint8 (heat, daikin.mode == FAIKIN_MODE_HEAT);       // Crude - TODO find if anything actually tells us this
-            if (daikin.mode == FAIKIN_MODE_HEAT || daikin.mode == FAIKIN_MODE_COOL || daikin.mode == FAIKIN_MODE_AUTO)
-               report_float (temp, s21_decode_target_temp (payload[2]));
-            else if (!isnan (daikin.temp))
-               report_float (temp, daikin.temp);        // Does not have temp in other modes
-            if (!s21.rgfan)
-            {                   // RG is better, so we only look at G1 if RG does not work
-               if (payload[3] != 'A')   // Set fan speed
-                  report_uint8 (fan, "00012345"[payload[3] & 0x7] - '0');       // XXX12345 mapped to A12345Q
-               else if (daikin.fan == 6)
-                  report_uint8 (fan, 6);        // Quiet mode set (it returns as auto, so we assume it should be quiet if fan speed is low)
-               else
-                  report_uint8 (fan, 0);        // Auto as fan too fast to be quiet mode
-            }
-         }
-         break;
-      case '3':                // Seems to be an alternative to G6
-         // If F6 is supported, F3 does not provide "powerful" flag even if supported.
-         // We may still get G3 response for debug or from injection via MQTT "send".
-         if (s21.F6.bad && check_length (cmd_buf, S21_COMMAND_LEN, len, 1, payload))
-         {
-            report_bool (powerful, payload[3] & 0x02);
-         }
-         break;
-      case '5':                // 'G5' - swing status
-         if (check_length (cmd_buf, S21_COMMAND_LEN, len, 1, payload))
-         {
-            if (!noswingw)
-               report_bool (swingv, payload[0] & 1);
-            if (!noswingh)
-               report_bool (swingh, payload[0] & 2);
-         }
-         break;
-      case '6':                // 'G6' - "powerful" mode and some others
-         if (check_length (cmd_buf, S21_COMMAND_LEN, len, S21_PAYLOAD_LEN, payload))
-         {
-            if (!nopowerful)
-               report_bool (powerful, payload[0] & 0x02);
-            if (!nocomfort)
-               report_bool (comfort, payload[0] & 0x40);
-            if (!noquiet)
-               report_bool (quiet, payload[0] & 0x80);
-            if (!nostreamer)
-               report_bool (streamer, payload[1] & 0x80);
-            if (!nosensor)
-               report_bool (sensor, payload[3] & 0x08);
-            if (!noled)
-               report_bool (led, (payload[3] & 0x0C) != 0x0C);
-         }
-         break;
-      case '7':                // 'G7' - "demand" and "eco" mode
-         if (check_length (cmd_buf, S21_COMMAND_LEN, len, 2, payload))
-         {
-            if (!nodemand && payload[0] != '1')
-               report_int (demand, 100 - (payload[0] - '0'));
-            report_bool (econo, payload[1] & 0x02);
-         }
-         break;
-      case '8':
-         if (check_length (cmd_buf, S21_COMMAND_LEN, len, 2, payload))
-         {
-            daikin.protocol_major = payload[1] & (~0x30);
-         }
-         break;
-      case '9':
-         if (check_length (cmd_buf, S21_COMMAND_LEN, len, 2, payload))
-         {
-            report_float (home, (float) ((signed) payload[0] - 0x80) / 2);
-            report_float (outside, (float) ((signed) payload[1] - 0x80) / 2);
-         }
-         break;
-      case 'C':
-         if (len > 0)
-         {
-            // Normally response length would be 4, but let's try being more creative
-            // and future-proof. Accept the whole payload whatever it is.
-            int limit = len >= sizeof (daikin.model) ? sizeof (daikin.model) - 1 : len;
-            for (int i = 0; i < limit; i++) // The string is provided in reverse
-               daikin.model[i] = payload[len - i - 1];
-            daikin.model[limit] = 0;
-         }
-         break;
-      case 'M':                // Power meter
-         report_int (Wh, s21_decode_hex_sensor (payload) * 100);        // 100Wh units
-         break;
-      case 'Y':
-      case 'U':
-         if (check_length (cmd_buf, S21_COMMAND_LEN, len, 2, payload))
-         {
-            // These are known v3 responses, command length = 4
-            return daikin_s21_v3_response (cmd_buf, len - 2, payload + 2);
-         }
-         break;
-      }
-   if (cmd == 'S')
-   {
-      if (cmd2 == 'G')
-      {
-         if (check_length (cmd_buf, S21_COMMAND_LEN, len, 1, payload))
-         {                      // One byte response!
-            switch (cmd2)
-            {
-            case 'G':
-               if (strchr ("34567AB", payload[0]))
-               {                // Sensible FAN, else us F1
-                  if (payload[0] >= '3' && payload[0] <= '7')
-                     report_uint8 (fan, payload[0] - '3' + 1);  // 1-5
-                  else if (payload[0] == 'A')
-                     report_uint8 (fan, 0);     // Auto
-                  else if (payload[0] == 'B')
-                     report_uint8 (fan, 6);     // Quiet
-                  s21.rgfan = 1;
-               } else
-                  s21.rgfan = 0;
-               break;
-            }
-         }
-      } else if (cmd2 == 'L' || cmd2 == 'd' || cmd2 == 'D' || cmd2 == 'N' || cmd2 == 'M')
-      {                         // These responses are always only 3 bytes long
-         if (check_length (cmd_buf, S21_COMMAND_LEN, len, 3, payload))
-         {
-            int v = s21_decode_int_sensor (payload);
-            switch (cmd2)
-            {
-            case 'L':          // Fan
-               report_int (fanrpm, v * 10);
-               break;
-            case 'd':          // Compressor
-               report_int (comp, v);
-               break;
-            case 'N':          // Angle vertical swing
-               report_int (anglev, v);
-               break;
-            }
-         }
-      } else if (check_length (cmd_buf, S21_COMMAND_LEN, len, S21_PAYLOAD_LEN, payload))
-      {
-         float t = s21_decode_float_sensor (payload);
-
-         if (t < 100)           // Sanity check
-         {
-            switch (cmd2)
-            {                   // Temperatures (guess)
-            case 'H':          // 'SH' - home temp
-               report_float (home, t);
-               break;
-            case 'a':          // 'Sa' - outside temp
-               report_float (outside, t);
-               break;
-            case 'I':          // 'SI' - liquid ???
-               report_float (liquid, t);
-               break;
-            case 'N':          // ?
-               break;
-            case 'X':          // ?
-               break;
-            }
-         }
-      }
-   }
-   return RES_OK;
+   ja_t *j = ja_comms ();
+   ja_stringf (j, "badsum", "%02X", c);
+   ja_base16 (j, "data", buf, rxlen);
+   ja_error ("comms", j);
 }
 
 void
 protocol_found (void)
 {
    protocol_set = 1;
+   bus_stats_reset ();          // Probing other protocols is not what /stats is for
+   ja_t *i = ja_comms ();
+   ja_int (i, "detect-ms", (esp_timer_get_time () - detect_start) / 1000);    // Start of detection to first valid response
+   ja_info ("protocol", i);
    if (proto != protocol)
    {
       jo_t j = jo_object_alloc ();
@@ -736,8 +586,9 @@ cn_wired_report_fan_speed (const uint8_t * packet)
 // Parse an incoming CN_WIRED packet
 // These packets always have a fixed length of CNW_PKT_LEN
 void
-daikin_cn_wired_incoming_packet (const uint8_t * payload)
+daikin_cn_wired_incoming_packet (const cn_wired_packet_t * pkt)
 {
+   const uint8_t *payload = pkt->data;
    static int cnw_retries = 0;
    uint8_t pkt_type;
    int8_t new_mode;
@@ -746,9 +597,11 @@ daikin_cn_wired_incoming_packet (const uint8_t * payload)
    if (c != payload[CNW_CRC_TYPE_OFFSET])
    {
       // Bad checksum
+      bus_stats_result (bus_stats_find ("rx"), BUS_BADSUM);
       comm_badcrc (c >> 4, payload, CNW_PKT_LEN);
 
       daikin.online = false;
+      daikin.status_dirty |= CONTROL_online;
 
       // When autodetecting a protocol, we only have 2 retries before deciding
       // that it's not CN_WIRED
@@ -760,6 +613,7 @@ daikin_cn_wired_incoming_packet (const uint8_t * payload)
       return;
    }
    // We're now online
+   bus_stats_result (bus_stats_find ("rx"), BUS_OK);
    report_uint8 (online, 1);
 
    if (!protocol_set)
@@ -773,7 +627,7 @@ daikin_cn_wired_incoming_packet (const uint8_t * payload)
       report_uint8 (power, 0);
       report_uint8 (mode, FAIKIN_MODE_AUTO);
       report_uint8 (heat, 0);
-      report_float (temp, 20);
+      report_temp (temp, CTEMP (20));
       report_uint8 (fan, FAIKIN_FAN_AUTO);
       report_uint8 (powerful, 0);
       report_uint8 (swingv, 0);
@@ -786,20 +640,21 @@ daikin_cn_wired_incoming_packet (const uint8_t * payload)
 
    if (b.dumping)
    {
-      jo_t j = jo_comms_alloc ();
+      ja_t *j = ja_comms ();
 
       if (pkt_type > CNW_MODE_CHANGED)
-         jo_string (j, "error", "Unknown message type");
+         ja_string (j, "error", "Unknown message type");
 
-      jo_base16 (j, "data", payload, CNW_PKT_LEN);
+      ja_base16 (j, "data", payload, CNW_PKT_LEN);
+      ja_int (j, "quality", pkt->quality);
       cn_wired_stats (j);
-      revk_info ("rx", &j);
+      ja_info ("rx", j);
    }
 
    switch (pkt_type)
    {
    case CNW_SENSOR_REPORT:
-      report_float (home, decode_bcd (payload[CNW_TEMP_OFFSET]));
+      report_temp (home, CTEMP (decode_bcd (payload[CNW_TEMP_OFFSET])));
       break;
    case CNW_MODE_CHANGED:
       new_mode = cnw_decode_mode (payload);
@@ -807,7 +662,7 @@ daikin_cn_wired_incoming_packet (const uint8_t * payload)
       if (new_mode != FAIKIN_MODE_INVALID)
          report_uint8 (mode, new_mode);
       report_uint8 (heat, daikin.mode == FAIKIN_MODE_HEAT);
-      report_float (temp, decode_bcd (payload[CNW_TEMP_OFFSET]));
+      report_temp (temp, CTEMP (decode_bcd (payload[CNW_TEMP_OFFSET])));
       cn_wired_report_fan_speed (payload);
       report_bool (swingv, payload[CNW_SPECIALS_OFFSET] & CNW_V_SWING);
       report_bool (sleep, payload[CNW_SPECIALS_OFFSET] & CNW_SLEEP);
@@ -861,7 +716,7 @@ daikin_cn_wired_send_modes (void)
    if (daikin.led)
       specials |= CNW_LED_ON;
 
-   buf[CNW_TEMP_OFFSET] = encode_bcd (daikin.temp);
+   buf[CNW_TEMP_OFFSET] = encode_bcd (daikin.temp / CTEMP (1));
    buf[1] = 0x04;               // These two bytes are perhaps not even used, but from experiments
    buf[2] = 0x50;               // we know these packets work. So let's stick to known working values.
    buf[CNW_MODE_OFFSET] = cnw_encode_mode (daikin.mode, daikin.power);
@@ -873,9 +728,9 @@ daikin_cn_wired_send_modes (void)
 
    if (b.dumping)
    {
-      jo_t j = jo_comms_alloc ();
-      jo_base16 (j, "data", buf, CNW_PKT_LEN);
-      revk_info (daikin.talking ? "tx" : "cannot-tx", &j);
+      ja_t *j = ja_comms ();
+      ja_base16 (j, "data", buf, CNW_PKT_LEN);
+      ja_info (daikin.talking ? "tx" : "cannot-tx", j);
    }
 
    if (cn_wired_write_bytes (buf) == ESP_OK)
@@ -890,15 +745,48 @@ daikin_cn_wired_send_modes (void)
    }
 }
 
+// X50A poll schedule. Like S21, each command has a refresh interval which backs off while the response
+// does not change. CA is sent with zeros for status, so it is also how controls are read back
+static const poll_sched_def_t x50a_polls[] = {
+   {0xCA, 1000, 1000},          // Power, mode, fan - what users see and control
+   {0xBD, 2000, 10000},         // Temperatures
+   {0xBE, 5000, 30000},         // Fan RPM, flap, antifreeze
+};
+
+#define	X50A_POLLS	(sizeof (x50a_polls) / sizeof (*x50a_polls))
+
+static poll_sched_state_t x50a_poll[X50A_POLLS];
+static poll_sched_t x50a_sched = {.defs = x50a_polls,.state = x50a_poll,.count = X50A_POLLS,.budget = X50A_POLLS };
+
+static uint16_t x50a_rx_hash = 0;       // Hash of last good response payload
+static uint8_t x50a_cb[2] = { 0 };      // Last CB (fan) payload the unit accepted
+static uint8_t x50a_cb_valid = 0;       // x50a_cb is what the unit has
+
+static uint8_t
+x50a_cb_mode (uint8_t mode)
+{                               // CB byte 0 for a mode
+   return (mode == 1 || mode == 2) ? mode : 6;
+}
+
+static int
+x50a_decode_temp (const uint8_t * p)
+{                               // 1/128C, 0000 is not set
+   int raw = (int16_t) (p[0] + (p[1] << 8));
+   if (!raw)
+      return CTEMP_NONE;
+   int t = (raw * CTEMP (1) + (raw < 0 ? -64 : 64)) / 128;
+   return t < CTEMP (100) ? t : CTEMP_NONE;
+}
+
 void
 daikin_x50a_response (uint8_t cmd, int len, uint8_t * payload)
 {                               // Process response
    if (debug && len)
    {
-      jo_t j = jo_comms_alloc ();
-      jo_stringf (j, "cmd", "%02X", cmd);
-      jo_base16 (j, "payload", payload, len);
-      revk_info ("rx", &j);
+      ja_t *j = ja_comms ();
+      ja_stringf (j, "cmd", "%02X", cmd);
+      ja_base16 (j, "payload", payload, len);
+      ja_info ("rx", j);
    }
    if (cmd == 0xAA && len >= 1)
    {                            // Initialisation response
@@ -909,6 +797,7 @@ daikin_x50a_response (uint8_t cmd, int len, uint8_t * payload)
    if (cmd == 0xBA && len >= 20)
    {
       strncpy (daikin.model, (char *) payload, sizeof (daikin.model));
+      daikin.status_dirty |= CONTROL_model;
       daikin.status_changed = 1;
       return;
    }
@@ -920,6 +809,8 @@ daikin_x50a_response (uint8_t cmd, int len, uint8_t * payload)
       report_uint8 (heat, payload[2] == 1);
       report_uint8 (slave, payload[9]);
       report_uint8 (fan, (payload[6] >> 4) & 7);
+      if (x50a_cb_valid && (((payload[6] ^ x50a_cb[1]) & 0x70) || x50a_cb_mode (payload[1]) != x50a_cb[0]))
+         x50a_cb_valid = 0;     // Fan or mode changed on the unit, maybe by remote, so next CB must go out
       return;
    }
    if (cmd == 0xCB && len >= 2)
@@ -928,15 +819,15 @@ daikin_x50a_response (uint8_t cmd, int len, uint8_t * payload)
    }
    if (cmd == 0xBD && len >= 29)
    {                            // Looks like temperatures - we assume 0000 is not set
-      float t;
-      if ((t = (int16_t) (payload[0] + (payload[1] << 8)) / 128.0) && t < 100)
-         report_float (inlet, t);
-      if ((t = (int16_t) (payload[2] + (payload[3] << 8)) / 128.0) && t < 100)
-         report_float (home, t);
-      if ((t = (int16_t) (payload[4] + (payload[5] << 8)) / 128.0) && t < 100)
-         report_float (liquid, t);
-      if ((t = (int16_t) (payload[8] + (payload[9] << 8)) / 128.0) && t < 100)
-         report_float (temp, t);
+      int t;
+      if ((t = x50a_decode_temp (payload + 0)) != CTEMP_NONE)
+         report_temp (inlet, t);
+      if ((t = x50a_decode_temp (payload + 2)) != CTEMP_NONE)
+         report_temp (home, t);
+      if ((t = x50a_decode_temp (payload + 4)) != CTEMP_NONE)
+         report_temp (liquid, t);
+      if ((t = x50a_decode_temp (payload + 8)) != CTEMP_NONE)
+         report_temp (temp, t);
 #if 0
       if (debug)
       {
@@ -965,9 +856,9 @@ daikin_x50a_response (uint8_t cmd, int len, uint8_t * payload)
       // 010476050101000001
       // 010000000100000001
 #if 0
-      jo_t j = jo_comms_alloc ();       // Debug
-      jo_base16 (j, "be", payload, len);
-      revk_info ("rx", &j);
+      ja_t *j = ja_comms ();       // Debug
+      ja_base16 (j, "be", payload, len);
+      ja_info ("rx", j);
 #endif
       return;
    }
@@ -976,27 +867,102 @@ daikin_x50a_response (uint8_t cmd, int len, uint8_t * payload)
 // Timeout value for serial port read
 #define READ_TIMEOUT (500 / portTICK_PERIOD_MS)
 
+// Timeout value for serial port read on the first pass of protocol detection. A unit talking
+// the protocol answers well within this, the full timeout is used if nothing is found quickly
+#define PROBE_TIMEOUT_MS 150
+
+// Listen for CN_WIRED sync pulses this long before trying it, packets come about once a second
+#define CNW_SNIFF_TIME (1500 / portTICK_PERIOD_MS)
+// Try CN_WIRED every this many times anyway, even if nothing was heard
+#define CNW_SNIFF_TRIES 4
+
+static int
+probing (void)
+{                               // Quick first pass of protocol detection
+   return !protocol_set && proto_tries <= PROTO_TYPE_MAX;
+}
+
 // Timeout value for CN_WIRED reads (4 seconds)
 #define CNW_READ_TIMEOUT (4000 / portTICK_PERIOD_MS)
+// A packet takes ~100ms, if it started longer ago than this we have missed the moment to answer it
+#define CNW_STALE_TIME 300000LL
+// The trailer ends ~18ms after a packet
+#define CNW_TRAILER_TIMEOUT (30 / portTICK_PERIOD_MS)
+
+static void s21_report_uint8 (void *ctx, int field, uint8_t val);
+static void s21_report_int (void *ctx, int field, int val);
+static void s21_report_temp (void *ctx, int field, int val);
+
+// Altherma_S register decoders, see asregisters.m
+enum
+{
+   AS_DEC_TEMP,                 // Signed 16 bits little endian, 0.1C
+   AS_DEC_BYTE,                 // Unsigned byte, times arg
+   AS_DEC_WORD,                 // Unsigned 16 bits little endian, times arg
+   AS_DEC_BIT,                  // Boolean, any of arg bits set
+};
+
+typedef struct as_field_s
+{
+   char reg[2];                 // Register code
+   uint8_t decoder;
+   uint8_t field;               // CONTROL_xxx_pos
+   uint8_t offset;              // In data following register code
+   uint8_t arg;
+} as_field_t;
+
+static const as_field_t as_fields[] = {
+#define f(reg,name,decoder,offset,arg)	{#reg,AS_DEC_##decoder,CONTROL_##name##_pos,offset,arg},
+#include "asregisters.m"
+};
+
+#define	AS_FIELDS	(sizeof (as_fields) / sizeof (*as_fields))
+
+// Altherma_S poll schedule. Like X50A, each register has a refresh interval which backs off while the reply
+// does not change. Temperatures and states change all the time, settings hardly ever
+static const poll_sched_def_t as_polls[] = {
+   {'P', 1000, 5000},           // Pump, defrost
+   {'T', 2000, 10000},          // Temperatures
+   {'U', 2000, 10000},          // Compressor, water flow
+   {'S', 10000, 60000},         // Settings
+};
+
+#define	AS_POLLS	(sizeof (as_polls) / sizeof (*as_polls))
+#define	AS_NAKS		2       // NAKs in a row before we decide a register is not supported
+
+static poll_sched_state_t as_poll[AS_POLLS];
+static poll_sched_t as_sched = {.defs = as_polls,.state = as_poll,.count = AS_POLLS,.max_naks = AS_NAKS,.budget = AS_POLLS };
+
+static uint16_t as_rx_hash = 0; // Hash of last good reply
 
 void
 daikin_as_response (int len, uint8_t * res)
 {
    report_uint8 (online, 1);
-   switch (*res)
+   if (!asdecode)
+      return;                   // Offsets not checked yet, see raw replies with dump
+   const uint8_t *data = res + 1;
+   len -= 2;                    // Register code and checksum
+   for (int n = 0; n < AS_FIELDS; n++)
    {
-   case 'U':
-      // TODO
-      break;
-   case 'T':
-      // TODO
-      break;
-   case 'P':
-      // TODO
-      break;
-   case 'S':
-      // TODO
-      break;
+      const as_field_t *f = &as_fields[n];
+      if (f->reg[0] != *res || f->offset + (f->decoder == AS_DEC_TEMP || f->decoder == AS_DEC_WORD ? 2 : 1) > len)
+         continue;
+      switch (f->decoder)
+      {
+      case AS_DEC_TEMP:
+         s21_report_temp (NULL, f->field, (int16_t) (data[f->offset] + (data[f->offset + 1] << 8)) * CTEMP (0.1));
+         break;
+      case AS_DEC_BYTE:
+         s21_report_int (NULL, f->field, data[f->offset] * f->arg);
+         break;
+      case AS_DEC_WORD:
+         s21_report_int (NULL, f->field, (data[f->offset] + (data[f->offset + 1] << 8)) * f->arg);
+         break;
+      case AS_DEC_BIT:
+         s21_report_uint8 (NULL, f->field, (data[f->offset] & f->arg) ? 1 : 0);
+         break;
+      }
    }
 }
 
@@ -1009,265 +975,449 @@ daikin_as_command (int len, uint8_t * buf)
    buf[len++] = ~cs;
    if (b.dumping)
    {
-      jo_t j = jo_comms_alloc ();
-      jo_stringf (j, "cmd", "%c", buf[1]);
-      jo_base16 (j, "dump", buf, len);
-      revk_info ("tx", &j);
+      ja_t *j = ja_comms ();
+      ja_stringf (j, "cmd", "%c", buf[1]);
+      ja_base16 (j, "dump", buf, len);
+      ja_info ("tx", j);
    }
+   char name[2] = { buf[1] };
+   bus_stat_t *stat = bus_stats_find (name);
+   int64_t sent = esp_timer_get_time ();
    uart_write_bytes (uart, (char *)buf, len);
    uint8_t res[18];
-   len = uart_read_bytes (uart, res, sizeof (res), READ_TIMEOUT);
+   len = uart_read_bytes (uart, res, sizeof (res), probing ()? PROBE_TIMEOUT_MS / portTICK_PERIOD_MS : READ_TIMEOUT);
    if (len < 0)
    {
       daikin.talking = 0;
+      bus_stats_result (stat, BUS_BAD);
       return RES_NOACK;
    }
+   if (!len)
+   {
+      bus_stats_result (stat, BUS_TIMEOUT);
+      if (!protocol_set)
+         comm_timeout (NULL, 0);        // Nothing there, move on to next protocol
+      return RES_TIMEOUT;
+   }
+   if (stat)
+      bus_stats_time (&stat->reply, esp_timer_get_time () - sent);
    cs = 0;
    for (int i = 0; i < len - 1; i++)
       cs += res[i];
    cs = ~cs;
-   if (b.dumping && len > 0)
+   if (b.dumping)
    {
-      jo_t j = jo_comms_alloc ();
-      jo_stringf (j, "cmd", "%c", buf[1]);
-      jo_base16 (j, "dump", res, len);
-      revk_info ("rx", &j);
+      ja_t *j = ja_comms ();
+      ja_stringf (j, "cmd", "%c", buf[1]);
+      ja_base16 (j, "dump", res, len);
+      ja_info ("rx", j);
    }
    if (len != sizeof (res) || cs != res[len - 1] || *res != buf[1])
    {
-      jo_t j = jo_comms_alloc ();
-      jo_base16 (j, "payload", res, len);
+      ja_t *j = ja_comms ();
+      ja_base16 (j, "payload", res, len);
       if (cs != res[len - 1])
-         jo_stringf (j, "bad-cs", "%02X", cs);
+         ja_stringf (j, "bad-cs", "%02X", cs);
       if (*res != 0x15 && *res != buf[1])
-         jo_stringf (j, "bad-cmd", "%c", buf[1]);
-      revk_error ("comms", &j);
+         ja_stringf (j, "bad-cmd", "%c", buf[1]);
+      ja_error ("comms", j);
       if (*res == 0x15 && cs == res[len - 1])
+      {
+         bus_stats_result (stat, BUS_NAK);
          return RES_NAK;
+      }
+      bus_stats_result (stat, cs != res[len - 1] ? BUS_BADSUM : BUS_BAD);
       return RES_BAD;
    }
+   bus_stats_result (stat, BUS_OK);
    if (*res == buf[1] && !protocol_set)
       protocol_found ();
+   uint16_t hash = 0;
+   for (int i = 1; i < len - 1; i++)
+      hash = hash * 33 + res[i];
+   as_rx_hash = hash;
    daikin_as_response (len, res);
    return RES_OK;
 }
 
-int
-daikin_as_poll (char reg)
+void
+daikin_as_poll (void)
+{                               // Refresh what is due, most overdue first
+   poll_sched_start (&as_sched, esp_timer_get_time () / 1000);
+   int n;
+   while ((n = poll_sched_next (&as_sched)) >= 0)
+   {
+      uint8_t temp[3];
+      temp[0] = 0x02;
+      temp[1] = as_polls[n].code;
+      int res = daikin_as_command (2, temp);
+      poll_sched_done (&as_sched, n, res == RES_OK, res == RES_NAK, as_rx_hash);
+      if (res == RES_TIMEOUT || !daikin.talking)
+         break;                 // Nobody there, try again next cycle
+   }
+   if (!daikin.talking)
+      poll_sched_reset (&as_sched);     // Start again, and try every register
+}
+
+static ja_t *
+ja_s21 (char cmd, char cmd2, const char *payload, int payload_len)
 {
-   uint8_t temp[3];
-   temp[0] = 0x02;
-   temp[1] = reg;
-   return daikin_as_command (2, temp);
+   ja_t *j = ja_comms ();
+   ja_stringf (j, "cmd", "%c%c", cmd, cmd2);
+   if (payload_len)
+   {
+      ja_base16 (j, "payload", payload, payload_len);
+      ja_stringn (j, "text", payload, payload_len);
+   }
+   return j;
 }
 
 static int
-is_valid_s21_response (const uint8_t * buf, int rxlen, uint8_t cmd, uint8_t cmd2)
+s21_uart_write (void *ctx, const uint8_t * buf, int len)
 {
-   return rxlen >= S21_MIN_PKT_LEN && buf[S21_STX_OFFSET] == STX && buf[rxlen - 1] == ETX &&
-      buf[S21_CMD0_OFFSET] == cmd && buf[S21_CMD1_OFFSET] == cmd2;
+   return uart_write_bytes (uart, (const char *) buf, len);
 }
 
-static jo_t
-jo_s21_alloc (char cmd, char cmd2, const char *payload, int payload_len)
+static int
+s21_uart_read (void *ctx, uint8_t * buf, int len, int timeout_ms)
 {
-   jo_t j = jo_comms_alloc ();
-   jo_stringf (j, "cmd", "%c%c", cmd, cmd2);
-   if (payload_len)
+   int rxlen = uart_read_bytes (uart, buf, len, timeout_ms / portTICK_PERIOD_MS);
+   return rxlen < 0 ? 0 : rxlen;
+}
+
+static int
+s21_uart_available (void *ctx)
+{
+   size_t len = 0;
+   uart_get_buffered_data_len (uart, &len);
+   return len;
+}
+
+static const s21_transport_t s21_uart = {
+   .write = s21_uart_write,
+   .read = s21_uart_read,
+   .available = s21_uart_available,
+};
+
+static int
+s21_field_disabled (int field)
+{                               // Fields the user told us not to trust
+   switch (field)
    {
-      jo_base16 (j, "payload", payload, payload_len);
-      jo_stringn (j, "text", payload, payload_len);
+   case CONTROL_swingv_pos:
+      return noswingw;
+   case CONTROL_swingh_pos:
+      return noswingh;
+   case CONTROL_powerful_pos:
+      return nopowerful;
+   case CONTROL_comfort_pos:
+      return nocomfort;
+   case CONTROL_quiet_pos:
+      return noquiet;
+   case CONTROL_streamer_pos:
+      return nostreamer;
+   case CONTROL_sensor_pos:
+      return nosensor;
+   case CONTROL_led_pos:
+      return noled;
+   case CONTROL_demand_pos:
+      return nodemand;
    }
-   return j;
+   return 0;
 }
 
-int
-daikin_s21_command (uint8_t cmd, uint8_t cmd2, int payload_len, char *payload)
+static void
+s21_report_uint8 (void *ctx, int field, uint8_t val)
 {
-   if (debug && payload_len > 2 && !b.dumping)
+   if (s21_field_disabled (field))
+      return;
+   switch (field)
    {
-      jo_t j = jo_s21_alloc (cmd, cmd2, payload, payload_len);
-      revk_info (daikin.talking || protofix ? "tx" : "cannot-tx", &j);
+#define	b(name)		case CONTROL_##name##_pos: set_uint8(#name,&daikin.name,CONTROL_##name,val); break;
+#define	e(name,values)	b(name)
+#include "acextras.m"
    }
-   if (!daikin.talking && !protofix)
-      return RES_WAIT;          // Failed
-   uint8_t buf[256],
-     temp;
-   int txlen = S21_MIN_PKT_LEN + payload_len;
-   if (!snoop)
-   {                            // Send
-      buf[S21_STX_OFFSET] = STX;
-      buf[S21_CMD0_OFFSET] = cmd;
-      buf[S21_CMD1_OFFSET] = cmd2;
-      if (payload_len)
-         memcpy (buf + S21_PAYLOAD_OFFSET, payload, payload_len);
-      buf[S21_PAYLOAD_OFFSET + payload_len] = s21_checksum (buf, txlen);
-      buf[S21_PAYLOAD_OFFSET + payload_len + 1] = ETX;
-      if (b.dumping)
-      {
-         jo_t j = jo_comms_alloc ();
-         jo_base16 (j, "dump", buf, txlen);
-         char c[3] = { cmd, cmd2 };
-         jo_stringn (j, c, payload, payload_len);
-         revk_info ("tx", &j);
-      }
-      uart_write_bytes (uart, (char *)buf, txlen);
+}
+
+static void
+s21_report_int (void *ctx, int field, int val)
+{
+   if (s21_field_disabled (field))
+      return;
+   switch (field)
+   {
+#define	i(name)		case CONTROL_##name##_pos: set_int(#name,&daikin.name,CONTROL_##name,val); break;
+#include "acextras.m"
+   }
+}
+
+static void
+s21_report_temp (void *ctx, int field, int val)
+{
+   if (s21_field_disabled (field))
+      return;
+   switch (field)
+   {
+#define	t(name)		case CONTROL_##name##_pos: set_temp(#name,&daikin.name,CONTROL_##name,val); break;
+#include "acextras.m"
    }
-   // Wait ACK. Apparently some models omit it.
-   int rxlen = uart_read_bytes (uart, &temp, 1, READ_TIMEOUT);
-   if (rxlen == 0)
+}
+
+static void
+s21_report_string (void *ctx, int field, const char *val)
+{
+   switch (field)
    {
-      comm_timeout (NULL, 0);
-      return RES_TIMEOUT;
+#define	s(name,len)	case CONTROL_##name##_pos: if(strncmp(daikin.name,val,len-1)){strncpy(daikin.name,val,len-1); daikin.name[len-1]=0; daikin.status_dirty|=CONTROL_##name;} break;
+#include "acextras.m"
    }
-   if (rxlen != 1 || (temp != ACK && temp != STX))
+   if (field == CONTROL_modelname_pos && haenable)
+      daikin.ha_send = 1;       // HA device shows the full model name
+}
+
+static uint8_t
+s21_get_uint8 (void *ctx, int field)
+{
+   switch (field)
    {
-      // Got something else
-      if (rxlen == 1 && temp == NAK)
+#define	b(name)		case CONTROL_##name##_pos: return daikin.name;
+#define	e(name,values)	b(name)
+#include "acextras.m"
+   }
+   return 0;
+}
+
+static int
+s21_get_temp (void *ctx, int field)
+{
+   switch (field)
+   {
+#define	t(name)		case CONTROL_##name##_pos: return daikin.name;
+#include "acextras.m"
+   }
+   return CTEMP_NONE;
+}
+
+static void
+s21_bad (ja_t * j, const s21_event_t * e)
+{                               // Report error
+   ja_base16 (j, "data", e->data, e->len);
+   ja_error ("comms", j);
+}
+
+static bus_stat_t *s21_stat = NULL;    // Stats for command in progress
+static int s21_result = BUS_OK;         // Result for stats
+static int64_t s21_sent = 0;            // When command was sent
+static int64_t s21_acked = 0;           // When ACK came, 0 if not yet
+
+static void
+s21_event (void *ctx, int event, const s21_event_t * e)
+{                               // Protocol events from S21 engine
+   switch (event)
+   {
+   case S21_EV_TX:
+      s21_sent = esp_timer_get_time ();
+      s21_acked = 0;
+      if (b.dumping)
       {
-         // Got an explicit NAK
-         if (debug)
-         {
-            jo_t j = jo_s21_alloc (cmd, cmd2, payload, payload_len);
-            jo_bool (j, "nak", 1);
-            revk_error ("comms", &j);
-         } else if (b.dumping)
-         {
-            // We want to see NAKs under info/<name>/rx because we could have sent
-            // this command using command/<name>/send. We want to be informed if
-            // the unit has NAKed it.
-            jo_t j = jo_s21_alloc (cmd, cmd2, payload, payload_len);
-            jo_bool (j, "nak", 1);
-            revk_info ("rx", &j);
-         }
-         return RES_NAK;
-      } else
+         ja_t *j = ja_comms ();
+         ja_base16 (j, "dump", e->data, e->len);
+         char c[3] = { e->cmd[0], e->cmd[1] };
+         ja_stringn (j, c, (char *) e->data + S21_PAYLOAD_OFFSET, e->len - S21_MIN_PKT_LEN);
+         ja_info ("tx", j);
+      }
+      break;
+   case S21_EV_ACKED:
+      s21_acked = esp_timer_get_time ();
+      if (s21_stat)
+         bus_stats_time (&s21_stat->ack, s21_acked - s21_sent);
+      break;
+   case S21_EV_RX:
+      if (s21_stat)
+         bus_stats_time (&s21_stat->reply, esp_timer_get_time () - (s21_acked ? : s21_sent));
+      if (b.dumping || snoop)
       {
-         // Unexpected reply, protocol broken
-         jo_t j = jo_s21_alloc (cmd, cmd2, payload, payload_len);
+         ja_t *j = ja_comms ();
+         ja_base16 (j, "dump", e->data, e->len);
+         char c[3] = { e->cmd[0], e->cmd[1] };
+         ja_stringn (j, c, (char *) e->data + S21_PAYLOAD_OFFSET, e->len - S21_MIN_PKT_LEN);
+         ja_info ("rx", j);
+      }
+      break;
+   case S21_EV_ACK:
+      if (b.dumping)
+      {                         // We may be probing commands manually using command/<name>/send,
+         // and we want to explicitly see ACKs
+         ja_t *j = ja_s21 (e->cmd[0], e->cmd[1], (char *) e->data, e->len);
+         ja_bool (j, "ack", 1);
+         ja_info ("rx", j);
+      }
+      break;
+   case S21_EV_NAK:
+      s21_result = BUS_NAK;
+      if (debug)
+      {
+         ja_t *j = ja_s21 (e->cmd[0], e->cmd[1], (char *) e->data, e->len);
+         ja_bool (j, "nak", 1);
+         ja_error ("comms", j);
+      } else if (b.dumping)
+      {
+         // We want to see NAKs under info/<name>/rx because we could have sent
+         // this command using command/<name>/send. We want to be informed if
+         // the unit has NAKed it.
+         ja_t *j = ja_s21 (e->cmd[0], e->cmd[1], (char *) e->data, e->len);
+         ja_bool (j, "nak", 1);
+         ja_info ("rx", j);
+      }
+      break;
+   case S21_EV_NOACK:
+      {                         // Unexpected reply, protocol broken
+         ja_t *j = ja_s21 (e->cmd[0], e->cmd[1], (char *) e->data, e->len);
          daikin.talking = 0;
-         jo_bool (j, "noack", 1);
-         jo_stringf (j, "value", "%02X", temp);
-         revk_error ("comms", &j);
-         return RES_NOACK;
+         s21_result = BUS_BAD;
+         ja_bool (j, "noack", 1);
+         ja_stringf (j, "value", "%02X", e->value);
+         ja_error ("comms", j);
       }
-   }
-   if (temp == STX)
-      *buf = temp;              // No ACK, response started instead.
-   else
-   {
-      if (cmd == 'D')
-      {                         // No response expected
-         if (b.dumping)
-         {                      // We may be probing commands manually using command/<name>/send,
-            // and we want to explicitly see ACKs
-            jo_t j = jo_s21_alloc (cmd, cmd2, payload, payload_len);
-            jo_bool (j, "ack", 1);
-            revk_info ("rx", &j);
-         }
-         return RES_OK;
+      break;
+   case S21_EV_TIMEOUT:
+      s21_result = BUS_TIMEOUT;
+      comm_timeout ((uint8_t *) e->data, e->len);
+      break;
+   case S21_EV_BADSUM:
+      {
+         s21_result = BUS_BADSUM;
+         ja_t *j = ja_comms ();
+         ja_stringf (j, "badsum", "%02X", e->value);
+         s21_bad (j, e);
       }
-      while (1)
+      break;
+   case S21_EV_LOOPBACK:
       {
-         rxlen = uart_read_bytes (uart, buf, 1, READ_TIMEOUT);
-         if (rxlen != 1)
+         daikin.talking = 0;
+         s21_result = BUS_LOOPBACK;
+         if (!b.loopback)
          {
-            comm_timeout (NULL, 0);
-            return RES_NOACK;
+            ESP_LOGE (TAG, "Loopback");
+            b.loopback = 1;
+            revk_blink (0, 0, "RGB");
          }
-         if (*buf == STX)
-            break;
+         ja_t *j = ja_comms ();
+         ja_bool (j, "loopback", 1);
+         ja_error ("comms", j);
       }
-   }
-   // Receive the rest of response till ETX
-   while (rxlen < sizeof (buf))
-   {
-      if (uart_read_bytes (uart, buf + rxlen, 1, READ_TIMEOUT) != 1)
+      break;
+   case S21_EV_VALID:
+      b.loopback = 0;
+      // S21 protocol is now confirmed; we won't change it any more
+      if (!protocol_set)
+         protocol_found ();
+      break;
+   case S21_EV_BADHEAD:
       {
-         comm_timeout (buf, txlen);
-         return RES_NOACK;
+         daikin.talking = 0;    // Protocol is broken, will restart communication
+         s21_result = BUS_BAD;
+         ja_t *j = ja_comms ();
+         if (e->value & S21_BAD_HEAD)
+            ja_bool (j, "badhead", 1);
+         if (e->value & S21_BAD_MISMATCH)
+            ja_bool (j, "mismatch", 1);
+         s21_bad (j, e);
       }
-      rxlen++;
-      if (buf[rxlen - 1] == ETX)
-         break;
-   }
-   ESP_LOG_BUFFER_HEX (TAG, buf, rxlen);        // TODO 
-   // Send ACK regardless of packet quality. If we don't ack due to checksum error,
-   // for example, the response will be sent again.
-   // Note not all ACs do that. My FTXF20D doesn't - Sonic-Amiga
-   temp = ACK;
-   uart_write_bytes (uart, (char *)&temp, 1);
-   if (b.dumping || snoop)
-   {
-      jo_t j = jo_comms_alloc ();
-      jo_base16 (j, "dump", buf, rxlen);
-      char c[3] = { buf[1], buf[2] };
-      jo_stringn (j, c, (char *) buf + 3, rxlen - 5);
-      revk_info ("rx", &j);
-   }
-   int s21_bad (jo_t j)
-   {                            // Report error and return RES_BAD - also pause/flush
-      jo_base16 (j, "data", buf, rxlen);
-      revk_error ("comms", &j);
-      return RES_BAD;
-   }
-   // Check checksum
-   uint8_t c = s21_checksum (buf, rxlen);
-   if (c != buf[rxlen - 2])
-   {                            // Sees checksum of 03 actually sends as 05
-      jo_t j = jo_comms_alloc ();
-      jo_stringf (j, "badsum", "%02X", c);
-      return s21_bad (j);
-   }
-   // For reliability, verify that we've got back the exact transmitted data
-   // We're using the same buf for both tx and rx, so our sent packet is gone
-   // at this point, so we're verifying piece by piece
-   if (!snoop && rxlen == txlen && is_valid_s21_response (buf, rxlen, cmd, cmd2) &&
-       (payload_len == 0 || !memcmp (payload, buf + S21_PAYLOAD_OFFSET, payload_len)))
-   {                            // Loop back
-      daikin.talking = 0;
-      if (!b.loopback)
+      break;
+   case S21_EV_BADLENGTH:
       {
-         ESP_LOGE (TAG, "Loopback");
-         b.loopback = 1;
-         revk_blink (0, 0, "RGB");
+         s21_result = BUS_BAD;
+         ja_t *j = ja_comms ();
+         ja_stringf (j, "badlength", "%d", e->len);
+         ja_stringf (j, "expected", "%d", e->value);
+         ja_stringn (j, "command", (const char *) e->cmd, e->cmd_len);
+         ja_base16 (j, "data", e->data, e->len);
+         ja_error ("comms", j);
       }
-      jo_t j = jo_comms_alloc ();
-      jo_bool (j, "loopback", 1);
-      revk_error ("comms", &j);
-      return RES_OK;
+      break;
+   case S21_EV_RESPONSE:
+      if (s21debug)
+      {
+         char tag[3] = { e->cmd[0], e->cmd[1] };
+         if (debughex)
+            jo_base16 (s21debug, tag, e->data, e->len);
+         else
+            jo_stringn (s21debug, tag, (char *) e->data, e->len);
+      }
+      break;
    }
-   b.loopback = 0;
-   // If we've got an STX, S21 protocol is now confirmed; we won't change it any more
-   if (buf[0] == STX && !protocol_set)
-      protocol_found ();
-   // An expected S21 reply contains the first character of the command
-   // incremented by 1, the second character is left intact
-   if (!snoop && !is_valid_s21_response (buf, rxlen, cmd + 1, cmd2))
-   {                            // Malformed response, no proper S21
-      daikin.talking = 0;       // Protocol is broken, will restart communication
-      jo_t j = jo_comms_alloc ();
-      if (buf[0] != STX)
-         jo_bool (j, "badhead", 1);
-      if (buf[1] != cmd + 1 || buf[2] != cmd2)
-         jo_bool (j, "mismatch", 1);
-      return s21_bad (j);
+}
+
+static const s21_sink_t s21_sink = {
+   .report_uint8 = s21_report_uint8,
+   .report_int = s21_report_int,
+   .report_temp = s21_report_temp,
+   .report_string = s21_report_string,
+   .get_uint8 = s21_get_uint8,
+   .get_temp = s21_get_temp,
+   .event = s21_event,
+};
+
+s21_engine_t s21 = {
+   .transport = &s21_uart,
+   .sink = &s21_sink,
+};
+
+int
+daikin_s21_command (uint8_t cmd, uint8_t cmd2, int payload_len, char *payload)
+{
+   if (debug && payload_len > 2 && !b.dumping)
+   {
+      ja_t *j = ja_s21 (cmd, cmd2, payload, payload_len);
+      ja_info (daikin.talking || protofix ? "tx" : "cannot-tx", j);
    }
-   return daikin_s21_response (buf + S21_CMD0_OFFSET, rxlen - S21_MIN_PKT_LEN, buf + S21_PAYLOAD_OFFSET);
+   if (!daikin.talking && !protofix)
+      return RES_WAIT;          // Failed
+   s21.read_timeout = (probing ()? PROBE_TIMEOUT_MS : 0);
+   char name[3] = { cmd, cmd2 };
+   s21_stat = bus_stats_find (name);
+   s21_result = BUS_OK;
+   int res = s21_command (&s21, cmd, cmd2, payload_len, payload);
+   bus_stats_result (s21_stat, s21_result);
+   s21_stat = NULL;
+   return res;
 }
 
-void
+// Timeout between bytes of X50A frame, a byte takes ~1ms at 9600 baud
+#define X50A_BYTE_TIMEOUT_MS 10
+
+static int
+daikin_x50a_read (uint8_t * buf, int size, TickType_t timeout)
+{                               // Read a frame. Header first, then exactly as many bytes as its length says
+   int rxlen = uart_read_bytes (uart, buf, 3, timeout);
+   if (rxlen < 3)
+      return rxlen;
+   int want = buf[2];
+   TickType_t wait = (X50A_BYTE_TIMEOUT_MS * (want - 3) + portTICK_PERIOD_MS - 1) / portTICK_PERIOD_MS;
+   if (want < 6 || want > size)
+   {                            // Not a sensible length, take whatever comes in the original time, checks will fail
+      want = size;
+      wait = timeout;
+   }
+   int got = uart_read_bytes (uart, buf + 3, want - 3, wait);
+   if (got > 0)
+      rxlen += got;
+   return rxlen;
+}
+
+int
 daikin_x50a_command (uint8_t cmd, int txlen, uint8_t * payload)
-{                               // Send a command and get response
+{                               // Send a command and get response, returns RES_xxx
    if (debug && txlen)
    {
-      jo_t j = jo_comms_alloc ();
-      jo_stringf (j, "cmd", "%02X", cmd);
-      jo_base16 (j, "payload", payload, txlen);
-      revk_info (daikin.talking || protofix ? "tx" : "cannot-tx", &j);
+      ja_t *j = ja_comms ();
+      ja_stringf (j, "cmd", "%02X", cmd);
+      ja_base16 (j, "payload", payload, txlen);
+      ja_info (daikin.talking || protofix ? "tx" : "cannot-tx", j);
    }
    if (!daikin.talking && !protofix)
-      return;                   // Failed
+      return RES_WAIT;          // Failed
    uint8_t buf[256];
    buf[0] = 0x06;
    buf[1] = cmd;
@@ -1282,23 +1432,30 @@ daikin_x50a_command (uint8_t cmd, int txlen, uint8_t * payload)
    buf[5 + txlen] = ~c;
    if (b.dumping)
    {
-      jo_t j = jo_comms_alloc ();
-      jo_base16 (j, "dump", buf, txlen + 6);
-      revk_info ("tx", &j);
+      ja_t *j = ja_comms ();
+      ja_base16 (j, "dump", buf, txlen + 6);
+      ja_info ("tx", j);
    }
+   char name[3];
+   sprintf (name, "%02X", cmd);
+   bus_stat_t *stat = bus_stats_find (name);
+   int64_t sent = esp_timer_get_time ();
    uart_write_bytes (uart, (char *)buf, 6 + txlen);
    // Wait for reply
-   int rxlen = uart_read_bytes (uart, buf, sizeof (buf), READ_TIMEOUT);
+   int rxlen = daikin_x50a_read (buf, sizeof (buf), probing ()? PROBE_TIMEOUT_MS / portTICK_PERIOD_MS : READ_TIMEOUT);
    if (rxlen <= 0)
    {
+      bus_stats_result (stat, BUS_TIMEOUT);
       comm_timeout (NULL, 0);
-      return;
+      return RES_TIMEOUT;
    }
+   if (stat)
+      bus_stats_time (&stat->reply, esp_timer_get_time () - sent);
    if (b.dumping)
    {
-      jo_t j = jo_comms_alloc ();
-      jo_base16 (j, "dump", buf, rxlen);
-      revk_info ("rx", &j);
+      ja_t *j = ja_comms ();
+      ja_base16 (j, "dump", buf, rxlen);
+      ja_info ("rx", j);
    }
    // Check checksum
    c = 0;
@@ -1307,52 +1464,279 @@ daikin_x50a_command (uint8_t cmd, int txlen, uint8_t * payload)
    if (c != 0xFF)
    {
       daikin.talking = 0;
+      bus_stats_result (stat, BUS_BADSUM);
       comm_badcrc (c, buf, rxlen);
-      return;
+      return RES_BAD;
    }
    // Process response
    if (rxlen < 6 || buf[0] != 0x06 || buf[1] != cmd || buf[2] != rxlen || buf[3] != 1)
    {                            // Basic checks
       daikin.talking = 0;
-      jo_t j = jo_comms_alloc ();
+      bus_stats_result (stat, BUS_BAD);
+      ja_t *j = ja_comms ();
       if (buf[0] != 0x06)
-         jo_bool (j, "badhead", 1);
+         ja_bool (j, "badhead", 1);
       if (buf[1] != cmd)
-         jo_bool (j, "mismatch", 1);
+         ja_bool (j, "mismatch", 1);
       if (buf[2] != rxlen || rxlen < 6)
-         jo_bool (j, "badrxlen", 1);
+         ja_bool (j, "badrxlen", 1);
       if (buf[3] != 1)
-         jo_bool (j, "badform", 1);
-      jo_base16 (j, "data", buf, rxlen);
-      revk_error ("comms", &j);
-      return;
+         ja_bool (j, "badform", 1);
+      ja_base16 (j, "data", buf, rxlen);
+      ja_error ("comms", j);
+      return RES_BAD;
    }
    if (!buf[4])
    {                            // Tx sends 00 here, rx is 06
       daikin.talking = 0;
+      bus_stats_result (stat, BUS_LOOPBACK);
       if (!b.loopback)
       {
          ESP_LOGE (TAG, "Loopback");
          b.loopback = 1;
          revk_blink (0, 0, "RGB");
       }
-      jo_t j = jo_comms_alloc ();
-      jo_bool (j, "loopback", 1);
-      revk_error ("comms", &j);
-      return;
+      ja_t *j = ja_comms ();
+      ja_bool (j, "loopback", 1);
+      ja_error ("comms", j);
+      return RES_BAD;
    }
    b.loopback = 0;
    if (buf[0] == 0x06 && !protocol_set && buf[1] != 0xFF)
       protocol_found ();
    if (buf[1] == 0xFF)
    {                            // Error report
-      jo_t j = jo_comms_alloc ();
-      jo_bool (j, "fault", 1);
-      jo_base16 (j, "data", buf, rxlen);
-      revk_error ("comms", &j);
-      return;
+      bus_stats_result (stat, BUS_NAK);
+      ja_t *j = ja_comms ();
+      ja_bool (j, "fault", 1);
+      ja_base16 (j, "data", buf, rxlen);
+      ja_error ("comms", j);
+      return RES_NAK;
    }
+   bus_stats_result (stat, BUS_OK);
+   uint16_t hash = 0;
+   for (int i = 5; i < rxlen - 1; i++)
+      hash = hash * 33 + buf[i];
+   x50a_rx_hash = hash;
    daikin_x50a_response (cmd, rxlen - 6, buf + 5);
+   return RES_OK;
+}
+
+static void
+daikin_s21_send_control (uint8_t cmd2, char *payload)
+{                               // Send D command, unless the unit has already acknowledged exactly this
+   if (s21_control_differs (&s21, cmd2, payload))
+      daikin_s21_command ('D', cmd2, S21_PAYLOAD_LEN, payload);
+}
+
+void
+daikin_s21_control (void)
+{                               // Send new values, requested by the user, if any
+   char temp[5];
+   if (daikin.control_changed & (CONTROL_power | CONTROL_mode | CONTROL_temp | CONTROL_fan))
+   {                            // D1
+      xSemaphoreTake (daikin.mutex, portMAX_DELAY);
+      temp[0] = daikin.power ? '1' : '0';
+      temp[1] = ("64300002"[daikin.mode]);  // FHCA456D mapped to AXDCHXF
+      if (daikin.mode == 1 || daikin.mode == 2 || daikin.mode == 3)
+         temp[2] = s21_encode_target_temp (daikin.temp);
+      else
+         temp[2] = AC_MIN_TEMP_VALUE;       // No temp in other modes
+      temp[3] = ("A34567B"[daikin.fan]);
+      daikin_s21_send_control ('1', temp);
+      xSemaphoreGive (daikin.mutex);
+   }
+   if (daikin.control_changed & (CONTROL_swingh | CONTROL_swingv))
+   {                            // D5
+      xSemaphoreTake (daikin.mutex, portMAX_DELAY);
+      temp[0] = '0' + (daikin.swingh ? 2 : 0) + (daikin.swingv ? 1 : 0) + (daikin.swingh && daikin.swingv ? 4 : 0);
+      temp[1] = (daikin.swingh || daikin.swingv ? '?' : '0');
+      temp[2] = '0';
+      temp[3] = '0';
+      daikin_s21_send_control ('5', temp);
+      xSemaphoreGive (daikin.mutex);
+   }
+   if (daikin.control_changed & (CONTROL_powerful | CONTROL_comfort | CONTROL_streamer |
+                                 CONTROL_sensor | CONTROL_quiet | CONTROL_led))
+   {                            // D6
+      xSemaphoreTake (daikin.mutex, portMAX_DELAY);
+      if (!s21.F6.bad)
+      {
+         temp[0] = '0' + (daikin.powerful ? 2 : 0) + (daikin.comfort ? 0x40 : 0) + (daikin.quiet ? 0x80 : 0);
+         temp[1] = '0' + (daikin.streamer ? 0x80 : 0);
+         temp[2] = '0';
+         // If sensor, the 8 is sensor, if not, then 4 and 8 are LED, with 4=high, 8=low, 12=off
+         if (noled || !nosensor)
+            temp[3] = '0' + (daikin.sensor ? 0x08 : 0) + (daikin.led ? 0x04 : 0);   // Messy but gives some controls
+         else
+            temp[3] = '0' + (daikin.led ? dark ? 8 : 4 : 12);
+         // FIXME: ATX20K2V1B responds NAK to this command, but also doesn't react on D3.
+         // Looks like it supports something else, we don't know what.
+         // https://github.com/revk/ESP32-Faikin/issues/441
+         daikin_s21_send_control ('6', temp);
+      } else if (!s21.F3.bad)
+      {                         // F3 or F6 depends on model
+         // Actually many ACs (tested on FTXF20D5V1B and ATX20K2V1B) respond to
+         // both F3 and F6, but F3 does not report "powerful" state, so we give
+         // F6 a preference.
+         // The current code assumes that only units, which don't respond to F6
+         // at all, will report the flag in F3, and require D3 to control.
+         // This suggestion must be true, because otherwise commit 0c5f769, which
+         // introduced support for F3, wouldn't have worked, being overriden by F6
+         // due to how poll sequence is organized.
+         temp[0] = '0';
+         temp[1] = '0';
+         temp[2] = '0';
+         temp[3] = '0' + (daikin.powerful ? 2 : 0);
+         daikin_s21_send_control ('3', temp);
+      }
+      xSemaphoreGive (daikin.mutex);
+   }
+   if (daikin.control_changed & (CONTROL_demand | CONTROL_econo))
+   {                            // D7
+      xSemaphoreTake (daikin.mutex, portMAX_DELAY);
+      temp[0] = '0' + 100 - daikin.demand;
+      temp[1] = '0' + (daikin.econo ? 2 : 0);
+      temp[2] = '0';
+      temp[3] = '0';
+      daikin_s21_send_control ('7', temp);
+      xSemaphoreGive (daikin.mutex);
+   }
+}
+
+static uint8_t s21_caps_loaded = 0;     // Capability map loaded from settings, not checked against the unit yet
+static uint8_t s21_caps_full = 0;       // Poll everything known to work in one go, nothing needs probing
+static uint8_t s21_caps_wrong = 0;      // Stored capability map is for another unit
+
+void
+daikin_s21_caps_load (void)
+{                               // Apply stored capability map, saves probing all the commands on a known unit
+   s21_caps_loaded = s21_caps_full = 0;
+   if (!s21caps || s21_caps_wrong)
+      return;
+   const char *map = strchr (s21caps, ' ');     // Model/version comes first
+   if (map && s21_caps_load (&s21, map))
+      s21_caps_loaded = s21_caps_full = 1;
+}
+
+void
+daikin_s21_caps (void)
+{                               // Check the stored capability map is for this unit, and store what we have learned
+   if (!s21.FC.ack && !s21.FC.bad)
+      return;                   // Model not known yet
+   if (!s21.FY00.ack && !s21.F8.ack && !(s21.FY00.bad && s21.F8.bad))
+      return;                   // Protocol version not known yet
+   char caps[200];
+   int len = snprintf (caps, sizeof (caps), "%s/%d.%d", s21.FC.ack ? daikin.model : "", s21.protocol_major,
+                       s21.protocol_minor);
+   for (char *c = caps; *c; c++)
+      if (*c == ' ')
+         *c = '_';              // Space separates the map
+   if (s21_caps_loaded)
+   {
+      s21_caps_loaded = 0;
+      if (strncmp (s21caps, caps, len) || s21caps[len] != ' ')
+      {                         // Stored map is for another unit, start from scratch
+         s21_caps_wrong = 1;
+         s21_poll_reset (&s21);
+         return;
+      }
+   }
+   if (!s21_caps_settled (&s21) || !s21_caps_save (&s21, caps + len + 1, sizeof (caps) - len - 1))
+      return;
+   caps[len] = ' ';
+   if (s21caps && !strcmp (s21caps, caps))
+      return;                   // Already stored
+   s21_caps_wrong = 0;
+   jo_t j = jo_object_alloc ();
+   jo_string (j, "s21caps", caps);
+   revk_settings_store (j, NULL, 1);
+   jo_free (&j);
+}
+
+void
+daikin_s21_poll (void)
+{                               // Poll the AC status
+   // The scheduler gives us what is due, most important first, backing off on values which don't change.
+   // Each command has a smart NAK counter, which allows for autodetecting unsupported commands
+   uint32_t now = esp_timer_get_time () / 1000;
+   const s21_poll_def_t *p;
+   int budget = (s21_caps_full ? S21_POLL_MAX : S21_POLL_BUDGET);
+   s21_caps_full = 0;
+   s21.debug = debug;
+   for (int n = 0; n < budget && daikin.talking && (p = s21_poll_next (&s21, now)); n++)
+      s21_poll_done (&s21, p, now, daikin_s21_command (p->cmd[0], p->cmd[1], strlen (p->payload), (char *) p->payload));
+   if (!daikin.talking)
+   {
+      s21_poll_reset (&s21);
+      daikin_s21_caps_load ();
+   }
+}
+
+void
+daikin_x50a_control (void)
+{                               // Send pending controls. CA also reports status, so it counts as a CA refresh
+   if (!daikin.control_changed)
+      return;
+   uint8_t ca[17] = { 0 };
+   uint8_t cb[2] = { 0 };
+   xSemaphoreTake (daikin.mutex, portMAX_DELAY);
+   ca[0] = 2 + daikin.power;
+   ca[1] = 0x10 + daikin.mode;
+   if (daikin.mode >= 1 && daikin.mode <= 3)
+   {                            // Temp
+      int t = ctemp_round (daikin.temp, CTEMP (0.1)) / CTEMP (0.1);
+      ca[3] = t / 10;
+      ca[4] = 0x80 + (t % 10);
+   } else
+      daikin.control_changed &= ~CONTROL_temp;
+   cb[0] = x50a_cb_mode (daikin.mode);
+   cb[1] = 0x80 + ((daikin.fan & 7) << 4);
+   uint8_t fan = ((daikin.control_changed & (CONTROL_fan | CONTROL_mode)) ? 1 : 0);
+   xSemaphoreGive (daikin.mutex);
+   poll_sched_start (&x50a_sched, esp_timer_get_time () / 1000);
+   int res = daikin_x50a_command (0xCA, sizeof (ca), ca);
+   poll_sched_done (&x50a_sched, 0, res == RES_OK, res == RES_NAK, x50a_rx_hash);
+   if (fan && (!x50a_cb_valid || memcmp (cb, x50a_cb, sizeof (cb))))
+   {                            // The unit does not have this fan setting yet
+      if (daikin_x50a_command (0xCB, sizeof (cb), cb) == RES_OK)
+      {
+         memcpy (x50a_cb, cb, sizeof (cb));
+         x50a_cb_valid = 1;
+      }
+      poll_sched_expedite (&x50a_sched, 0);     // Read back by CA in the poll that follows
+   }
+}
+
+void
+daikin_x50a_poll (void)
+{                               // Refresh what is due, most overdue first
+   poll_sched_start (&x50a_sched, esp_timer_get_time () / 1000);
+   int n;
+   while (daikin.talking && (n = poll_sched_next (&x50a_sched)) >= 0)
+   {
+      uint8_t ca[17] = { 0 };   // No changes, just status
+      int res = daikin_x50a_command (x50a_polls[n].code, x50a_polls[n].code == 0xCA ? sizeof (ca) : 0, ca);
+      poll_sched_done (&x50a_sched, n, res == RES_OK, res == RES_NAK, x50a_rx_hash);
+   }
+   if (!daikin.talking)
+   {                            // Start again, and make sure controls go out
+      poll_sched_reset (&x50a_sched);
+      x50a_cb_valid = 0;
+   }
+}
+
+void
+daikin_send_controls (void)
+{                               // Send control changes right away, not waiting for poll cycle
+   if (!daikin.control_changed || !daikin.talking || !uart_enabled ())
+      return;
+   if (proto_type () == PROTO_TYPE_S21)
+   {
+      daikin_s21_control ();
+      daikin_s21_poll ();       // Read back what we have set
+   } else if (proto_type () == PROTO_TYPE_X50A)
+      daikin_x50a_control ();
 }
 
 // The following two functions are reused also for parsing control requests
@@ -1379,8 +1763,11 @@ auto_mode_control_item(const char *tag, const char *val, jo_t s)
    {                         // Stored settings
       if (!s)
          s = jo_object_alloc ();
-      jo_int (s, tag, lroundf (strtof (val, NULL) * 10.0));
+      int t = ctemp_parse (val);
+      if (t != CTEMP_NONE)
+         jo_centi (s, tag, t, 1);
       daikin.status_changed = 1;
+      daikin.status_extras = 1;
    }
 #ifdef ELA
    if (!strcmp (tag, "autob"))
@@ -1418,7 +1805,7 @@ daikin_control (jo_t j)
       t = jo_next (j);
       jo_strncpy (j, val, sizeof (val));
 #define	b(name)		if(!strcmp(tag,#name)&&(t==JO_TRUE||t==JO_FALSE))err=daikin_set_v(name,t==JO_TRUE?1:0);
-#define	t(name)		if(!strcmp(tag,#name)&&t==JO_NUMBER)err=daikin_set_t(name,strtof(val,NULL));
+#define	t(name)		if(!strcmp(tag,#name)&&t==JO_NUMBER)err=daikin_set_t(name,ctemp_parse(val));
 #define	i(name)		if(!strcmp(tag,#name)&&t==JO_NUMBER)err=daikin_set_i(name,atoi(val));
 #define	e(name,values)	if(!strcmp(tag,#name)&&t==JO_STRING)err=daikin_set_e(name,val);
 #include "accontrols.m"
@@ -1466,9 +1853,9 @@ mqtt_client_callback (int client, const char *prefix, const char *target, const
    }
    if (!strcmp (suffix, "control"))
    {                            // Control, e.g. from environmental monitor
-      float env = NAN;
-      float min = NAN;
-      float max = NAN;
+      int env = CTEMP_NONE;
+      int min = CTEMP_NONE;
+      int max = CTEMP_NONE;
       jo_type_t t = jo_next (j);        // Start object
       while (t == JO_TAG)
       {
@@ -1478,7 +1865,7 @@ mqtt_client_callback (int client, const char *prefix, const char *target, const
          t = jo_next (j);
          jo_strncpy (j, val, sizeof (val));
          if (!strcmp (tag, "env"))
-            env = strtof (val, NULL);
+            env = ctemp_parse (val);
          else if (!strcmp (tag, "target"))
          {
             if (jo_here (j) == JO_ARRAY)
@@ -1487,13 +1874,13 @@ mqtt_client_callback (int client, const char *prefix, const char *target, const
                if (jo_here (j) == JO_NUMBER)
                {
                   jo_strncpy (j, val, sizeof (val));
-                  min = strtof (val, NULL);
+                  min = ctemp_parse (val);
                   jo_next (j);
                }
                if (jo_here (j) == JO_NUMBER)
                {
                   jo_strncpy (j, val, sizeof (val));
-                  max = strtof (val, NULL);
+                  max = ctemp_parse (val);
                   jo_next (j);
                }
                while (jo_here (j) > JO_CLOSE)
@@ -1501,10 +1888,10 @@ mqtt_client_callback (int client, const char *prefix, const char *target, const
                t = jo_next (j); // Pass the close
                continue;        // As we passed the close, don't skip}
             } else
-               min = max = strtof (val, NULL);
+               min = max = ctemp_parse (val);
          }
 #define	b(name)		else if(!strcmp(tag,#name)){if(t!=JO_TRUE&&t!=JO_FALSE)ret= "Expecting boolean";else ret=daikin_set_v(name,t==JO_TRUE?1:0);}
-#define	t(name)		else if(!strcmp(tag,#name)){if(t!=JO_NUMBER)ret= "Expecting number";else ret=daikin_set_t(name,jo_read_float(j));}
+#define	t(name)		else if(!strcmp(tag,#name)){if(t!=JO_NUMBER)ret= "Expecting number";else ret=daikin_set_t(name,ctemp_parse(val));}
 #define	i(name)		else if(!strcmp(tag,#name)){if(t!=JO_NUMBER)ret= "Expecting number";else ret=daikin_set_i(name,jo_read_int(j));}
 #define	e(name,values)	else if(!strcmp(tag,#name)){if(t!=JO_STRING)ret= "Expecting string";else ret=daikin_set_e(name,val);}
 #include "accontrols.m"
@@ -1520,11 +1907,16 @@ mqtt_client_callback (int client, const char *prefix, const char *target, const
       }
       if (!ble_sensor_connected ())
       {
+         if (daikin.env != env)
+            daikin.status_dirty |= CONTROL_env;
          daikin.env = env;
          daikin.status_known |= CONTROL_env;    // So we report it
       }
-      if (!autor && !ble_sensor_enabled ())
+      if (!autor && !ble_sensor_enabled () && !daikin.remote)
+      {
          daikin.remote = 1;     // Hides local automation settings
+         daikin.status_extras = 1;
+      }
       xSemaphoreGive (daikin.mutex);
       return ret ? : "";
    }
@@ -1563,7 +1955,9 @@ mqtt_client_callback (int client, const char *prefix, const char *target, const
          if (autor)
          {                      // Setting the control
             jo_t s = jo_object_alloc ();
-            jo_litf (s, "autot", "%.1f", atof (value));
+            int t = ctemp_parse (value);
+            if (t != CTEMP_NONE)
+               jo_centi (s, "autot", t, 1);
             revk_settings_store (s, NULL, 1);
             jo_free (&s);
          } else
@@ -1633,43 +2027,69 @@ mqtt_client_callback (int client, const char *prefix, const char *target, const
    return ret;
 }
 
-jo_t
-daikin_status (void)
+enum
 {
-   xSemaphoreTake (daikin.mutex, portMAX_DELAY);
-   jo_t j = jo_comms_alloc ();
-#define b(name)         if(daikin.status_known&CONTROL_##name)jo_bool(j,#name,daikin.name);
-#define t(name)         if(daikin.status_known&CONTROL_##name){if(isnan(daikin.name)||daikin.name>=100)jo_null(j,#name);else jo_litf(j,#name,"%.1f",daikin.name);}
-#define i(name)         if(daikin.status_known&CONTROL_##name)jo_int(j,#name,daikin.name);
-#define e(name,values)  if((daikin.status_known&CONTROL_##name)&&daikin.name<sizeof(CONTROL_##name##_VALUES)-1)jo_stringf(j,#name,"%c",CONTROL_##name##_VALUES[daikin.name]);
-#define s(name,len)     if((daikin.status_known&CONTROL_##name)&&*daikin.name)jo_string(j,#name,daikin.name);
+   STATUS_WEB,                  // All known fields, for /status
+   STATUS_SEND,                 // All known fields, sent as state/status
+   STATUS_DELTA,                // Only fields changed since last sent, as state/delta, null if no longer known
+};
+
+static void
+ja_status (ja_t * j, void *ctx)
+{                               // Status fields, daikin.mutex held
+   uint8_t mode = *(uint8_t *) ctx;
+   ja_protocol (j);
+   uint64_t which = (mode == STATUS_DELTA ? daikin.status_dirty : daikin.status_known);
+#define b(name)         if(which&CONTROL_##name){if(!(daikin.status_known&CONTROL_##name))ja_null(j,#name);else ja_bool(j,#name,daikin.name);}
+#define t(name)         if(which&CONTROL_##name){if(!(daikin.status_known&CONTROL_##name)||daikin.name==CTEMP_NONE||daikin.name>=CTEMP(100))ja_null(j,#name);else ja_centi(j,#name,daikin.name,1);}
+#define i(name)         if(which&CONTROL_##name){if(!(daikin.status_known&CONTROL_##name))ja_null(j,#name);else ja_int(j,#name,daikin.name);}
+#define e(name,values)  if(which&CONTROL_##name){if(!(daikin.status_known&CONTROL_##name)||daikin.name>=sizeof(CONTROL_##name##_VALUES)-1)ja_null(j,#name);else ja_stringf(j,#name,"%c",CONTROL_##name##_VALUES[daikin.name]);}
+#define s(name,len)     if((which&CONTROL_##name)&&*daikin.name)ja_string(j,#name,daikin.name);
 #include "acextras.m"
+   if (mode == STATUS_DELTA && !daikin.status_extras)
+      return;                   // Nothing else has changed
 #ifdef	ELA
    if (bletemp && !bletemp->missing)
    {
-      jo_object (j, "ble");
+      ja_object (j, "ble");
       if (bletemp->tempset)
-         jo_litf (j, "temp", "%.2f", bletemp->temp / 100.0);
+         ja_litf (j, "temp", "%.2f", bletemp->temp / 100.0);
       if (bletemp->humset)
-         jo_litf (j, "hum", "%.2f", bletemp->hum / 100.0);
+         ja_litf (j, "hum", "%.2f", bletemp->hum / 100.0);
       if (bletemp->batset)
-         jo_int (j, "bat", bletemp->temp);
+         ja_int (j, "bat", bletemp->temp);
       if (bletemp->voltset)
-         jo_litf (j, "volt", "%.2f", bletemp->volt / 100.0);
-      jo_close (j);
+         ja_litf (j, "volt", "%.2f", bletemp->volt / 100.0);
+      ja_close (j);
    }
    if (ble && *autob)
-      jo_string (j, "autob", autob);
+      ja_string (j, "autob", autob);
 #endif
    if (daikin.remote)
-      jo_bool (j, "remote", 1);
+      ja_bool (j, "remote", 1);
    else
    {
-      jo_litf (j, "autor", "%.1f", (float) autor / autor_scale);
-      jo_litf (j, "autot", "%.1f", (float) autot / autot_scale);
-      jo_stringf (j, "auto0", "%02d:%02d", auto0 / 100, auto0 % 100);
-      jo_stringf (j, "auto1", "%02d:%02d", auto1 / 100, auto1 % 100);
-      jo_bool (j, "autop", autop);
+      ja_centi (j, "autor", CTEMP_SETTING (autor), 1);
+      ja_centi (j, "autot", CTEMP_SETTING (autot), 1);
+      ja_stringf (j, "auto0", "%02d:%02d", auto0 / 100, auto0 % 100);
+      ja_stringf (j, "auto1", "%02d:%02d", auto1 / 100, auto1 % 100);
+      ja_bool (j, "autop", autop);
+   }
+}
+
+ja_t *
+daikin_status (uint8_t mode)
+{
+   xSemaphoreTake (daikin.mutex, portMAX_DELAY);
+   ja_t *j;
+   if (mode == STATUS_WEB)      // Web server task, so not the daikin task's buffer
+      j = ja_build_heap (JSON_ARENA_STATUS, ja_status, &mode);
+   else
+      j = ja_build (JSON_ARENA_STATUS, ja_status, &mode);
+   if (mode != STATUS_WEB)
+   {                            // Sent, so nothing is pending
+      daikin.status_dirty = 0;
+      daikin.status_extras = 0;
    }
    xSemaphoreGive (daikin.mutex);
    return j;
@@ -1783,6 +2203,12 @@ web_root (httpd_req_t * req)
       addt ("Liquid", "Liquid coolant temperature");
    if (daikin.status_known & CONTROL_outside)
       addt ("Outside", "Outside temperature");
+   if (daikin.status_known & CONTROL_flowtemp)
+      addt ("Flow", "Leaving water temperature");
+   if (daikin.status_known & CONTROL_returntemp)
+      addt ("Return", "Return water temperature");
+   if (daikin.status_known & CONTROL_tank)
+      addt ("Tank", "Hot water tank temperature");
    if ((daikin.status_known & CONTROL_env) && !ble_sensor_connected ())
       addt ("Env", "External reference temperature");
 #ifdef ELA
@@ -1837,6 +2263,8 @@ web_root (httpd_req_t * req)
                   "<p id=slave style='display:none'>❋ Another unit is controlling the mode, so this unit is not operating at present.</p>"    //
                   "<p id=control style='display:none'>✷ Automatic control means some functions are limited.</p>"      //
                   "<p id=antifreeze style='display:none'>❄ System is in anti-freeze now, so cooling is suspended.</p>");
+   if (history)
+      revk_web_send (req, "<canvas id=hist width=600 height=200 style='display:none;max-width:100%%;background:#fff;'></canvas>");
 
    if (autor || ble_sensor_connected () || (!nofaikinauto && !daikin.remote))
    {
@@ -1938,6 +2366,9 @@ web_root (httpd_req_t * req)
                   "t('Env',o.env);"     //
                   "t('Outside',o.outside);"     //
                   "t('Liquid',o.liquid);"       //
+                  "t('Flow',o.flowtemp);"       //
+                  "t('Return',o.returntemp);"   //
+                  "t('Tank',o.tank);"   //
                   "if(o.ble)t('BLE',o.ble.temp);"       //
                   "if(o.ble)s('Hum',o.ble.hum?o.ble.hum+'%%':'');"      //
                   "n('demand',o.demand);"       //
@@ -1974,10 +2405,55 @@ web_root (httpd_req_t * req)
                      "xhttp.open('GET', '/status', true);"
                      "xhttp.send();"
                   "}"
+                  "function hist()"
+                  "{"    // Chart temperatures from /history.csv
+                     "var x=new XMLHttpRequest();"
+                     "x.onreadystatechange=function(){if(this.readyState==4&&this.status==200)chart(this.responseText);};"
+                     "x.open('GET','/history.csv',true);"
+                     "x.send();"
+                  "}"
+                  "function chart(csv)"
+                  "{"
+                     "var l=csv.trim().split('\\n').map(function(r){return r.trim().split(',');}),hd=l.shift();"
+                     "if(l.length<2)return;"
+                     "var names=['home','inlet','outside','liquid','env','temp','flowtemp','returntemp','tank'],"
+                     "cols=['#c00','#f80','#08c','#888','#0a0','#000','#c0c','#0cc','#840'],"
+                     "lo=1e9,hi=-1e9,set=[];"
+                     "names.forEach(function(n,k){"
+                        "var i=hd.indexOf(n);if(i<0)return;"
+                        "var p=l.map(function(r){return r[i]===''?null:+r[i];});"
+                        "if(p.every(function(v){return v==null;}))return;"
+                        "p.forEach(function(v){if(v!=null){lo=Math.min(lo,v);hi=Math.max(hi,v);}});"
+                        "set.push([n,cols[k],p]);"
+                     "});"
+                     "if(!set.length)return;"
+                     "lo=Math.floor(lo)-1;hi=Math.ceil(hi)+1;"
+                     "var c=g('hist'),d=c.getContext('2d'),W=c.width,H=c.height-12,"
+                     "t=l.map(function(r){return Date.parse(r[0]);}),t0=t[0],t1=t[t.length-1];"
+                     "c.style.display='block';"
+                     "d.clearRect(0,0,W,c.height);"
+                     "d.font='10px sans-serif';"
+                     "d.fillStyle='#000';"
+                     "d.fillText(cf(hi),2,10);d.fillText(cf(lo),2,H);"
+                     "d.fillText(new Date(t0).toLocaleTimeString(),40,H+11);"
+                     "set.forEach(function(s,k){"
+                        "d.strokeStyle=d.fillStyle=s[1];"
+                        "d.fillText(s[0],40+k*60,10);"
+                        "d.beginPath();"
+                        "var m=0;"
+                        "s[2].forEach(function(v,i){"
+                           "if(v==null||(i&&t[i]-t[i-1]>120000)){m=0;if(v==null)return;}"  // Gap
+                           "var x=(t[i]-t0)*W/(t1-t0||1),y=H-(v-lo)*(H-12)/(hi-lo);"
+                           "if(m)d.lineTo(x,y);else d.moveTo(x,y);m=1;"
+                        "});"
+                        "d.stroke();"
+                     "});"
+                  "}"
                   "function handleLoad()"
                   "{"
                      "c();"
                      "window.setInterval(c, 1000);"
+                     "if(g('hist')){hist();window.setInterval(hist,60000);}"
                   "}"
                   "</script>", fahrenheit ? "Math.round(10*((v*9/5)+32))/10+'℉'" : "v+'℃'");
    return revk_web_foot (req, 0, websettings, protocol_set ? proto_name () : NULL);
@@ -2003,27 +2479,247 @@ web_root (httpd_req_t * req)
 
 // Our own JSON-based control interface starts here
 
+static void
+ja_bus_hist (ja_t * j, const char *tag, const bus_hist_t * h)
+{                               // Latency histogram, counts per bucket
+   if (!h->max && !h->count[0])
+      return;                   // Nothing
+   ja_object (j, tag);
+   ja_array (j, "count");
+   for (int i = 0; i < BUS_STATS_BUCKETS; i++)
+      ja_int (j, NULL, h->count[i]);
+   ja_close (j);
+   ja_int (j, "max", h->max);
+   ja_close (j);
+}
+
+static struct
+{                               // Time spent each time round the main loop, talking to the AC included, waiting for the next second not
+   uint32_t cycles;
+   uint32_t total;              // us
+   uint32_t max;                // us
+} loop_cpu;
+
+static void
+ja_report (ja_t * j, void *ctx)
+{                               // Environment report, from stats since the last one
+   time_t clock = *(time_t *) ctx;
+   ja_protocol (j);
+   {                            // Timestamp
+      struct tm tm;
+      gmtime_r (&clock, &tm);
+      ja_stringf (j, "ts", "%04d-%02d-%02dT%02d:%02d:%02dZ", tm.tm_year + 1900,
+                  tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec);
+   }
+#define	b(name)		if(daikin.status_known&CONTROL_##name){if(!stats.btrue[STATS_B_##name])ja_bool(j,#name,0);else if(fixstatus||stats.btrue[STATS_B_##name]==stats.samples)ja_bool(j,#name,1);else ja_centi(j,#name,ac_stats_bool_frac(&stats,STATS_B_##name),2);}
+#define	t(name)		if(stats.tcount[STATS_T_##name]){if(fixstatus||stats.tmin[STATS_T_##name]==stats.tmax[STATS_T_##name])ja_centi(j,#name,stats.tmin[STATS_T_##name],2);	\
+			else {ja_array(j,#name);ja_centi(j,NULL,stats.tmin[STATS_T_##name],2);ja_centi(j,NULL,ac_stats_temp_avg(&stats,STATS_T_##name),2);ja_centi(j,NULL,stats.tmax[STATS_T_##name],2);ja_close(j);}}
+#define	r(name)		if(daikin.min##name!=CTEMP_NONE&&daikin.max##name!=CTEMP_NONE){if(fixstatus||daikin.min##name==daikin.max##name)ja_centi(j,#name,daikin.min##name,2);	\
+			else {ja_array(j,#name);ja_centi(j,NULL,daikin.min##name,2);ja_centi(j,NULL,daikin.max##name,2);ja_close(j);}}
+#define	i(name)		if(daikin.status_known&CONTROL_##name){if(fixstatus||stats.imin[STATS_I_##name]==stats.imax[STATS_I_##name])ja_int(j,#name,ac_stats_int_avg(&stats,STATS_I_##name));     \
+                        else {ja_array(j,#name);ja_int(j,NULL,stats.imin[STATS_I_##name]);ja_int(j,NULL,ac_stats_int_avg(&stats,STATS_I_##name));ja_int(j,NULL,stats.imax[STATS_I_##name]);ja_close(j);}}
+#define e(name,values)  if((daikin.status_known&CONTROL_##name)&&daikin.name<sizeof(CONTROL_##name##_VALUES)-1)ja_stringf(j,#name,"%c",CONTROL_##name##_VALUES[daikin.name]);
+#include "acextras.m"
+}
+
+static void
+ja_bus_stats (ja_t * j, void *ctx)
+{                               // Per command bus statistics
+   static const char *const results[] = { BUS_RESULT_NAMES };
+   ja_protocol (j);
+   ja_array (j, "buckets");     // Upper limits (ms), last bucket is everything above
+   for (int i = 0; i < BUS_STATS_BUCKETS - 1; i++)
+      ja_int (j, NULL, bus_stats_limit[i]);
+   ja_close (j);
+   ja_object (j, "commands");
+   for (int n = 0; n < bus_stats_count; n++)
+   {
+      const bus_stat_t *s = &bus_stats[n];
+      ja_object (j, s->cmd);
+      for (int i = 0; i < BUS_RESULTS; i++)
+         if (s->result[i])
+            ja_int (j, results[i], s->result[i]);
+      ja_bus_hist (j, "ack", &s->ack);
+      ja_bus_hist (j, "reply", &s->reply);
+      ja_close (j);
+   }
+   ja_close (j);
+   if (proto_type () == PROTO_TYPE_CN_WIRED && protocol_set)
+      cn_wired_stats (j);       // Line level timings
+   if (proto_type () == PROTO_TYPE_S21 && s21_static_get (&s21, 0))
+   {                            // Static values read once, e.g. GU05 model name, raw
+      ja_object (j, "static");
+      const s21_static_t *v;
+      for (int n = 0; (v = s21_static_get (&s21, n)); n++)
+      {
+         char tag[S21_V3_COMMAND_LEN + 1];
+         memcpy (tag, v->cmd, S21_V3_COMMAND_LEN);
+         tag[S21_V3_COMMAND_LEN] = 0;
+         ja_base16 (j, tag, v->data, v->len);
+      }
+      ja_close (j);
+   }
+   if (loop_cpu.cycles)
+   {
+      ja_object (j, "cpu");
+      ja_int (j, "cycles", loop_cpu.cycles);
+      ja_int (j, "avg-us", loop_cpu.total / loop_cpu.cycles);
+      ja_int (j, "max-us", loop_cpu.max);
+      ja_close (j);
+   }
+   ja_array (j, "arena");       // Message buffers, status, report and comms
+   for (int n = 0; n < JSON_ARENA_SLOTS; n++)
+   {
+      const json_arena_stats_t *a = json_arena_stats (n);
+      ja_object (j, NULL);
+      ja_int (j, "size", a->size);
+      ja_int (j, "high", a->high);
+      ja_int (j, "uses", a->uses);
+      if (a->overflows)
+         ja_int (j, "overflows", a->overflows);
+      if (a->heap)
+         ja_int (j, "heap", a->heap);
+      ja_close (j);
+   }
+   ja_close (j);
+}
+
+static esp_err_t
+web_stats (httpd_req_t * req)
+{                               // Web server task, so on the heap, and it can be long
+   ja_t *j = ja_build_heap (JSON_ARENA_COMMS, ja_bus_stats, NULL);
+
+   httpd_resp_set_type (req, "application/json");
+
+   if (j) {
+      httpd_resp_sendstr (req, ja_finish (j));
+      ja_done (j);
+   } else {
+      httpd_resp_send (req, NULL, 0);
+   }
+
+   return ESP_OK;
+}
+
+static esp_err_t
+web_history (httpd_req_t * req)
+{                               // Binary, see ac_history_export()
+   if (!history)
+   {
+      httpd_resp_send_err (req, HTTPD_500_INTERNAL_SERVER_ERROR, "No history");
+      return ESP_OK;
+   }
+   httpd_resp_set_type (req, "application/octet-stream");
+   uint8_t buf[512];
+   ac_history_export_t e = { 0 };
+   int len;
+   do
+   {                            // A piece at a time, so as not to hold up the main loop while sending
+      xSemaphoreTake (daikin.mutex, portMAX_DELAY);
+      len = ac_history_export (history, &e, buf, sizeof (buf));
+      xSemaphoreGive (daikin.mutex);
+      if (len > 0 && httpd_resp_send_chunk (req, (const char *) buf, len) != ESP_OK)
+         return ESP_FAIL;
+   }
+   while (len > 0);
+   if (len < 0)
+      return ESP_FAIL;          // Overtaken, e.g. sending stalled for minutes, so drop it rather than end it as if whole
+   httpd_resp_send_chunk (req, NULL, 0);
+   return ESP_OK;
+}
+
+static esp_err_t
+web_history_csv (httpd_req_t * req)
+{                               // One line per minute, oldest first
+   if (!history)
+   {
+      httpd_resp_send_err (req, HTTPD_500_INTERNAL_SERVER_ERROR, "No history");
+      return ESP_OK;
+   }
+   httpd_resp_set_type (req, "text/csv");
+   char line[512];
+   int len = 0;
+   void add (const char *fmt, ...)
+   {
+      va_list ap;
+      va_start (ap, fmt);
+      int l = vsnprintf (line + len, sizeof (line) - len, fmt, ap);
+      va_end (ap);
+      if (l > 0)
+         len += l;
+      if (len >= sizeof (line))
+         len = sizeof (line) - 1;       // Truncated, should not happen
+   }
+   void addtemp (int32_t v)
+   {                            // 0.1C
+      if (v == CTEMP_NONE)
+         add (",");
+      else
+         add (",%s%d.%d", v < 0 ? "-" : "", abs (v) / 10, abs (v) % 10);
+   }
+   add ("time");
+#define	t(name)		add(","#name);
+#define	r(name)		add(",min"#name",max"#name);
+#define	i(name)		add(","#name);
+#define	e(name,values)	add(","#name);
+#define	b(name)		add(","#name);
+#include "acextras.m"
+   add ("\r\n");
+   ac_history_iter_t it;
+   // Locked for each sample only, so as not to hold up the main loop while sending
+   xSemaphoreTake (daikin.mutex, portMAX_DELAY);
+   int more = ac_history_first (history, &it);
+   xSemaphoreGive (daikin.mutex);
+   if (more)
+      do
+      {
+         if (len > sizeof (line) / 2)
+         {
+            if (httpd_resp_send_chunk (req, line, len) != ESP_OK)
+               return ESP_FAIL; // Gone, so stop rather than format the rest
+            len = 0;
+         }
+         time_t clock = it.s.minute * 60;
+         struct tm tm;
+         gmtime_r (&clock, &tm);
+         add ("%04d-%02d-%02dT%02d:%02dZ", tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min);
+#define	t(name)		addtemp(it.s.v[HISTORY_##name]);
+#define	r(name)		addtemp(it.s.v[HISTORY_min##name]);addtemp(it.s.v[HISTORY_max##name]);
+#define	i(name)		add(",%ld",(long)it.s.v[HISTORY_##name]);
+#define	e(name,values)	if(it.s.v[HISTORY_##name]>=0&&it.s.v[HISTORY_##name]<sizeof(CONTROL_##name##_VALUES)-1)add(",%c",CONTROL_##name##_VALUES[it.s.v[HISTORY_##name]]);else add(",");
+#define	b(name)		add(",%d",(it.s.v[HISTORY_BOOLS]>>HISTORY_B_##name)&1);
+#include "acextras.m"
+         add ("\r\n");
+         xSemaphoreTake (daikin.mutex, portMAX_DELAY);
+         more = ac_history_next (history, &it);
+         xSemaphoreGive (daikin.mutex);
+      }
+      while (more);
+   if (len && httpd_resp_send_chunk (req, line, len) != ESP_OK)
+      return ESP_FAIL;
+   httpd_resp_send_chunk (req, NULL, 0);
+   return ESP_OK;
+}
+
 static esp_err_t
 web_status (httpd_req_t * req)
 {
-   jo_t j = daikin_status ();
+   ja_t *j = daikin_status (STATUS_WEB);
    const char *reason;
    int t;
 
-   if (b.loopback)   
-      jo_bool (j, "loopback", 1);
-
-   t = revk_shutting_down (&reason);
-   if (t)
-      jo_string (j, "shutdown", reason);
+   httpd_resp_set_type (req, "application/json");
 
-   char *js = jo_finisha (&j);
+   if (j) {
+      if (b.loopback)   
+         ja_bool (j, "loopback", 1);
 
-   httpd_resp_set_type (req, "application/json");
+      t = revk_shutting_down (&reason);
+      if (t)
+         ja_string (j, "shutdown", reason);
 
-   if (js) {
-      httpd_resp_sendstr (req, js);
-      free (js);
+      httpd_resp_sendstr (req, ja_finish (j));
+      ja_done (j);
    } else {
       httpd_resp_send (req, NULL, 0);
    }
@@ -2175,10 +2871,10 @@ legacy_web_set_demand_control (httpd_req_t * req)
 static void
 jo_protocol_version (jo_t j)
 {
-   if (daikin.protocol_minor)       //Conditioner protocol version
-      jo_stringf (j, "pv", "%d.%02d", daikin.protocol_major, daikin.protocol_minor);
+   if (s21.protocol_minor)      //Conditioner protocol version
+      jo_stringf (j, "pv", "%d.%02d", s21.protocol_major, s21.protocol_minor);
    else
-      jo_int (j, "pv", daikin.protocol_major);
+      jo_int (j, "pv", s21.protocol_major);
    jo_int (j, "cpv", 3);        // Controller protocol version 
    jo_string (j, "cpv_minor", "20");    //
 }
@@ -2274,7 +2970,7 @@ jo_en_demand (jo_t j)
 static esp_err_t
 legacy_web_get_control_info (httpd_req_t * req)
 {
-   static float dt[8] = { 20, 20, 20, 20, 20, 20, 20, 20 };     // Used for some of the status
+   static ctemp_t dt[8] = { CTEMP (20), CTEMP (20), CTEMP (20), CTEMP (20), CTEMP (20), CTEMP (20), CTEMP (20), CTEMP (20) };  // Used for some of the status
    static char dfr[8] = { 'A', 'A', 'A', 'A', 'A', 'A', 'A', 'A' };
    char mode = '0';
    if (daikin.mode <= 7)
@@ -2285,12 +2981,12 @@ legacy_web_get_control_info (httpd_req_t * req)
    jo_int (j, "pow", daikin.power);
    jo_stringf (j, "mode", "%c", mode);
    legacy_adv (j);
-   jo_litf (j, "stemp", "%.1f", daikin.temp);
+   jo_centi (j, "stemp", daikin.temp, 1);
    jo_int (j, "shum", 0);
    for (int i = 1; i <= 7; i++)
    {                            // Temp setting in mode
       char tag[4] = { 'd', 't', '0' + i };
-      jo_litf (j, tag, "%.1f", dt[i]);
+      jo_centi (j, tag, dt[i], 1);
    }
    for (int i = 1; i <= 7; i++)
    {                            // Probably humidity, unknown
@@ -2300,7 +2996,7 @@ legacy_web_get_control_info (httpd_req_t * req)
    jo_int (j, "dhh", 0);
    if (daikin.mode <= 7)
       jo_stringf (j, "b_mode", "%c", "64370002"[daikin.mode]);
-   jo_litf (j, "b_stemp", "%.1f", daikin.temp);
+   jo_centi (j, "b_stemp", daikin.temp, 1);
    jo_int (j, "b_shum", 0);
    jo_int (j, "alert", 255);
    if (daikin.fan <= 6)
@@ -2361,7 +3057,7 @@ legacy_web_set_control_info (httpd_req_t * req)
       {
          char *v = jo_strdup (j);
          if (v)
-            daikin_set_t_e (err, temp, strtof (v, NULL));
+            daikin_set_t_e (err, temp, ctemp_parse (v));
          free (v);
       }
       if (jo_find (j, "f_rate"))
@@ -2408,12 +3104,12 @@ legacy_web_get_sensor_info (httpd_req_t * req)
 {
    jo_t j = legacy_ok ();
    if (daikin.status_known & CONTROL_home)
-      jo_litf (j, "htemp", "%.2f", daikin.home);
+      jo_centi (j, "htemp", daikin.home, 2);
    else
       jo_string (j, "htemp", "-");
    jo_string (j, "hhum", "-");
    if (daikin.status_known & CONTROL_outside)
-      jo_litf (j, "otemp", "%.2f", daikin.outside);
+      jo_centi (j, "otemp", daikin.outside, 2);
    else
       jo_string (j, "otemp", "-");
    jo_int (j, "err", 0);
@@ -2592,6 +3288,101 @@ legacy_discovery_task (void *pvParameters)
    vTaskDelete (NULL);
 }
 
+#define CNW_CAPTURE_LEN    1024 // Capture ring entries, ~10 packets
+#define CNW_CAPTURE_BATCH  256  // Max entries per message
+#define CNW_CAPTURE_PERIOD (250 / portTICK_PERIOD_MS)
+
+// Raw CN_WIRED pulse capture export. Over UDP each datagram is, little endian, a uint32_t sequence number,
+// uint16_t count of entries lost since last datagram, uint16_t count of entries that follow, then the
+// uint16_t entries as cn_wired_capture_read() gives them. Over MQTT the same is sent as "capture" info, in hex.
+static void
+cnw_capture_task (void *pvParameters)
+{
+   static uint8_t buf[8 + CNW_CAPTURE_BATCH * 2];
+   int sock = -1;
+   struct sockaddr_in dest = {.sin_family = AF_INET };
+   vTaskPrioritySet (NULL, tskIDLE_PRIORITY + 1);       // Reception comes first
+   if (strcmp (cnwcapture, "mqtt"))
+   {                            // UDP host:port
+      char host[64];
+      strncpy (host, cnwcapture, sizeof (host) - 1);
+      host[sizeof (host) - 1] = 0;
+      char *port = strrchr (host, ':');
+      if (port)
+         *port++ = 0;
+      if (!port)
+      {
+         jo_t j = jo_object_alloc ();
+         jo_string (j, "error", "Bad capture host:port");
+         jo_string (j, "capture", cnwcapture);
+         revk_error ("cnw", &j);
+         vTaskDelete (NULL);
+         return;
+      }
+      struct addrinfo *ai = NULL;
+      uint8_t reported = 0;
+      while (1)
+      {                         // We start before WiFi is up, and the name may not resolve at first
+         if (revk_link_down ())
+         {
+            sleep (1);
+            continue;
+         }
+         if (!getaddrinfo (host, NULL, &(struct addrinfo){.ai_family = AF_INET,.ai_socktype = SOCK_DGRAM }, &ai) && ai)
+            break;
+         if (!reported++)
+         {
+            jo_t j = jo_object_alloc ();
+            jo_string (j, "error", "Cannot resolve capture host, retrying");
+            jo_string (j, "capture", cnwcapture);
+            revk_error ("cnw", &j);
+         }
+         sleep (10);
+      }
+      dest.sin_addr = ((struct sockaddr_in *) ai->ai_addr)->sin_addr;
+      dest.sin_port = htons (atoi (port));
+      freeaddrinfo (ai);
+      sock = socket (AF_INET, SOCK_DGRAM, IPPROTO_IP);
+   }
+   if (cn_wired_capture_start (CNW_CAPTURE_LEN) != ESP_OK)
+   {
+      ESP_LOGE (TAG, "CN_WIRED capture no memory");
+      if (sock >= 0)
+         close (sock);
+      vTaskDelete (NULL);
+      return;
+   }
+   ESP_LOGI (TAG, "CN_WIRED capture start");
+   uint32_t seq = 0;
+   while (1)
+   {
+      vTaskDelay (CNW_CAPTURE_PERIOD);
+      unsigned int lost;
+      int n;
+      while ((n = cn_wired_capture_read ((uint16_t *) (buf + 8), CNW_CAPTURE_BATCH, &lost)) || lost)
+      {
+         if (lost > 0xFFFF)
+            lost = 0xFFFF;
+         memcpy (buf, &seq, 4);
+         buf[4] = lost;
+         buf[5] = lost >> 8;
+         buf[6] = n;
+         buf[7] = n >> 8;
+         seq++;
+         if (sock >= 0)
+            sendto (sock, buf, 8 + n * 2, 0, (struct sockaddr *) &dest, sizeof (dest));
+         else
+         {
+            jo_t j = jo_comms_alloc ();
+            jo_base16 (j, "capture", buf, 8 + n * 2);
+            revk_info ("cnw", &j);
+         }
+         if (n < CNW_CAPTURE_BATCH)
+            break;
+      }
+   }
+}
+
 // ESP8266: No-websocket web control routine. Reuses Daikin BRP response format.
 static esp_err_t
 web_control (httpd_req_t * req)
@@ -2618,7 +3409,7 @@ web_control (httpd_req_t * req)
          jo_next (j); // Ignore type, will be JO_STRING
          jo_strncpy (j, val, sizeof (val));
 #define	b(name)		if(!strcmp(tag,#name))err=daikin_set_v(name,!strcmp(val,"true"));
-#define	t(name)		if(!strcmp(tag,#name))err=daikin_set_t(name,strtof(val,NULL));
+#define	t(name)		if(!strcmp(tag,#name))err=daikin_set_t(name,ctemp_parse(val));
 #define	i(name)		if(!strcmp(tag,#name))err=daikin_set_i(name,atoi(val));
 #define	e(name,values)	if(!strcmp(tag,#name))err=daikin_set_e(name,val);
 #include "accontrols.m"
@@ -2670,7 +3461,9 @@ send_ha_config (void)
       jo_string (j, NULL, revk_id);
       jo_close (j);
       jo_string (j, "name", hostname);
-      if (*daikin.model)
+      if (*daikin.modelname)
+         jo_string (j, "mdl", daikin.modelname);        // Full name, from v3 S21
+      else if (*daikin.model)
          jo_string (j, "mdl", daikin.model);
       jo_string (j, "sw", revk_version);
       jo_string (j, "mf", "RevK");
@@ -2954,19 +3747,19 @@ revk_state_extra (jo_t j)
    if (daikin.status_known & CONTROL_power)
       jo_bool (j, "power", daikin.power);
    //if (daikin.status_known & CONTROL_temp) // HA always expects this
-   jo_litf (j, "target", "%.2f", autor ? (float) autot / autot_scale : daikin.temp);    // Target - either internal or what we are using as reference
+   jo_centi (j, "target", autor ? CTEMP_SETTING (autot) : daikin.temp, 2);      // Target - either internal or what we are using as reference
    if (daikin.status_known & CONTROL_env)
-      jo_litf (j, "temp", "%.2f", daikin.env);  // The external temperature
+      jo_centi (j, "temp", daikin.env, 2);      // The external temperature
    else if (daikin.status_known & CONTROL_home)
-      jo_litf (j, "temp", "%.2f", daikin.home); // We use home if present, else inlet
+      jo_centi (j, "temp", daikin.home, 2);     // We use home if present, else inlet
    else if (daikin.status_known & CONTROL_inlet)
-      jo_litf (j, "temp", "%.2f", daikin.inlet);
+      jo_centi (j, "temp", daikin.inlet, 2);
    if ((daikin.status_known & CONTROL_home) && (daikin.status_known & CONTROL_inlet))
-      jo_litf (j, "inlet", "%.2f", daikin.inlet);       // Both so report inlet as well
+      jo_centi (j, "inlet", daikin.inlet, 2);   // Both so report inlet as well
    if (daikin.status_known & CONTROL_outside)
-      jo_litf (j, "outside", "%.2f", daikin.outside);
+      jo_centi (j, "outside", daikin.outside, 2);
    if (daikin.status_known & CONTROL_liquid)
-      jo_litf (j, "liquid", "%.2f", daikin.liquid);
+      jo_centi (j, "liquid", daikin.liquid, 2);
    if (daikin.status_known & CONTROL_demand)
       jo_int (j, "demand", daikin.demand);
    if ((daikin.status_known & CONTROL_Wh) && daikin.Wh)
@@ -3032,11 +3825,17 @@ void
 uart_setup (void)
 {
    esp_err_t err = 0;
+   static uint8_t log_flushed = 0;
    ESP_LOGI (TAG, "Trying %s", proto_name());
    // This makes sure UART is clear and previously emitted log text has reached
    // its destination
    // fflush(stdout) doesn't do the job, neither uart_wait_tx_done() is reliable
-   sleep (1);
+   // Only needed once, after that console log is off, so we don't slow down detection
+   if (!log_flushed)
+   {
+      sleep (1);
+      log_flushed = 1;
+   }
    // Shut off console log if it is using our UART
    if (uart == CONFIG_ESP_CONSOLE_UART_NUM) {
       // This requires https://github.com/espressif/ESP8266_RTOS_SDK/pull/1253
@@ -3053,6 +3852,7 @@ uart_setup (void)
    {
       // Hardcoded for UART0, because UART1 is tx-only
       err = cn_wired_driver_install (GPIO_NUM_3, GPIO_NUM_1, invert_rx_line (), invert_tx_line ());
+      cn_wired_calibrate (cnwcalibrate);
    } else {
       uart_config_t uart_config = {
          .baud_rate = (proto_type () == PROTO_TYPE_S21) ? 2400 : 9600,
@@ -3140,17 +3940,25 @@ app_main ()
    }
 #endif
    daikin.mutex = xSemaphoreCreateMutex ();
+   daikin_task = xTaskGetCurrentTaskHandle ();
    daikin.status_known = CONTROL_online;
-#define	t(name)	daikin.name=NAN;
-#define	r(name)	daikin.min##name=NAN;daikin.max##name=NAN;
+#define	t(name)	daikin.name=CTEMP_NONE;
+#define	r(name)	daikin.min##name=CTEMP_NONE;daikin.max##name=CTEMP_NONE;
 #include "acextras.m"
+   ac_stats_reset (&stats);
+   if (!nohistory)
+      history = calloc (1, sizeof (*history));
    revk_boot (&mqtt_client_callback);
    revk_start ();
 
    if (udp_discovery)
       revk_task ("daikin_discovery", legacy_discovery_task, NULL, 0);
+   if (*cnwcapture)
+      revk_task ("cnw_capture", cnw_capture_task, NULL, 0);
 
    b.dumping = dump;
+   s21.snoop = snoop;
+   daikin_s21_caps_load ();
    revk_blink (0, 0, "");
 
    if (webcontrol || websettings)
@@ -3160,7 +3968,7 @@ app_main ()
       config.stack_size += 2048;        // Being on the safe side
       // When updating the code below, make sure this is enough
       // Note that we're also adding revk's own web config handlers
-      config.max_uri_handlers = 16 + revk_num_web_handlers ();
+      config.max_uri_handlers = 19 + revk_num_web_handlers ();
       if (!httpd_start (&webserver, &config))
       {
          if (websettings)
@@ -3171,6 +3979,9 @@ app_main ()
             register_get_uri ("/apple-touch-icon.png", web_icon);
             // ESP8266: No websockets
             register_get_uri ("/status", web_status);
+            register_get_uri ("/stats", web_stats);
+            register_get_uri ("/history", web_history);
+            register_get_uri ("/history.csv", web_history_csv);
             register_get_uri ("/control", web_control);
             register_get_uri ("/common/basic_info", legacy_web_get_basic_info);
             register_get_uri ("/aircon/get_model_info", legacy_web_get_model_info);
@@ -3217,10 +4028,11 @@ app_main ()
          daikin.status_known |= CONTROL_demand;
       daikin.power = 1;
       daikin.mode = 1;
-      daikin.temp = 20.0;
+      daikin.temp = CTEMP (20);
    }
    strncpy (daikin.model, model, sizeof (daikin.model));        // Default model
    proto = protocol;
+   detect_start = esp_timer_get_time ();
    if (protofix)
       protocol_set = 1;         // Fixed protocol - do not change
    else
@@ -3242,6 +4054,14 @@ app_main ()
             usleep (1000);      // Yeh, silly, but someone could configure to do nothing
             continue;
          }
+         if (proto_type () == PROTO_TYPE_CN_WIRED && proto != protocol && uart_enabled ())
+         {                      // CN_WIRED units talk without being asked, so listen before waiting on a read
+            static uint8_t skipped = 0;
+            if (cn_wired_sniff (GPIO_NUM_3, invert_rx_line (), CNW_SNIFF_TIME) <= 0 && ++skipped < CNW_SNIFF_TRIES)
+               continue;        // Nothing heard, but try properly now and then in case we missed it
+            skipped = 0;
+         }
+         proto_tries++;
       }
       daikin.talking = 1;
       if (uart_enabled ())
@@ -3265,16 +4085,40 @@ app_main ()
       }
       if (haenable)
          daikin.ha_send = 1;
+      uint8_t fresh = 1;        // Just started, don't wait before talking to the AC
       do
       {
          // Polling loop. We exit from here only if we get a protocol error
-         if (proto_type () != PROTO_TYPE_CN_WIRED)
+         if (proto_type () != PROTO_TYPE_CN_WIRED && !fresh)
          {
             /* wait for next second. For CN_WIRED we don't need to actively poll the
                A/C, so we don't need this delay. We just keep reading, packets should
                come once per second, and that's our timing */
-            usleep (1000000LL - (esp_timer_get_time () % 1000000LL));
+            // A control change wakes us up early, so that it goes to the AC right away
+            int64_t next = (esp_timer_get_time () / 1000000LL + 1) * 1000000LL,
+               left;
+            while ((left = next - esp_timer_get_time ()) > 0)
+            {
+               TickType_t ticks = left / 1000 / portTICK_PERIOD_MS;
+               if (!ticks)
+               {                // Less than a tick to go
+                  usleep (left);
+                  break;
+               }
+               if (ulTaskNotifyTake (pdTRUE, ticks))
+               {                // Let a burst of changes settle, so it goes as one write
+                  while (controlwindow && (left = next - esp_timer_get_time ()) > 0)
+                  {
+                     TickType_t wait = (left / 1000 < controlwindow ? left / 1000 : controlwindow) / portTICK_PERIOD_MS;
+                     if (!ulTaskNotifyTake (pdTRUE, wait))
+                        break;  // Quiet for long enough
+                  }
+                  daikin_send_controls ();
+               }
+            }
          }
+         fresh = 0;
+         int64_t loop_start = esp_timer_get_time ();    // Everything but waiting for the next second
 #ifdef ELA
          if (ble_sensor_connected ())
          {                      // Automatic external temperature logic - only really useful if autor/autot set
@@ -3294,176 +4138,77 @@ app_main ()
             }
             if (bletemp && !bletemp->missing && bletemp->tempset)
             {                   // Use temp
-               daikin.env = bletemp->temp / 100.0;
+               if (daikin.env != bletemp->temp)
+                  daikin.status_dirty |= CONTROL_env;
+               daikin.env = bletemp->temp;      // Already 0.01C
                daikin.status_known |= CONTROL_env;      // So we report it
-            } else
+            } else if (daikin.status_known & CONTROL_env)
+            {
                daikin.status_known &= ~CONTROL_env;     // So we don't report it
+               daikin.status_dirty |= CONTROL_env;
+            }
          }
 #endif
          if (autor && autot)
          {                      // Automatic setting of "external" controls, autot is temp(*autot_scale), autor is range(*autor_scale), autob is BLE name
             daikin.controlvalid = uptime () + 10;
-            daikin.mintarget = (float) autot / autot_scale - (float) autor / autor_scale;
-            daikin.maxtarget = (float) autot / autot_scale + (float) autor / autor_scale;
+            daikin.mintarget = CTEMP_SETTING (autot) - CTEMP_SETTING (autor);
+            daikin.maxtarget = CTEMP_SETTING (autot) + CTEMP_SETTING (autor);
          }
          // Talk to the AC
          if (uart_enabled ())
          {
             if (proto_type () == PROTO_TYPE_ALTHERMA_S)
             {
-#define poll(a)                         \
-   static uint8_t a=2;                  \
-   if(a){                               \
-      int r=daikin_as_poll(*#a); \
-      if (r==RES_OK)                          \
-         a=100;                         \
-      else if(r==RES_NAK)                     \
-         a--;                           \
-   }                                          \
-   if(!daikin.talking)                        \
-      a=2;
-               poll (U);
-               poll (T);
-               poll (P);
-               poll (S);
-#undef poll
+               daikin_as_poll ();
             } else if (proto_type () == PROTO_TYPE_CN_WIRED)
             {                   // CN WIRED
-               uint8_t buf[CNW_PKT_LEN];
-               esp_err_t e = cn_wired_read_bytes (buf, CNW_READ_TIMEOUT);
+               cn_wired_packet_t pkt;
+               int64_t wait = esp_timer_get_time ();
+               esp_err_t e = cn_wired_read_packet (&pkt, CNW_READ_TIMEOUT);
+               bus_stat_t *stat = bus_stats_find ("rx");
 
+               if (e == ESP_OK && stat)
+                  bus_stats_time (&stat->reply, esp_timer_get_time () - wait); // Time since we replied to last one
                if (e == ESP_ERR_TIMEOUT)
                {
+                  bus_stats_result (stat, BUS_TIMEOUT);
                   daikin.online = false;
+                  daikin.status_dirty |= CONTROL_online;
                   comm_timeout (NULL, 0);
                } else if (e == ESP_OK)
                {
-                  daikin_cn_wired_incoming_packet (buf);
-
-                  // Send new modes to the AC. We have just received a data packet; CN_WIRED devices
-                  // may dislike being interrupted, so we delay for 20 ms in order for the packet
-                  // trailer pulse (which we ignore) passes
-                  sys_msleep (20);
-                  // We send modes as a "response" to every packet from the AC. We know that original
-                  // equipment (wall panel, as well as Daichi 3rd party controller) does that too; and
-                  // we also know that some ACs (FTN15PV1L) don't take commands on 1st try if we don't
-                  // do so. Perhaps they think we are offline.
-                  daikin_cn_wired_send_modes ();
+                  daikin_cn_wired_incoming_packet (&pkt);
+
+                  if (esp_timer_get_time () - pkt.sync_time < CNW_STALE_TIME)
+                  {             // Packets are queued, if we got to this one late, answer the next one instead
+                     // Send new modes to the AC. We have just received a data packet; CN_WIRED devices
+                     // may dislike being interrupted, so we wait for the packet trailer pulse (which we
+                     // otherwise ignore) to end, and then a bit more. If we don't see the trailer, the
+                     // timeout is about when it would have ended.
+                     // We send modes as a "response" to every packet from the AC. We know that original
+                     // equipment (wall panel, as well as Daichi 3rd party controller) does that too; and
+                     // we also know that some ACs (FTN15PV1L) don't take commands on 1st try if we don't
+                     // do so. Perhaps they think we are offline.
+                     if (cn_wired_wait_idle (&pkt, CNW_TRAILER_TIMEOUT) != ESP_FAIL)
+                     {
+                        if (cnwguard)
+                           usleep (cnwguard * 1000);
+                        daikin_cn_wired_send_modes ();
+                     }
+                  }
                } else
                {
                   daikin.talking = 0;   // Not ready?
                }
             } else if (proto_type () == PROTO_TYPE_S21)
             {                   // Older S21
-               char temp[5];
                if (debug)
                   s21debug = jo_object_alloc ();
-               // Poll the AC status.
-               // Each value has a smart NAK counter (see macro below), which allows
-               // for autodetecting unsupported commands
-               // Not the do{}while(0); logic is so this works as a single C statement can so can  be used as if()poll(); safely
-#define poll(a,b,c,d)                         		\
-   do							\
-   {							\
-   	if(!s21.a##b##d.bad)				\
-	{						\
-      	    int r=daikin_s21_command(*#a,*#b,c,#d);	\
-      	    if (r==RES_OK)                          	\
-      	    {                         	 		\
-        	s21.a##b##d.ack=1;            		\
-        	s21.a##b##d.nak=0;            		\
-        	s21.a##b##d.bad=0;            		\
-	    }                         	 		\
-      	    else if(r==RES_NAK)                     	\
-      	    {                         	 		\
-         	s21.a##b##d.nak++;                      \
-		if(!s21.a##b##d.nak)			\
-		    s21.a##b##d.bad=1;			\
-	    }                         	 		\
-   	}                                          	\
-   	if(!daikin.talking)                        	\
-      	    s21.a##b##d.ack=s21.a##b##d.nak=s21.a##b##d.bad=0;\
-    } while(0)
-
-               if (!s21.FY00.ack && !s21.F8.ack)
-                  poll (F, Y, 2, 00);  // One time static value
-               poll (F, 1, 0,);
-               if (debug)
-                  poll (F, 2, 0,);
-               if (s21.F6.bad || debug)
-                  poll (F, 3, 0,);      // If F6 works we assume we don't need F3
-               if (debug)
-                  poll (F, 4, 0,);
-               poll (F, 5, 0,);
-               poll (F, 6, 0,);
-               poll (F, 7, 0,);
-               if (!s21.FY00.ack && !s21.F8.ack)
-                  poll (F, 8, 0,);      // One time static value
-               poll (F, 9, 0,);
-               if (debug)
-                  poll (F, A, 0,);
-               if (debug)
-                  poll (F, B, 0,);
-               if (!s21.FC.ack)
-                  poll (F, C, 0,);      // One time static value
-               if (debug)
-                  poll (F, G, 0,);
-               if (debug)
-                  poll (F, K, 0,);
-               poll (F, M, 0,);
-               if (debug)
-                  poll (F, N, 0,);
-               if (debug)
-                  poll (F, P, 0,);
-               if (debug)
-                  poll (F, Q, 0,);
-               if (debug)
-                  poll (F, S, 0,);
-               if (debug)
-                  poll (F, T, 0,);
-               //if(debug)poll (F, U, 2, 02);
-               //if(debug)poll (F, U, 2, 04);
-
-               static uint8_t rcycle = 0;       // R polling one per cycle
-               switch (rcycle++)
-               {
-               case 0:
-                  poll (R, H, 0,);
-                  break;
-               case 1:
-                  poll (R, I, 0,);
-                  break;
-               case 2:
-                  poll (R, a, 0,);
-                  break;
-               case 3:
-                  poll (R, L, 0,);      // Fan speed
-                  break;
-               case 4:
-                  poll (R, d, 0,);      // Compressor
-                  break;
-               case 5:
-                  poll (R, N, 0,);      // Angle
-                  break;
-               case 6:
-                  poll (R, G, 0,);      // Fan
-                  if (!debug)
-                     rcycle = 0;        // End of normal R polling - the following are debug only
-                  break;
-               case 7:
-                  poll (R, M, 0,);
-                  break;
-               case 8:
-                  poll (R, X, 0,);
-                  break;
-               case 9:
-                  poll (R, D, 0,);
-                  rcycle = 0;   // End of debug cycle
-                  break;
-               }
-
-               if (!s21.RH.bad && !s21.Ra.bad)
-                  s21.F9.bad = 1;       // Don't use F9
+               // Send new values, requested by the user, if any, ahead of polling
+               daikin_s21_control ();
+               daikin_s21_poll ();
+               daikin_s21_caps ();
                if (*debugsend)
                {
                   b.dumping = 1;        // Force dumping
@@ -3472,134 +4217,50 @@ app_main ()
                   *debugsend = 0;
                   b.dumping = dump;     // Back to setting
                }
-#undef poll
                if (debug)
                   revk_info ("s21", &s21debug);
-               // Now send new values, requested by the user, if any
-               if (daikin.control_changed & (CONTROL_power | CONTROL_mode | CONTROL_temp | CONTROL_fan))
-               {                // D1
-                  xSemaphoreTake (daikin.mutex, portMAX_DELAY);
-                  temp[0] = daikin.power ? '1' : '0';
-                  temp[1] = ("64300002"[daikin.mode]);  // FHCA456D mapped to AXDCHXF
-                  if (daikin.mode == 1 || daikin.mode == 2 || daikin.mode == 3)
-                     temp[2] = s21_encode_target_temp (daikin.temp);
-                  else
-                     temp[2] = AC_MIN_TEMP_VALUE;       // No temp in other modes
-                  temp[3] = ("A34567B"[daikin.fan]);
-                  daikin_s21_command ('D', '1', S21_PAYLOAD_LEN, temp);
-                  xSemaphoreGive (daikin.mutex);
-               }
-               if (daikin.control_changed & (CONTROL_swingh | CONTROL_swingv))
-               {                // D5
-                  xSemaphoreTake (daikin.mutex, portMAX_DELAY);
-                  temp[0] = '0' + (daikin.swingh ? 2 : 0) + (daikin.swingv ? 1 : 0) + (daikin.swingh && daikin.swingv ? 4 : 0);
-                  temp[1] = (daikin.swingh || daikin.swingv ? '?' : '0');
-                  temp[2] = '0';
-                  temp[3] = '0';
-                  daikin_s21_command ('D', '5', S21_PAYLOAD_LEN, temp);
-                  xSemaphoreGive (daikin.mutex);
-               }
-               if (daikin.control_changed & (CONTROL_powerful | CONTROL_comfort | CONTROL_streamer |
-                                             CONTROL_sensor | CONTROL_quiet | CONTROL_led))
-               {                // D6
-                  xSemaphoreTake (daikin.mutex, portMAX_DELAY);
-                  if (!s21.F6.bad)
-                  {
-                     temp[0] = '0' + (daikin.powerful ? 2 : 0) + (daikin.comfort ? 0x40 : 0) + (daikin.quiet ? 0x80 : 0);
-                     temp[1] = '0' + (daikin.streamer ? 0x80 : 0);
-                     temp[2] = '0';
-                     // If sensor, the 8 is sensor, if not, then 4 and 8 are LED, with 4=high, 8=low, 12=off
-                     if (noled || !nosensor)
-                        temp[3] = '0' + (daikin.sensor ? 0x08 : 0) + (daikin.led ? 0x04 : 0);   // Messy but gives some controls
-                     else
-                        temp[3] = '0' + (daikin.led ? dark ? 8 : 4 : 12);
-                     // FIXME: ATX20K2V1B responds NAK to this command, but also doesn't react on D3.
-                     // Looks like it supports something else, we don't know what.
-                     // https://github.com/revk/ESP32-Faikin/issues/441
-                     daikin_s21_command ('D', '6', S21_PAYLOAD_LEN, temp);
-                  } else if (!s21.F3.bad)
-                  {             // F3 or F6 depends on model
-                     // Actually many ACs (tested on FTXF20D5V1B and ATX20K2V1B) respond to
-                     // both F3 and F6, but F3 does not report "powerful" state, so we give
-                     // F6 a preference.
-                     // The current code assumes that only units, which don't respond to F6
-                     // at all, will report the flag in F3, and require D3 to control.
-                     // This suggestion must be true, because otherwise commit 0c5f769, which
-                     // introduced support for F3, wouldn't have worked, being overriden by F6
-                     // due to how poll sequence is organized.
-                     temp[0] = '0';
-                     temp[1] = '0';
-                     temp[2] = '0';
-                     temp[3] = '0' + (daikin.powerful ? 2 : 0);
-                     daikin_s21_command ('D', '3', S21_PAYLOAD_LEN, temp);
-                  }
-                  xSemaphoreGive (daikin.mutex);
-               }
-               if (daikin.control_changed & (CONTROL_demand | CONTROL_econo))
-               {                // D7
-                  xSemaphoreTake (daikin.mutex, portMAX_DELAY);
-                  temp[0] = '0' + 100 - daikin.demand;
-                  temp[1] = '0' + (daikin.econo ? 2 : 0);
-                  temp[2] = '0';
-                  temp[3] = '0';
-                  daikin_s21_command ('D', '7', S21_PAYLOAD_LEN, temp);
-                  xSemaphoreGive (daikin.mutex);
-               }
             } else if (proto_type () == PROTO_TYPE_X50A)
             {                   // Newer protocol
                //daikin_x50a_command(0xB7, 0, NULL);       // Not sure this is actually meaningful
-               daikin_x50a_command (0xBD, 0, NULL);
-               daikin_x50a_command (0xBE, 0, NULL);
-               uint8_t ca[17] = { 0 };
-               uint8_t cb[2] = { 0 };
-               if (daikin.control_changed)
-               {
-                  xSemaphoreTake (daikin.mutex, portMAX_DELAY);
-                  ca[0] = 2 + daikin.power;
-                  ca[1] = 0x10 + daikin.mode;
-                  if (daikin.mode >= 1 && daikin.mode <= 3)
-                  {             // Temp
-                     int t = lroundf (daikin.temp * 10);
-                     ca[3] = t / 10;
-                     ca[4] = 0x80 + (t % 10);
-                  } else
-                     daikin.control_changed &= ~CONTROL_temp;
-                  if (daikin.mode == 1 || daikin.mode == 2)
-                     cb[0] = daikin.mode;
-                  else
-                     cb[0] = 6;
-                  cb[1] = 0x80 + ((daikin.fan & 7) << 4);
-                  xSemaphoreGive (daikin.mutex);
-               }
-               daikin_x50a_command (0xCA, sizeof (ca), ca);
-               daikin_x50a_command (0xCB, sizeof (cb), cb);
+               // Pending controls first, their CA reply is also the status refresh, then whatever is due
+               daikin_x50a_control ();
+               daikin_x50a_poll ();
             }
          }
+         static uint32_t lastfull = 0;  // uptime of last full status
+         if (statusdelta && statusfull && lastfull && uptime () - lastfull >= statusfull)
+            daikin.status_report = 1;   // Periodic full status for anyone who missed the deltas
          // Report status changes if happen on AC side. Ignore if we've just sent
          // some new control values
          if (!daikin.control_changed && (daikin.status_changed || daikin.status_report || daikin.mode_changed))
          {
             uint8_t send = ((debug || livestatus || daikin.status_report || daikin.mode_changed) ? 1 : 0);
+            // With statusdelta, a full status on request, when due, or if we have not sent one yet
+            uint8_t full = (daikin.status_report || !lastfull || (statusfull && uptime () - lastfull >= statusfull));
             daikin.status_changed = 0;
             daikin.mode_changed = 0;
             daikin.status_report = 0;
-            if (send)
+            if (send && statusdelta && !full && (daikin.status_dirty || daikin.status_extras))
+            {                   // Just what has changed
+               ja_t *j = daikin_status (STATUS_DELTA);
+               ja_state ("delta", j);
+            } else if (send && (!statusdelta || full))
             {
-               jo_t j = daikin_status ();
-               revk_state ("status", &j);
+               ja_t *j = daikin_status (STATUS_SEND);
+               ja_state ("status", j);
+               lastfull = uptime ();
             }
             ha_status ();
          }
          // Stats
-#define b(name)         if(daikin.name)daikin.total##name++;
-#define t(name)		if(!isnan(daikin.name)){if(!daikin.count##name||daikin.min##name>daikin.name)daikin.min##name=daikin.name;	\
-	 		if(!daikin.count##name||daikin.max##name<daikin.name)daikin.max##name=daikin.name;	\
-	 		daikin.total##name+=daikin.name;daikin.count##name++;}
-#define i(name)		if(!daikin.statscount||daikin.min##name>daikin.name)daikin.min##name=daikin.name;	\
-	 		if(!daikin.statscount||daikin.max##name<daikin.name)daikin.max##name=daikin.name;	\
-	 		daikin.total##name+=daikin.name;
+         if (!ac_stats_full (&stats))
+         {
+#define b(name)         ac_stats_bool(&stats,STATS_B_##name,daikin.name);
+#define t(name)		ac_stats_temp(&stats,STATS_T_##name,daikin.name);
+#define i(name)		ac_stats_int(&stats,STATS_I_##name,daikin.name);
 #include "acextras.m"
-         daikin.statscount++;
+            ac_stats_next (&stats);
+         }
          if (!daikin.control_changed)
             daikin.control_count = 0;
          else if (daikin.control_count++ > 10)
@@ -3607,7 +4268,7 @@ app_main ()
             // Report failed settings
             jo_t j = jo_object_alloc ();
 #define b(name)         if(daikin.control_changed&CONTROL_##name)jo_bool(j,#name,daikin.name);
-#define t(name)         if(daikin.control_changed&CONTROL_##name){if(daikin.name>=100)jo_null(j,#name);else jo_litf(j,#name,"%.1f",daikin.name);}
+#define t(name)         if(daikin.control_changed&CONTROL_##name){if(daikin.name>=CTEMP(100))jo_null(j,#name);else jo_centi(j,#name,daikin.name,1);}
 #define i(name)         if(daikin.control_changed&CONTROL_##name)jo_int(j,#name,daikin.name);
 #define e(name,values)  if((daikin.control_changed&CONTROL_##name)&&daikin.name<sizeof(CONTROL_##name##_VALUES)-1)jo_stringf(j,#name,"%c",CONTROL_##name##_VALUES[daikin.name]);
 #include "accontrols.m"
@@ -3620,10 +4281,10 @@ app_main ()
          // Basic temp tracking
          xSemaphoreTake (daikin.mutex, portMAX_DELAY);
          uint8_t hot = daikin.heat;     // Are we in heating mode?
-         float min = daikin.mintarget;
-         float max = daikin.maxtarget;
-         float measured_temp = daikin.env;
-         if (isnan (measured_temp))     // No env temp available, so use A/C internal temp
+         int min = daikin.mintarget;
+         int max = daikin.maxtarget;
+         int measured_temp = daikin.env;
+         if (measured_temp == CTEMP_NONE)       // No env temp available, so use A/C internal temp
             measured_temp = daikin.home;
          xSemaphoreGive (daikin.mutex);
 
@@ -3638,7 +4299,7 @@ app_main ()
          //       new "predicted" env temp is (19.8+(0.1+0.2)*2)=20.4 (*2 is calculated from tpredictt and tpredicts)
          // tpredicts is the "sample time" for the calculation (it must be taken *2, because the deltas are calculated over 2 cycles)
          // tpredictt is the time in the future where the predicted env temp would be reached.
-         if (tpredicts && !isnan (measured_temp))
+         if (tpredicts && measured_temp != CTEMP_NONE)
          {
             static uint32_t lasttime = 0;
             if (now / tpredicts != lasttime / tpredicts)
@@ -3652,19 +4313,19 @@ app_main ()
             }
             // Two subsequent temperature changes in the same direction ("no change" is ok as well)
             if ((daikin.env_delta <= 0 && daikin.env_delta_prev <= 0) || (daikin.env_delta >= 0 && daikin.env_delta_prev >= 0))
-               measured_temp += (daikin.env_delta + daikin.env_delta_prev) * tpredictt / (tpredicts * 2);       // Predict
+               measured_temp += (daikin.env_delta + daikin.env_delta_prev) * (int) tpredictt / (int) (tpredicts * 2);   // Predict
          }
          // Apply adjustment
-         if (!thermostat && daikin.control && daikin.power && !isnan (min) && !isnan (max))
+         if (!thermostat && daikin.control && daikin.power && min != CTEMP_NONE && max != CTEMP_NONE)
          {
             if (hot)
             {
-               max += (float) switchtemp / switchtemp_scale;    // Overshoot for switching (heating)
-               min += (float) pushtemp / pushtemp_scale;        // Adjust target
+               max += CTEMP_SETTING (switchtemp);       // Overshoot for switching (heating)
+               min += CTEMP_SETTING (pushtemp); // Adjust target
             } else
             {
-               min -= (float) switchtemp / switchtemp_scale;    // Overshoot for switching (cooling)
-               max -= (float) pushtemp / pushtemp_scale;        // Adjust target
+               min -= CTEMP_SETTING (switchtemp);       // Overshoot for switching (cooling)
+               max -= CTEMP_SETTING (pushtemp); // Adjust target
             }
          }
 
@@ -3700,8 +4361,8 @@ app_main ()
             //  and temperature not close to target temp
             // TODO: Use of switchtemp for different purposes is confusing (ref. min/max a couple of lines above)
             if (!nofanauto && daikin.fan
-                && ((hot && measured_temp < min - 2 * (float) switchtemp / switchtemp_scale)
-                    || (!hot && measured_temp > max + 2 * (float) switchtemp / switchtemp_scale)))
+                && ((hot && measured_temp < min - 2 * CTEMP_SETTING (switchtemp))
+                    || (!hot && measured_temp > max + 2 * CTEMP_SETTING (switchtemp))))
             {
                daikin.fansaved = daikin.fan;    // Save for when we get to temp
                daikin_set_v (fan, autofmax);    // Max fan at start
@@ -3721,10 +4382,10 @@ app_main ()
                daikin.fansaved = 0;
             }
             // We were controlling, so set to a non controlling mode, best guess at sane settings for now
-            if (!isnan (daikin.mintarget) && !isnan (daikin.maxtarget))
+            if (daikin.mintarget != CTEMP_NONE && daikin.maxtarget != CTEMP_NONE)
                daikin_set_t (temp, daikin.heat ? daikin.maxtarget : daikin.mintarget);
-            daikin.mintarget = NAN;
-            daikin.maxtarget = NAN;
+            daikin.mintarget = CTEMP_NONE;
+            daikin.maxtarget = CTEMP_NONE;
          }
          // END OF controlstop()
 
@@ -3741,14 +4402,14 @@ app_main ()
             if (auto1 && last < auto1 && hhmm >= auto1)
             {                   // Auto on - and consider mode change is not on Auto
                daikin_set_v (power, 1);
-               if (!lockmode && daikin.mode != 3 && !isnan (measured_temp) && !isnan (min) && !isnan (max)
+               if (!lockmode && daikin.mode != 3 && measured_temp != CTEMP_NONE && min != CTEMP_NONE && max != CTEMP_NONE
                    && ((hot && measured_temp > max) || (!hot && measured_temp < min)))
                   daikin_set_e (mode, hot ? "C" : "H"); // Swap mode
             }
             last = hhmm;
          }
          // Monitoring and automation
-         if (!isnan (measured_temp) && !isnan (min) && !isnan (max) && tsample)
+         if (measured_temp != CTEMP_NONE && min != CTEMP_NONE && max != CTEMP_NONE && tsample)
          {                      // Monitoring and automation
             if (daikin.power && daikin.lastheat != hot)
             {                   // If we change mode, start samples again
@@ -3777,19 +4438,19 @@ app_main ()
                int countBeyond2Samples = daikin.countBeyond + daikin.countBeyondPrev;   // Beyond counter of this and previous cycle
                int count_total_2_samples = daikin.countTotal + daikin.countTotalPrev;   // Total counter of this and previous cycle (includes neither approaching or beyond, i.e. in range)
 
-               // Prepare reporting structure for "automation"
-               jo_t j = jo_object_alloc ();
-               jo_bool (j, "hot", hot);
+               // Prepare reporting structure for "automation", periodic so not on the heap, report slot is free here
+               ja_t *j = ja_start (JSON_ARENA_REPORT);
+               ja_bool (j, "hot", hot);
                if (count_total_2_samples)
                {
-                  jo_int (j, "approaching", count_approaching_2_samples);
-                  jo_int (j, "beyond", countBeyond2Samples);
-                  jo_int (j, daikin.countTotalPrev ? "samples" : "initial-samples", count_total_2_samples);
+                  ja_int (j, "approaching", count_approaching_2_samples);
+                  ja_int (j, "beyond", countBeyond2Samples);
+                  ja_int (j, daikin.countTotalPrev ? "samples" : "initial-samples", count_total_2_samples);
                }
-               jo_int (j, "period", tsample);
-               jo_litf (j, "temp", "%.2f", measured_temp);
-               jo_litf (j, "min", "%.2f", min);
-               jo_litf (j, "max", "%.2f", max);
+               ja_int (j, "period", tsample);
+               ja_centi (j, "temp", measured_temp, 2);
+               ja_centi (j, "min", min, 2);
+               ja_centi (j, "max", max, 2);
 
                if (daikin.countTotalPrev)       // Skip first cycle
                {                // Power, mode, fan, automation
@@ -3803,12 +4464,12 @@ app_main ()
                      {          // Mode switch
                         if (!lockmode)
                         {
-                           jo_string (j, "set-mode", hot ? "C" : "H");
+                           ja_string (j, "set-mode", hot ? "C" : "H");
                            daikin_set_e (mode, hot ? "C" : "H");        // Swap mode
 
                            if (!nofanauto && step && daikin.fan > 1 && daikin.fan <= 5)
                            {
-                              jo_int (j, "set-fan", 1);
+                              ja_int (j, "set-fan", 1);
                               daikin_set_v (fan, 1);
                            }
                         }
@@ -3818,7 +4479,7 @@ app_main ()
                      else if (!nofanauto && count_approaching_2_samples * 10 < count_total_2_samples * 7
                               && step && daikin.fan > 1 && daikin.fan <= 5)
                      {
-                        jo_int (j, "set-fan", daikin.fan - step);
+                        ja_int (j, "set-fan", daikin.fan - step);
                         daikin_set_v (fan, daikin.fan - step);  // Reduce fan
                      }
                      // A lot of approaching means still far away from desired temp
@@ -3827,7 +4488,7 @@ app_main ()
                               && count_approaching_2_samples * 10 > count_total_2_samples * 9
                               && step && daikin.fan >= 1 && daikin.fan < autofmax)
                      {
-                        jo_int (j, "set-fan", daikin.fan + step);
+                        ja_int (j, "set-fan", daikin.fan + step);
                         daikin_set_v (fan, daikin.fan + step);  // Increase fan
                      }
                      // No Approaching and no Beyond, so it's in desired range (autot +/- autor)
@@ -3835,29 +4496,29 @@ app_main ()
                      // Turn off as 100% in band for last two period
                      else if ((autop || (daikin.remote && autoptemp)) && !count_approaching_2_samples && !countBeyond2Samples)
                      {          // Auto off
-                        jo_bool (j, "set-power", 0);
+                        ja_bool (j, "set-power", 0);
                         daikin_set_v (power, 0);        // Turn off as 100% in band for last two period
                      }
                   }
                   // Daikin is off
                   else if ((autop || (daikin.remote && autoptemp))      // AutoP Mode only
                            && (daikin.countApproaching == daikin.countTotal || daikin.countBeyond == daikin.countTotal) // full cycle approaching or full cycle beyond
-                           && (measured_temp >= max + (float) autoptemp / autoptemp_scale       // temp out of desired range
-                               || measured_temp <= min - (float) autoptemp / autoptemp_scale) && (!lockmode || countBeyond2Samples != count_total_2_samples))   // temp out of desired range
+                           && (measured_temp >= max + CTEMP_SETTING (autoptemp) // temp out of desired range
+                               || measured_temp <= min - CTEMP_SETTING (autoptemp)) && (!lockmode || countBeyond2Samples != count_total_2_samples))     // temp out of desired range
                   {             // Auto on (don't auto on if would reverse mode and lockmode)
-                     jo_bool (j, "set-power", 1);
+                     ja_bool (j, "set-power", 1);
                      daikin_set_v (power, 1);   // Turn on as 100% out of band for last two period
                      if (countBeyond2Samples == count_total_2_samples)
                      {
-                        jo_string (j, "set-mode", hot ? "C" : "H");
+                        ja_string (j, "set-mode", hot ? "C" : "H");
                         daikin_set_e (mode, hot ? "C" : "H");   // Swap mode
                      }
                   }
                }
                if (count_total_2_samples)       // after a cycle, send automation data  
-                  revk_info ("automation", &j);
+                  ja_info ("automation", j);
                else
-                  jo_free (&j);
+                  ja_done (j);
 
                // Next sample
                daikin.countApproachingPrev = daikin.countApproaching;
@@ -3872,22 +4533,24 @@ app_main ()
          {                      // End of auto mode and no env data either
             daikin.controlvalid = 0;
             daikin.status_known &= ~CONTROL_env;
-            daikin.env = NAN;
+            daikin.status_dirty |= CONTROL_env;
+            daikin.env = CTEMP_NONE;
             daikin.remote = 0;
+            daikin.status_extras = 1;
             controlstop ();
          }
          // Local auto controls
          if (daikin.power && daikin.controlvalid && !revk_shutting_down (NULL))
          {                      // Local auto controls
             // Get the settings atomically
-            if (isnan (min) || isnan (max))
+            if (min == CTEMP_NONE || max == CTEMP_NONE)
                controlstop ();
             else
             {                   // Control
                controlstart (); // Will do nothing if control already active
 
                // What the A/C is using as current temperature
-               float reference = NAN;
+               int reference = CTEMP_NONE;
                if ((daikin.status_known & (CONTROL_home | CONTROL_inlet)) == (CONTROL_home | CONTROL_inlet))    // Both values are known
                   reference = (daikin.home * thermref + daikin.inlet * (100 - thermref)) / 100; // thermref is how much inlet and home are used as reference
                else if (daikin.status_known & CONTROL_home)
@@ -3898,7 +4561,8 @@ app_main ()
                if (daikin.mode == 3)
                   daikin_set_e (mode, hot ? "H" : "C"); // Out of auto
                // Temp set
-               float set = (min + max) / 2.0;   // Target temp we will be setting (before adjust for reference error and before limiting)
+               int set = (min + max) / 2;       // Target temp we will be setting (before adjust for reference error and before limiting)
+               uint8_t setvalid = (reference != CTEMP_NONE || (!temptrack && !tempadjust));   // Unless based on a reference we don't have
                if (thermostat)
                   set = (((hot && daikin.hysteresis) || (!hot && !daikin.hysteresis)) ? max : min);
                if (temptrack)
@@ -3912,11 +4576,11 @@ app_main ()
                      daikin.hysteresis = 1;     // We're on, so keep going to "beyond"
                   if (hot)
                   {
-                     set += heatover;   // Ensure heating by applying A/C offset to force it
+                     set += CTEMP (heatover);   // Ensure heating by applying A/C offset to force it
                      daikin.action = HVAC_HEATING;
                   } else
                   {
-                     set -= coolover;   // Ensure cooling by applying A/C offset to force it
+                     set -= CTEMP (coolover);   // Ensure cooling by applying A/C offset to force it
                      daikin.action = HVAC_COOLING;
                   }
                   if (!noled && autolcontrol)
@@ -3934,9 +4598,9 @@ app_main ()
                      samplestart ();    // Initial phase complete, start samples again.
                   }
                   if (hot)
-                     set -= heatback;   // Heating mode but apply negative offset to not actually heat any more than this
+                     set -= CTEMP (heatback);   // Heating mode but apply negative offset to not actually heat any more than this
                   else
-                     set += coolback;   // Cooling mode but apply positive offset to not actually cool any more than this
+                     set += CTEMP (coolback);   // Cooling mode but apply positive offset to not actually cool any more than this
                   if (!noled && autolcontrol)
                   {
                      daikin_set_v (led, 0);
@@ -3945,17 +4609,17 @@ app_main ()
 
                // Limit settings to acceptable values
                if (proto_type () == PROTO_TYPE_CN_WIRED)
-                  set = roundf (set);   // CN_WIRED only does 1C steps
+                  set = ctemp_round (set, CTEMP (1));   // CN_WIRED only does 1C steps
                else if (proto_type () == PROTO_TYPE_S21)
-                  set = roundf (set * 2.0) / 2.0;       // S21 only does 0.5C steps
-               if (set < (hot ? tmin : tcoolmin))
-                  set = (hot ? tmin : tcoolmin);
-               if (set > (hot ? theatmax : tmax))
-                  set = (hot ? theatmax : tmax);
+                  set = ctemp_round (set, CTEMP (0.5)); // S21 only does 0.5C steps
+               if (set < CTEMP (hot ? tmin : tcoolmin))
+                  set = CTEMP (hot ? tmin : tcoolmin);
+               if (set > CTEMP (hot ? theatmax : tmax))
+                  set = CTEMP (hot ? theatmax : tmax);
                static uint32_t flap = 0;
                static uint8_t lastaction = 0;
-               static float lastset = 0;
-               if (!isnan (set) && (daikin.action != lastaction || (set != lastset && now > flap)))
+               static int lastset = 0;
+               if (setvalid && (daikin.action != lastaction || (set != lastset && now > flap)))
                {
                   flap = now + tempnoflap;      // Hold off changes for preset time, unless change of mode
                   lastaction = daikin.action;
@@ -3976,6 +4640,26 @@ app_main ()
          }
          // End of local auto controls
 
+         if (history && protocol_set)
+         {                      // History
+            time_t clock = time (0);
+            static uint32_t last = 0;
+            if (clock >= 1600000000 && clock / 60 != last)
+            {                   // Clock is set, and a new minute
+               last = clock / 60;
+               int32_t v[HISTORY_VALUES] = { 0 };
+#define	t(name)		v[HISTORY_##name]=(daikin.name==CTEMP_NONE?CTEMP_NONE:ctemp_round(daikin.name,CTEMP(0.1))/CTEMP(0.1));
+#define	r(name)		v[HISTORY_min##name]=(daikin.min##name==CTEMP_NONE?CTEMP_NONE:ctemp_round(daikin.min##name,CTEMP(0.1))/CTEMP(0.1));	\
+			v[HISTORY_max##name]=(daikin.max##name==CTEMP_NONE?CTEMP_NONE:ctemp_round(daikin.max##name,CTEMP(0.1))/CTEMP(0.1));
+#define	i(name)		v[HISTORY_##name]=daikin.name;
+#define	e(name,values)	v[HISTORY_##name]=daikin.name;
+#define	b(name)		if(daikin.name)v[HISTORY_BOOLS]|=(1<<HISTORY_B_##name);
+#include "acextras.m"
+               xSemaphoreTake (daikin.mutex, portMAX_DELAY);
+               ac_history_add (history, last, v);
+               xSemaphoreGive (daikin.mutex);
+            }
+         }
          if (reporting && !revk_link_down () && protocol_set)
          {                      // Environment logging
             time_t clock = time (0);
@@ -3983,38 +4667,40 @@ app_main ()
             if (clock / reporting != last / reporting)
             {
                last = clock;
-               if (daikin.statscount)
+               if (stats.samples)
                {
-                  jo_t j = jo_comms_alloc ();
-                  {             // Timestamp
-                     struct tm tm;
-                     gmtime_r (&clock, &tm);
-                     jo_stringf (j, "ts", "%04d-%02d-%02dT%02d:%02d:%02dZ", tm.tm_year + 1900,
-                                 tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec);
-                  }
-#define	b(name)		if(daikin.status_known&CONTROL_##name){if(!daikin.total##name)jo_bool(j,#name,0);else if(fixstatus||daikin.total##name==daikin.statscount)jo_bool(j,#name,1);else jo_litf(j,#name,"%.2f",(float)daikin.total##name/daikin.statscount);} \
-		  	daikin.total##name=0;
-#define	t(name)		if(daikin.count##name&&!isnan(daikin.total##name)){if(fixstatus||daikin.min##name==daikin.max##name)jo_litf(j,#name,"%.2f",daikin.min##name);	\
-		  	else {jo_array(j,#name);jo_litf(j,NULL,"%.2f",daikin.min##name);jo_litf(j,NULL,"%.2f",daikin.total##name/daikin.count##name);jo_litf(j,NULL,"%.2f",daikin.max##name);jo_close(j);}}	\
-		  	daikin.min##name=NAN;daikin.total##name=0;daikin.max##name=NAN;daikin.count##name=0;
-#define	r(name)		if(!isnan(daikin.min##name)&&!isnan(daikin.max##name)){if(fixstatus||daikin.min##name==daikin.max##name)jo_litf(j,#name,"%.2f",daikin.min##name);	\
-			else {jo_array(j,#name);jo_litf(j,NULL,"%.2f",daikin.min##name);jo_litf(j,NULL,"%.2f",daikin.max##name);jo_close(j);}}
-#define	i(name)		if(daikin.status_known&CONTROL_##name){if(fixstatus||daikin.min##name==daikin.max##name)jo_int(j,#name,daikin.total##name/daikin.statscount);     \
-                        else {jo_array(j,#name);jo_int(j,NULL,daikin.min##name);jo_int(j,NULL,daikin.total##name/daikin.statscount);jo_int(j,NULL,daikin.max##name);jo_close(j);}       \
-                        daikin.min##name=0;daikin.total##name=0;daikin.max##name=0;}
-#define e(name,values)  if((daikin.status_known&CONTROL_##name)&&daikin.name<sizeof(CONTROL_##name##_VALUES)-1)jo_stringf(j,#name,"%c",CONTROL_##name##_VALUES[daikin.name]);
-#include "acextras.m"
-                  revk_mqtt_send_clients (appname, 0, NULL, &j, 1);
-                  daikin.statscount = 0;
+                  ja_t *j = ja_build (JSON_ARENA_REPORT, ja_report, &clock);
+                  ja_send (appname, 0, NULL, j, 1);
+                  ac_stats_reset (&stats);
                   ha_status ();
                }
             }
          }
+         if (statsperiod && !revk_link_down () && protocol_set)
+         {                      // Bus statistics
+            static uint32_t last = 0;
+            uint32_t now = uptime ();
+            if (now / statsperiod != last / statsperiod)
+            {
+               last = now;
+               ja_t *j = ja_build_heap (JSON_ARENA_COMMS, ja_bus_stats, NULL);
+               ja_info ("stats", j);
+            }
+         }
          if (daikin.ha_send && protocol_set && daikin.talking)
          {
             send_ha_config ();
             ha_status ();       // Update status now sent
          }
+         {
+            uint32_t us = esp_timer_get_time () - loop_start;
+            if (loop_cpu.cycles == UINT32_MAX || loop_cpu.total + us < loop_cpu.total)
+               memset (&loop_cpu, 0, sizeof (loop_cpu));        // Start again rather than wrap
+            loop_cpu.cycles++;
+            loop_cpu.total += us;
+            if (us > loop_cpu.max)
+               loop_cpu.max = us;
+         }
       }
       while (daikin.talking);
       // We're here if protocol has been broken. We'll reconfigure the UART
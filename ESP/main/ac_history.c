@@ -0,0 +1,237 @@
+/* Compressed per-minute history */
+/* Copyright ©2022 Adrian Kennard, Andrews & Arnold Ltd. See LICENCE file for details .GPL 3.0 */
+
+#include <string.h>
+#include "ac_history.h"
+
+// Record header bits
+#define	REC_GAP		1       // Minutes skipped, as a varint, follows
+#define	REC_MASK	2       // New mask, as a varint, follows. Otherwise the previous mask applies
+
+#define	REC_MAX		(1 + 5 + 5 + HISTORY_VALUES * 5)        // Longest record
+
+_Static_assert (HISTORY_VALUES <= 32, "Too many values for the change mask");
+
+const char *const ac_history_names[HISTORY_VALUES] = {
+#define	t(name)		#name,
+#define	r(name)		"min"#name,"max"#name,
+#define	i(name)		#name,
+#define	e(name,values)	#name,
+#include "acextras.m"
+   "bools"
+};
+
+const char *const ac_history_bool_names[HISTORY_B] = {
+#define	b(name)		#name,
+#include "acextras.m"
+};
+
+static int
+put_varint (uint8_t * p, uint32_t v)
+{
+   int n = 0;
+   while (v >= 0x80)
+   {
+      p[n++] = v | 0x80;
+      v >>= 7;
+   }
+   p[n++] = v;
+   return n;
+}
+
+static uint32_t
+zigzag (int32_t v)
+{
+   return ((uint32_t) v << 1) ^ (uint32_t) (v >> 31);
+}
+
+static int32_t
+unzigzag (uint32_t v)
+{
+   return (int32_t) (v >> 1) ^ -(int32_t) (v & 1);
+}
+
+static uint32_t
+get_varint (const ac_history_t * h, uint16_t * pos)
+{                               // From the ring
+   uint32_t v = 0;
+   int shift = 0;
+   uint8_t c;
+   do
+   {
+      c = h->buf[*pos];
+      *pos = (*pos + 1) % HISTORY_SIZE;
+      if (shift < 32)
+         v |= (uint32_t) (c & 0x7F) << shift;
+      shift += 7;
+   }
+   while (c & 0x80);
+   return v;
+}
+
+static void
+decode (const ac_history_t * h, uint16_t * pos, ac_history_sample_t * s)
+{                               // Apply record at pos to s
+   uint32_t head = get_varint (h, pos);
+   s->minute++;
+   if (head & REC_GAP)
+      s->minute += get_varint (h, pos);
+   if (head & REC_MASK)
+      s->mask = get_varint (h, pos);
+   for (int n = 0; n < HISTORY_VALUES; n++)
+      if (s->mask & (1UL << n))
+         s->v[n] += unzigzag (get_varint (h, pos));
+}
+
+void
+ac_history_reset (ac_history_t * h)
+{
+   h->gone += h->used + 1;      // So that a walk can tell, even if the ring was empty
+   h->tail = h->used = h->records = 0;
+   h->valid = 0;
+}
+
+void
+ac_history_add (ac_history_t * h, uint32_t minute, const int32_t * v)
+{
+   if (h->valid && minute <= h->last.minute)
+   {
+      if (minute == h->last.minute)
+         return;                // Already have it
+      ac_history_reset (h);     // Clock went back
+   }
+   if (!h->valid)
+   {
+      h->base.minute = minute;
+      h->base.mask = 0;
+      memcpy (h->base.v, v, sizeof (h->base.v));
+      h->last = h->base;
+      h->valid = 1;
+      return;
+   }
+   uint8_t rec[REC_MAX];
+   uint32_t changed = 0;
+   for (int n = 0; n < HISTORY_VALUES; n++)
+      if (v[n] != h->last.v[n])
+         changed |= (1UL << n);
+   uint32_t gap = minute - h->last.minute - 1;
+   int len = 1;
+   // Keep the previous mask if it covers what has changed and its zeros (a byte each) are no longer than a new mask
+   uint32_t mask = changed;
+   if (!(changed & ~h->last.mask) && __builtin_popcount (h->last.mask & ~changed) <= put_varint (rec, changed))
+      mask = h->last.mask;
+   rec[0] = (gap ? REC_GAP : 0) | (mask != h->last.mask ? REC_MASK : 0);
+   if (gap)
+      len += put_varint (rec + len, gap);
+   if (mask != h->last.mask)
+      len += put_varint (rec + len, mask);
+   for (int n = 0; n < HISTORY_VALUES; n++)
+      if (mask & (1UL << n))
+         len += put_varint (rec + len, zigzag (v[n] - h->last.v[n]));
+   while (h->records && h->used + len > HISTORY_SIZE)
+   {                            // Fold oldest record in to base
+      uint16_t pos = h->tail;
+      decode (h, &pos, &h->base);
+      uint16_t l = (pos + HISTORY_SIZE - h->tail) % HISTORY_SIZE;
+      h->used -= l;
+      h->gone += l;
+      h->tail = pos;
+      h->records--;
+   }
+   uint16_t head = (h->tail + h->used) % HISTORY_SIZE;
+   for (int i = 0; i < len; i++)
+      h->buf[(head + i) % HISTORY_SIZE] = rec[i];
+   h->used += len;
+   h->records++;
+   h->last.minute = minute;
+   h->last.mask = mask;
+   memcpy (h->last.v, v, sizeof (h->last.v));
+}
+
+int
+ac_history_first (const ac_history_t * h, ac_history_iter_t * i)
+{
+   if (!h->valid)
+      return 0;
+   i->s = h->base;
+   i->pos = h->tail;
+   i->at = h->gone;
+   return 1;
+}
+
+int
+ac_history_next (const ac_history_t * h, ac_history_iter_t * i)
+{
+   if ((int32_t) (h->gone - i->at) > 0)
+   {                            // Overtaken, the record at pos has been folded away
+      if (!h->valid || h->base.minute <= i->s.minute)
+         return 0;              // Reset
+      i->s = h->base;
+      i->pos = h->tail;
+      i->at = h->gone;
+      return 1;
+   }
+   if (i->at == h->gone + h->used)
+      return 0;
+   uint16_t pos = i->pos;
+   decode (h, &i->pos, &i->s);
+   i->at += (i->pos + HISTORY_SIZE - pos) % HISTORY_SIZE;
+   return 1;
+}
+
+int
+ac_history_export (const ac_history_t * h, ac_history_export_t * e, uint8_t * buf, int max)
+{
+   uint8_t tmp[5];
+   uint32_t len = 0;
+   int n = 0;
+   void add (const void *data, int l)
+   {                            // Only what falls in this piece
+      for (const uint8_t * d = data; l--; d++, len++)
+         if (len >= e->off && n < max)
+            buf[n++] = *d;
+   }
+   void add_varint (uint32_t v)
+   {
+      add (tmp, put_varint (tmp, v));
+   }
+   if (!e->off)
+   {                            // Start
+      e->gone = h->gone;
+      e->head = 0;
+      e->tail = h->tail;
+      e->used = h->valid ? h->used : 0;
+      e->records = h->valid ? h->records + 1 : 0;
+   } else if (h->gone - e->gone > (e->off > e->head ? e->off - e->head : 0))
+      return -1;                // Bytes we still need have been folded away, or the ring reset
+   if (!e->head || e->off < e->head)
+   {                            // The base is as it was, as nothing has gone
+      add ("FKH1", 4);
+      for (int v = 0; v < HISTORY_VALUES; v++)
+      {
+         if (v)
+            add (",", 1);
+         add (ac_history_names[v], strlen (ac_history_names[v]));
+      }
+      for (int b = 0; b < HISTORY_B; b++)
+      {                         // Bits of bools, in order
+         add (b ? "," : ":", 1);
+         add (ac_history_bool_names[b], strlen (ac_history_bool_names[b]));
+      }
+      add ("", 1);
+      add_varint (HISTORY_VALUES);
+      add_varint (e->records);
+      if (e->records)
+      {
+         add_varint (h->base.minute);
+         add_varint (h->base.mask);
+         for (int v = 0; v < HISTORY_VALUES; v++)
+            add_varint (zigzag (h->base.v[v]));
+      }
+      e->head = len;
+   }
+   for (uint32_t r = e->off + n - e->head; n < max && r < e->used; r++)
+      buf[n++] = h->buf[(e->tail + r) % HISTORY_SIZE];
+   e->off += n;
+   return n;
+}
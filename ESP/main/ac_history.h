@@ -0,0 +1,91 @@
+#ifndef _AC_HISTORY_H
+#define _AC_HISTORY_H
+
+// Per-minute history of the acextras.m fields, in a fixed ring of bytes.
+// Each sample is stored as the change from the one before: a header, then a zigzag varint
+// difference for each value in a change mask. The oldest sample is kept whole, in base, so when
+// the ring is full the oldest record is folded into it. Independent of ESP, so it also builds on a
+// host, see Tools/Simulators/history-check.c
+
+#include <stdint.h>
+
+#include "faikin_enums.h"
+
+#define	HISTORY_SIZE	6656    // Bytes of records, typically a little more than a day
+
+// Values in a sample. Temperatures are in 0.1C, CTEMP_NONE if not known, bools are bits in one value
+enum
+{
+#define	t(name)		HISTORY_##name,
+#define	r(name)		HISTORY_min##name,HISTORY_max##name,
+#define	i(name)		HISTORY_##name,
+#define	e(name,values)	HISTORY_##name,
+#include "acextras.m"
+   HISTORY_BOOLS,
+   HISTORY_VALUES
+};
+enum
+{
+#define	b(name)		HISTORY_B_##name,
+#include "acextras.m"
+   HISTORY_B
+};
+
+typedef struct ac_history_sample_s
+{
+   uint32_t minute;             // time () / 60
+   uint32_t mask;               // Values in the record, the decoder needs this as records can say "same as before"
+   int32_t v[HISTORY_VALUES];
+} ac_history_sample_t;
+
+typedef struct ac_history_s
+{
+   ac_history_sample_t base;    // Oldest sample
+   ac_history_sample_t last;    // Newest sample, which the next is recorded against
+   uint16_t tail;               // Oldest record in buf
+   uint16_t used;               // Bytes in buf
+   uint16_t records;            // Samples after base
+   uint32_t gone;               // Bytes ever freed from the tail, and one more for each reset, see ac_history_next()
+   uint8_t valid:1;             // We have a base
+   uint8_t buf[HISTORY_SIZE];
+} ac_history_t;
+
+// Value names, for CSV and binary headers
+extern const char *const ac_history_names[HISTORY_VALUES];
+extern const char *const ac_history_bool_names[HISTORY_B];
+
+// Start again
+void ac_history_reset (ac_history_t * h);
+
+// Add a sample, once a minute. Going back in time starts again
+void ac_history_add (ac_history_t * h, uint32_t minute, const int32_t * v);
+
+// Walk samples from oldest, returns 0 when there are no more. The ring can change between calls, so a
+// caller need only lock it for each call. If the walk is overtaken by the oldest records being folded away,
+// it carries on from the new oldest sample, so some minutes are missed, and it stops if the ring is reset
+typedef struct ac_history_iter_s
+{
+   ac_history_sample_t s;
+   uint16_t pos;
+   uint32_t at;                 // Where pos is, counted as gone is
+} ac_history_iter_t;
+int ac_history_first (const ac_history_t * h, ac_history_iter_t * i);
+int ac_history_next (const ac_history_t * h, ac_history_iter_t * i);
+
+// Binary form, for /history: "FKH1", then value names, comma separated, with the bool names after a colon,
+// NUL terminated. Then varints: number of values, number of samples, and if any, the oldest sample (minute,
+// mask, zigzag values), followed by the records as they are in the ring.
+// Made a piece at a time, up to max bytes in to buf, so a caller need only lock the ring for each call.
+// Start with e zeroed. Returns bytes in buf, 0 at the end, or -1 if the ring has changed under the piece
+typedef struct ac_history_export_s
+{
+   uint32_t off;                // Bytes done
+   uint32_t gone;               // As when we started
+   uint16_t head;               // Bytes before the records
+   uint16_t tail;
+   uint16_t used;
+   uint16_t records;
+} ac_history_export_t;
+int ac_history_export (const ac_history_t * h, ac_history_export_t * e, uint8_t * buf, int max);
+
+#endif
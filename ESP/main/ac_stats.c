@@ -0,0 +1,76 @@
+/* Environment report statistics */
+/* Copyright ©2022 Adrian Kennard, Andrews & Arnold Ltd. See LICENCE file for details .GPL 3.0 */
+
+#include <string.h>
+#include "ac_stats.h"
+
+void
+ac_stats_reset (ac_stats_t * s)
+{
+   memset (s, 0, sizeof (*s));
+   for (int n = 0; n < STATS_T; n++)
+      s->tmin[n] = s->tmax[n] = CTEMP_NONE;
+}
+
+void
+ac_stats_bool (ac_stats_t * s, int n, int v)
+{
+   if (v)
+      s->btrue[n]++;
+}
+
+void
+ac_stats_temp (ac_stats_t * s, int n, int v)
+{
+   if (v == CTEMP_NONE)
+      return;
+   if (!s->tcount[n] || s->tmin[n] > v)
+      s->tmin[n] = v;
+   if (!s->tcount[n] || s->tmax[n] < v)
+      s->tmax[n] = v;
+   s->ttotal[n] += v;
+   s->tcount[n]++;
+}
+
+void
+ac_stats_int (ac_stats_t * s, int n, int v)
+{
+   if (!s->samples || s->imin[n] > v)
+      s->imin[n] = v;
+   if (!s->samples || s->imax[n] < v)
+      s->imax[n] = v;
+   s->itotal[n] += v;
+}
+
+void
+ac_stats_next (ac_stats_t * s)
+{
+   if (!ac_stats_full (s))
+      s->samples++;
+}
+
+int
+ac_stats_bool_frac (const ac_stats_t * s, int n)
+{
+   if (!s->samples)
+      return 0;
+   return ((int32_t) s->btrue[n] * 100 + s->samples / 2) / s->samples;
+}
+
+int
+ac_stats_temp_avg (const ac_stats_t * s, int n)
+{                               // Rounded, halves away from zero
+   int c = s->tcount[n];
+   if (!c)
+      return CTEMP_NONE;
+   int32_t t = s->ttotal[n];
+   return (t + (t < 0 ? -c / 2 : c / 2)) / c;
+}
+
+int
+ac_stats_int_avg (const ac_stats_t * s, int n)
+{
+   if (!s->samples)
+      return 0;
+   return s->itotal[n] / s->samples;
+}
@@ -0,0 +1,64 @@
+#ifndef _AC_STATS_H
+#define _AC_STATS_H
+
+// Accumulators for the periodic environment report, laid out from acextras.m.
+// These are cold, only touched once a main loop and when reporting, so they are kept
+// apart from the live values, one array per accumulator, sized for what they hold.
+// Independent of ESP, so it also builds on a host, see Tools/Simulators/stats-check.c
+
+#include <stdint.h>
+
+#include "faikin_enums.h"
+
+// Index of each field in its arrays
+enum
+{
+#define	b(name)		STATS_B_##name,
+#include "acextras.m"
+   STATS_B
+};
+enum
+{
+#define	t(name)		STATS_T_##name,
+#include "acextras.m"
+   STATS_T
+};
+enum
+{
+#define	i(name)		STATS_I_##name,
+#include "acextras.m"
+   STATS_I
+};
+
+// Samples in one report, after which sampling stops until the report is sent
+#define	STATS_MAX_SAMPLES	UINT16_MAX
+
+typedef struct ac_stats_s
+{
+   uint16_t samples;            // Number of samples, for b() and i()
+   uint16_t btrue[STATS_B];     // Samples where true
+   uint16_t tcount[STATS_T];    // Samples where known
+   ctemp_t tmin[STATS_T];
+   ctemp_t tmax[STATS_T];
+   int32_t ttotal[STATS_T];     // Can't overflow, |CTEMP_NONE| * STATS_MAX_SAMPLES fits
+   int32_t imin[STATS_I];
+   int32_t imax[STATS_I];
+   int32_t itotal[STATS_I];
+} ac_stats_t;
+
+// Start again, e.g. after a report
+void ac_stats_reset (ac_stats_t * s);
+
+// A sample is each value added, unless ac_stats_full(), then ac_stats_next()
+#define	ac_stats_full(s)	((s)->samples == STATS_MAX_SAMPLES)
+void ac_stats_bool (ac_stats_t * s, int n, int v);
+void ac_stats_temp (ac_stats_t * s, int n, int v);     // CTEMP_NONE is not counted
+void ac_stats_int (ac_stats_t * s, int n, int v);
+void ac_stats_next (ac_stats_t * s);
+
+// Averages, rounded as reported
+int ac_stats_bool_frac (const ac_stats_t * s, int n);  // Hundredths of samples where true
+int ac_stats_temp_avg (const ac_stats_t * s, int n);   // CTEMP_NONE if none known
+int ac_stats_int_avg (const ac_stats_t * s, int n);
+
+#endif
@@ -27,6 +27,7 @@
 b(online)
 b(control)
 s(model,20)
+s(modelname,32)
 t(home)
 b(heat)
 b(slave)
@@ -39,5 +40,11 @@ t(inlet)
 t(liquid)
 i(anglev)
 i(Wh)
+t(flowtemp)
+t(returntemp)
+t(tank)
+t(tanktarget)
+i(waterflow)
+b(pump)
 
 #include "accontrols.m"
@@ -0,0 +1,29 @@
+// Altherma_S registers
+// Each line maps part of a register reply to a field (see acfields.m). Offsets are in the 16 data bytes
+// that follow the register code in the reply. They are from community notes on protocol S and have not been
+// checked on a real unit, so they are only used with the asdecode setting - use dump to see raw replies,
+// and check them against the unit's own display before relying on them.
+
+#ifndef f
+#define f(reg,name,decoder,offset,arg)  // Field: decoder (AS_DEC_xxx) is applied to data[offset] with arg
+#endif
+
+// T - water and refrigerant temperatures, signed 16 bits, 0.1C
+f(T,flowtemp,TEMP,0,0)          // Leaving water
+f(T,returntemp,TEMP,2,0)        // Return water
+f(T,tank,TEMP,4,0)              // Domestic hot water
+f(T,outside,TEMP,6,0)
+f(T,liquid,TEMP,8,0)            // Refrigerant after the plate heat exchanger
+
+// U - compressor and water flow
+f(U,comp,BYTE,0,1)              // Compressor frequency, Hz
+f(U,waterflow,WORD,2,6)         // 0.1 l/min, reported as l/h
+
+// P - operating states
+f(P,pump,BIT,0,0x02)            // Water pump running
+f(P,antifreeze,BIT,0,0x10)      // Defrost
+
+// S - settings, rarely change
+f(S,tanktarget,TEMP,0,0)        // Domestic hot water target
+
+#undef	f
@@ -0,0 +1,54 @@
+/* Bus statistics */
+/* Copyright ©2022 Adrian Kennard, Andrews & Arnold Ltd. See LICENCE file for details .GPL 3.0 */
+
+#include <string.h>
+#include "bus_stats.h"
+
+const uint16_t bus_stats_limit[BUS_STATS_BUCKETS - 1] = { BUS_STATS_LIMITS };
+
+bus_stat_t bus_stats[BUS_STATS_MAX];
+int bus_stats_count = 0;
+
+bus_stat_t *
+bus_stats_find (const char *cmd)
+{
+   for (int i = 0; i < bus_stats_count; i++)
+      if (!strncmp (bus_stats[i].cmd, cmd, sizeof (bus_stats[i].cmd) - 1))
+         return &bus_stats[i];
+   if (bus_stats_count == BUS_STATS_MAX)
+      return NULL;
+   bus_stat_t *s = &bus_stats[bus_stats_count++];
+   memset (s, 0, sizeof (*s));
+   strncpy (s->cmd, cmd, sizeof (s->cmd) - 1);
+   return s;
+}
+
+void
+bus_stats_result (bus_stat_t * s, int result)
+{
+   if (s && result >= 0 && result < BUS_RESULTS)
+      s->result[result]++;
+}
+
+void
+bus_stats_time (bus_hist_t * h, int64_t us)
+{
+   if (!h || us < 0)
+      return;
+   uint32_t ms = us / 1000;
+   int b = 0;
+   while (b < BUS_STATS_BUCKETS - 1 && ms > bus_stats_limit[b])
+      b++;
+   if (h->count[b] == UINT16_MAX)
+      for (int i = 0; i < BUS_STATS_BUCKETS; i++)
+         h->count[i] /= 2;      // Keep the shape, lose some history
+   h->count[b]++;
+   if (ms > h->max)
+      h->max = (ms > UINT16_MAX ? UINT16_MAX : ms);
+}
+
+void
+bus_stats_reset (void)
+{
+   bus_stats_count = 0;
+}
@@ -0,0 +1,58 @@
+#ifndef _BUS_STATS_H
+#define _BUS_STATS_H
+
+// Per-command bus statistics: result counters and fixed bucket latency histograms.
+// Kept small, as a fixed table, and independent of ESP, so it also builds on a host.
+
+#include <stdint.h>
+
+#define BUS_STATS_MAX     40    // Number of different commands we keep stats for
+#define BUS_STATS_BUCKETS 6     // Latency buckets, see bus_stats_limit
+
+// Upper limits of latency buckets (ms), the last bucket is everything above
+#define BUS_STATS_LIMITS  20, 50, 100, 200, 500
+
+// Results
+enum
+{
+   BUS_OK,
+   BUS_NAK,
+   BUS_TIMEOUT,
+   BUS_BADSUM,
+   BUS_LOOPBACK,
+   BUS_BAD,                     // Anything else malformed
+   BUS_RESULTS
+};
+#define BUS_RESULT_NAMES "ok", "nak", "timeout", "badsum", "loopback", "bad"
+
+typedef struct bus_hist_s
+{
+   uint16_t count[BUS_STATS_BUCKETS];   // Halved when one fills up, so the shape is kept
+   uint16_t max;                // Longest seen (ms)
+} bus_hist_t;
+
+typedef struct bus_stat_s
+{
+   char cmd[5];                 // Command, as text
+   uint32_t result[BUS_RESULTS];
+   bus_hist_t ack;              // Command sent to ACK
+   bus_hist_t reply;            // ACK, or command sent if protocol has no ACK, to end of response
+} bus_stat_t;
+
+extern const uint16_t bus_stats_limit[BUS_STATS_BUCKETS - 1];
+extern bus_stat_t bus_stats[BUS_STATS_MAX];
+extern int bus_stats_count;
+
+// Find or add stats for a command, NULL if table is full
+bus_stat_t *bus_stats_find (const char *cmd);
+
+// Count a result (BUS_xxx). s can be NULL
+void bus_stats_result (bus_stat_t * s, int result);
+
+// Add a time (us) to a histogram
+void bus_stats_time (bus_hist_t * h, int64_t us);
+
+// Start again, e.g. when protocol has been found. A stat still held by a caller is no longer counted
+void bus_stats_reset (void);
+
+#endif
@@ -0,0 +1,97 @@
+/* Daikin CN_WIRED waveform encoder and decoder */
+/* Copyright ©2024 Pavel Fedin. See LICENCE file for details .GPL 3.0 */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "cn_wired_codec.h"
+
+const uint16_t cnw_nominal[CNW_PULSES] = {
+    CNW_SYNC_LENGTH, CNW_START_LENGTH, CNW_BIT_0_LENGTH, CNW_BIT_1_LENGTH, CNW_SPACE_LENGTH, CNW_END_DELAY, CNW_END_LENGTH
+};
+
+void cnw_encoder_start (cnw_encoder_t *e, const uint8_t *data)
+{
+    memcpy(e->data, data, CNW_PKT_LEN);
+    e->pos = 0;
+}
+
+int cnw_encoder_next (cnw_encoder_t *e)
+{
+    // SYNC, START, then SPACE before each data bit and after the last one, then DELAY and END
+    int i = e->pos;
+
+    if (i > CNW_PKT_LEN * 16 + 4)
+        return CNW_NONE;
+    e->pos++;
+
+    if (i == 0)
+        return CNW_SYNC;
+    if (i == 1)
+        return CNW_START;
+
+    i -= 2;
+    if (i <= CNW_PKT_LEN * 16) {
+        if (!(i & 1))
+            return CNW_SPACE;
+        // Bytes are transmitted LSB first
+        i >>= 1;
+        return ((e->data[i >> 3] >> (i & 7)) & 1) ? CNW_ONE : CNW_ZERO;
+    }
+
+    return i == CNW_PKT_LEN * 16 + 1 ? CNW_DELAY : CNW_END;
+}
+
+void cnw_decoder_reset (cnw_decoder_t *d)
+{
+    d->bits = -1; // "Wait for sync" state
+}
+
+int cnw_decode (cnw_decoder_t *d, int high, uint32_t length)
+{
+    if (!high) {
+        // SYNC, space between bits or the trailer
+        if (length > CNW_SYNC_LENGTH - CNW_THRESHOLD) {
+            // The packet always starts with a single HIGH pulse of 1000 usecs, which
+            // we count as bit 0, the next bit is going to be LSB of 1st byte.
+            int ev = CNW_EV_SYNC;
+
+            if (d->bits >= 0 && d->bits < CNW_PKT_BITS)
+                ev |= CNW_EV_PARTIAL;
+            memset(d->data, 0, CNW_PKT_LEN);
+            d->bits  = 0;
+            d->clean = 0;
+            return ev;
+        }
+        if (d->bits > 0 && d->bits < CNW_PKT_BITS)
+            return CNW_EV_SPACE;
+        if (d->bits == CNW_PKT_BITS && length > CNW_END_LENGTH - CNW_THRESHOLD) {
+            d->bits = -1;
+            return CNW_EV_TRAILER;
+        }
+        return 0;
+    }
+
+    if (d->bits < 0 || d->bits >= CNW_PKT_BITS)
+        return 0; // Not in a packet
+
+    // High bit - 900us, low bit - 400us
+    int v = length > CNW_BIT_1_LENGTH - CNW_THRESHOLD;
+    int ev = v ? CNW_EV_ONE : CNW_EV_ZERO;
+    int nominal = !d->bits ? CNW_START_LENGTH : v ? CNW_BIT_1_LENGTH : CNW_BIT_0_LENGTH;
+
+    if (abs((int)length - nominal) < CNW_THRESHOLD)
+        d->clean++;
+    else
+        ev |= CNW_EV_MARGINAL;
+
+    if (d->bits) {
+        int i = d->bits - 1;
+
+        d->data[i >> 3] |= v << (i & 7);
+    }
+    if (++d->bits == CNW_PKT_BITS)
+        ev |= CNW_EV_PACKET;
+
+    return ev;
+}
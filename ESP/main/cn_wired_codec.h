@@ -0,0 +1,75 @@
+#ifndef _CN_WIRED_CODEC_H
+#define _CN_WIRED_CODEC_H
+
+// CN_WIRED waveform encoder and decoder. There is no hardware here: the decoder is fed with
+// line states and their lengths, as an edge interrupt sees them, and the encoder gives line
+// states to send one at a time, as a timer interrupt needs them. So this also builds on a host,
+// see Tools/Simulators/cnw-bench.c
+
+#include <stdint.h>
+
+#include "cn_wired.h"
+
+// Pulse lengths in microseconds
+#define CNW_SYNC_LENGTH  2600
+#define CNW_START_LENGTH 1000
+#define CNW_SPACE_LENGTH 300
+#define CNW_BIT_1_LENGTH 900
+#define CNW_BIT_0_LENGTH 400
+#define CNW_END_DELAY    16000
+#define CNW_END_LENGTH   2000
+// Detection tolerance
+#define CNW_THRESHOLD 200
+// Number of bits in a packet, including start bit
+#define CNW_PKT_BITS (CNW_PKT_LEN * 8 + 1)
+
+// Kinds of line state. SYNC, SPACE and END are LOW, the rest are HIGH
+enum {
+    CNW_SYNC,
+    CNW_START,
+    CNW_ZERO,
+    CNW_ONE,
+    CNW_SPACE,
+    CNW_DELAY,
+    CNW_END,
+    CNW_PULSES,
+    CNW_NONE = CNW_PULSES
+};
+
+// Nominal lengths of the above
+extern const uint16_t cnw_nominal[CNW_PULSES];
+
+typedef struct cnw_encoder_s
+{
+    uint8_t data[CNW_PKT_LEN];
+    int16_t pos;
+} cnw_encoder_t;
+
+void cnw_encoder_start (cnw_encoder_t *e, const uint8_t *data);
+// Next line state to send, CNW_NONE when done. It starts with CNW_SYNC, and the line goes LOW and HIGH in turn
+int cnw_encoder_next (cnw_encoder_t *e);
+
+// Decoder events, a bit mask
+#define CNW_EV_SYNC     1   // SYNC seen, a packet starts
+#define CNW_EV_PARTIAL  2   // ... while the previous one was incomplete
+#define CNW_EV_SPACE    4   // Space between bits
+#define CNW_EV_ZERO     8   // Bit decoded, start bit is a one
+#define CNW_EV_ONE      16
+#define CNW_EV_MARGINAL 32  // ... not within CNW_THRESHOLD of its nominal length
+#define CNW_EV_PACKET   64  // Packet complete, data is valid
+#define CNW_EV_TRAILER  128 // Trailer has ended, line is free
+
+typedef struct cnw_decoder_s
+{
+    uint8_t data[CNW_PKT_LEN];
+    int16_t bits;  // Bits received including start bit, -1 waiting for SYNC, CNW_PKT_BITS waiting for trailer
+    uint8_t clean; // Bits with clean timing
+} cnw_decoder_t;
+
+void cnw_decoder_reset (cnw_decoder_t *d);
+// A line state has ended. high is what the line was, length is in microseconds. Returns CNW_EV_xxx
+int cnw_decode (cnw_decoder_t *d, int high, uint32_t length);
+// Percentage of bits of the packet with clean timing
+#define cnw_quality(d) ((d)->clean * 100 / CNW_PKT_BITS)
+
+#endif
@@ -3,64 +3,94 @@
 
 #include <esp_timer.h>
 #include <FreeRTOS.h>
-#include <limits.h>
+#include <stdlib.h>
 #include <string.h>
 #include <task.h>
 
 #include <driver/hw_timer.h>
 #include <esp8266/gpio_struct.h>
+#include <esp8266/pin_mux_register.h>
 #include <esp8266/timer_struct.h>
 #include <rom/gpio.h>
 
 #include "cn_wired.h"
+#include "cn_wired_codec.h"
 #include "cn_wired_driver.h"
 
-// Our RX buffers are prefixed by one byte, where start bit is stored.
-// See start()
-#define RX_LEN CNW_PKT_LEN + 1
-
-// Pulse lengths in microseconds
-#define SYNC_LENGTH  2600
-#define START_LENGTH 1000
-#define SPACE_LENGTH 300
-#define BIT_1_LENGTH 900
-#define BIT_0_LENGTH 400
-#define END_DELAY    16000
-#define END_LENGTH   2000
-// Detection tolerance
-#define THRESHOLD 200
+// Pulse lengths and waveform encoding are in cn_wired_codec.c, here we only time the line
+#define THRESHOLD CNW_THRESHOLD
+// Receive queue length, must be a power of 2
+#define RX_RING 4
+
+// Distribution of pulse lengths, in microseconds
+struct Pulse_Stat {
+    uint16_t min;
+    uint16_t max;
+    uint32_t count;
+    uint64_t total;
+};
+
+// Driver statistics, since install. Only updated by interrupts, so the only
+// harm in reading them from a task is an odd value being slightly stale
+struct CN_Wired_Stats {
+    unsigned int syncs;      // SYNC pulses seen
+    unsigned int packets;    // Complete packets received
+    unsigned int partial;    // Packets cut short by next SYNC
+    unsigned int spurious;   // Interrupts without a change of line state
+    unsigned int marginal;   // Bits not within THRESHOLD of either length
+    struct Pulse_Stat bit0;  // HIGH pulses read as 0
+    struct Pulse_Stat bit1;  // HIGH pulses read as 1, including start bit
+    struct Pulse_Stat space; // LOW between bits
+    uint16_t rx_isr_max;     // Worst case interrupt execution times
+    uint16_t tx_isr_max;
+};
 
 struct CN_Wired_Receiver {
-    uint8_t    buffer[RX_LEN];
+    cnw_decoder_t decoder;
+    int64_t    sync_time;   // End of SYNC pulse of the packet being received
+    // Completed packets. The interrupt only moves head, the reader only moves tail,
+    // so no locking is needed
+    cn_wired_packet_t ring[RX_RING];
+    volatile unsigned int head;
+    volatile unsigned int tail;
+    unsigned int dropped;   // Packets lost because the queue was full
+    volatile unsigned int rx_seq;      // Sequence number of the last complete packet
+    volatile unsigned int trailer_seq; // Sequence number of the last packet whose trailer has ended
+    // Raw capture ring, see cn_wired_capture_start(). Same producer/consumer rules as above
+    uint16_t*  capture;
+    unsigned int capture_mask;
+    volatile unsigned int capture_head;
+    volatile unsigned int capture_tail;
+    unsigned int capture_lost;      // Entries dropped because the ring was full
+    unsigned int capture_lost_read; // Value of capture_lost when last reported
     int64_t    pulse_start; // Pulse start time
     int        state;       // Current line state
-    int        rx_bytes;    // Bytes counter
-    int        rx_bits;     // Bits counter
     gpio_num_t pin;
     int        invert;      // Invert the signal
+    int        syncs;       // SYNC pulses seen
     TaskHandle_t task;
 };
 
-enum State {
-    TX_IDLE,
-    TX_DATA,
-    TX_END
-};
+// Calibration never moves a length further than this from nominal
+#define TX_ADJUST_MAX (THRESHOLD / 2)
 
 struct CN_Wired_Transmitter {
-    uint8_t buffer[CNW_PKT_LEN];
-    enum State tx_state;
+    cnw_encoder_t encoder;
+    volatile int busy;
+    unsigned int rejected; // Writes rejected because we were still sending, counted by the task
     int        invert;    // Invert the signal
     int        line_state;
-    int        tx_bytes;
-    int        tx_bits;
-    int        next_bit;  // Time of the next bit
+    int        next;      // Kind of the next line state, CNW_NONE when done
     int        gpio_mask; // Pre-cooked GPIO mask
-    int        t_space;   // Pre-cooked delays in ticks
-    int        t_zero;
-    int        t_one;
-    int        t_delay;
-    int        t_end;
+    int        ticks[CNW_PULSES]; // Pre-cooked lengths in ticks
+    // Calibration. The interrupt measures what it has actually sent, lengths are
+    // then corrected before the next packet
+    int        kind;      // What the current line state is
+    int64_t    last_edge; // When the current line state started
+    uint32_t   sum[CNW_PULSES];   // Measured lengths of the last packet
+    uint16_t   count[CNW_PULSES];
+    int16_t    adjust[CNW_PULSES]; // Correction, microseconds
+    int        calibrate;
 };
 
 // We need to act quickly-quickly-quickly for better timings. Standard drivers
@@ -93,9 +123,67 @@ static uint32_t timer_ticks(uint32_t usecs) {
 
 static struct CN_Wired_Receiver rx_obj;
 static struct CN_Wired_Transmitter tx_obj;
+static struct CN_Wired_Stats stats;
+
+static inline void pulse_stat(struct Pulse_Stat* p, uint32_t length)
+{
+    if (!p->count || length < p->min)
+        p->min = length;
+    if (length > p->max)
+        p->max = length;
+    p->count++;
+    p->total += length;
+}
+
+static inline void tx_measure(struct CN_Wired_Transmitter* tx, int64_t now)
+{
+    if (tx->kind != CNW_NONE) {
+        tx->sum[tx->kind] += now - tx->last_edge;
+        tx->count[tx->kind]++;
+    }
+    tx->last_edge = now;
+}
+
+static inline void isr_time(uint16_t* max, int64_t start)
+{
+    int64_t t = esp_timer_get_time() - start;
+
+    if (t > *max)
+        *max = t;
+}
 
-static int isReceiving (const struct CN_Wired_Receiver* rx) {
-    return rx->rx_bytes >= 0 && rx->rx_bytes < RX_LEN;
+static void rx_queue (struct CN_Wired_Receiver* rx)
+{
+    unsigned int head = rx->head;
+
+    if (head - rx->tail >= RX_RING) {
+        rx->dropped++; // Nobody is reading, keep what we have
+        return;
+    }
+
+    cn_wired_packet_t* pkt = &rx->ring[head & (RX_RING - 1)];
+
+    memcpy(pkt->data, rx->decoder.data, CNW_PKT_LEN);
+    pkt->sync_time = rx->sync_time;
+    pkt->quality   = cnw_quality(&rx->decoder);
+    pkt->seq       = rx->rx_seq;
+    // Single core, so we only need the compiler not to move the stores above past this
+    __asm__ __volatile__ ("" ::: "memory");
+    rx->head = head + 1;
+}
+
+static inline void rx_capture (struct CN_Wired_Receiver* rx, uint32_t length)
+{
+    unsigned int head = rx->capture_head;
+
+    if (head - rx->capture_tail > rx->capture_mask) {
+        rx->capture_lost++;
+        return;
+    }
+    rx->capture[head & rx->capture_mask] = (length > CNW_CAPTURE_MAX ? CNW_CAPTURE_MAX : length) |
+                                           (rx->state ? CNW_CAPTURE_HIGH : 0);
+    __asm__ __volatile__ ("" ::: "memory");
+    rx->capture_head = head + 1;
 }
 
 static void rx_interrupt (void* arg)
@@ -104,102 +192,84 @@ static void rx_interrupt (void* arg)
     int new_state = gpio_get_level(rx->pin) ^ rx->invert;
 
     if (new_state == rx->state) {
+        stats.spurious++;
         return; // Some rubbish
     }
 
     int64_t now = esp_timer_get_time();
 
-    if (new_state) {
-        // LOW->HIGH, start of data bit
-        uint64_t length = now - rx->pulse_start;
-
-        if (length > SYNC_LENGTH - THRESHOLD) {
-            // Got SYNC pulse, start receiving data
-            // The packet always starts with a single HIGH pulse of 1000 usecs, which can be
-            // interpreted as a value 1, so the 0th byte will contain this single bit.
-            // The next bit is going to be LSB of 1st byte.
-            rx->rx_bytes  = 0;
-            rx->rx_bits   = 7;
-            rx->buffer[0] = 0;
-        }
-    } else {
-        // HIGH->LOW, start of SYNC or end of data bit
-        if (isReceiving (rx)) {
-            // High bit - 900us, low bit - 400us
-            uint8_t v = (now - rx->pulse_start) > BIT_1_LENGTH - THRESHOLD;
-
-            rx->buffer[rx->rx_bytes] |= (v << rx->rx_bits);
-
-            if (rx->rx_bits == 7) {
-                rx->rx_bits = 0;
-                rx->rx_bytes++;
-
-                if (rx->rx_bytes == RX_LEN) {
-                    // Packet complete, signal ready to read
-                    vTaskNotifyGiveFromISR(rx->task, NULL);
-                } else {
-                    // Prepare the next byte. We don't check for overflow for speed, that's
-                    // why we need one spare trailing byte
-                    rx->buffer[rx->rx_bytes] = 0;
-                }
-            } else {
-                rx->rx_bits++;
-            }
-        }
+    // The state which has just ended, the line may have been idle for ages
+    int64_t elapsed = now - rx->pulse_start;
+    uint32_t length = elapsed > 0xFFFFFFFF ? 0xFFFFFFFF : elapsed;
+
+    if (rx->capture)
+        rx_capture(rx, length);
+
+    int ev = cnw_decode(&rx->decoder, rx->state, length);
+
+    if (ev & CNW_EV_SYNC) {
+        rx->sync_time = now;
+        rx->syncs++;
+        stats.syncs++;
+        if (ev & CNW_EV_PARTIAL)
+            stats.partial++;
+    }
+    if (ev & CNW_EV_SPACE)
+        pulse_stat(&stats.space, length);
+    if (ev & (CNW_EV_ZERO | CNW_EV_ONE))
+        pulse_stat((ev & CNW_EV_ONE) ? &stats.bit1 : &stats.bit0, length);
+    if (ev & CNW_EV_MARGINAL)
+        stats.marginal++;
+    if (ev & CNW_EV_PACKET) {
+        // Packet complete, queue it and signal ready to read
+        stats.packets++;
+        rx->rx_seq++;
+        rx_queue(rx);
+        vTaskNotifyGiveFromISR(rx->task, NULL);
+    }
+    if (ev & CNW_EV_TRAILER) {
+        // End of trailer, the line is free for a reply
+        rx->trailer_seq = rx->rx_seq;
+        vTaskNotifyGiveFromISR(rx->task, NULL);
     }
 
       // A new state has begun at 'now' microseconds
     rx->pulse_start = now;
     rx->state       = new_state;
-}
 
-static void tx_update_timings(struct CN_Wired_Transmitter* tx)
-{
-    if (tx->tx_bytes < CNW_PKT_LEN) {
-        // Ticks value for the next bit.
-        tx->next_bit = ((tx->buffer[tx->tx_bytes] >> tx->tx_bits) & 1) ? tx->t_one : tx->t_zero;
-        // Advance bit/byte counters
-        if (tx->tx_bits < 7) {
-            tx->tx_bits++;
-        } else {
-            tx->tx_bits = 0;
-            tx->tx_bytes++;
-        }
-    } else if (tx->tx_state == TX_DATA) {
-        // The current bit we've just started is the final one, no more data.
-        // After the space, issue a t_delay HIGH
-        tx->tx_state = TX_END;
-        tx->next_bit = tx->t_delay;
-    } else {
-        // tx->tx_state == TX_END. We've just started our DELAY.
-        // It will be followed by t_end LOW, after which we're done
-        tx->t_space = tx->t_end;
-        tx->next_bit = 0;
-    }
+    isr_time(&stats.rx_isr_max, now);
 }
 
 static void tx_interrupt (void* arg)
 {
     struct CN_Wired_Transmitter* tx = arg;
     int new_state = !tx->line_state;
-
-    if (!new_state) {
-        // HIGH -> LOW. Space starts
-        tx_timer_reload(tx, tx->t_space);
-        tx_set_low(tx);
-    } else if (tx->next_bit) {
-        // LOW ->HIGH. Bit starts
-        tx_timer_reload(tx, tx->next_bit);
-        tx_set_high(tx);
+    // This delays every edge the same, so it doesn't change pulse lengths
+    int64_t start = esp_timer_get_time();
+    int kind = tx->next;
+
+    if (kind != CNW_NONE) {
+        tx_timer_reload(tx, tx->ticks[kind]);
+        if (new_state)
+            tx_set_high(tx);
+        else
+            tx_set_low(tx);
         // We've set our line and timer, now we have some time for housekeeping.
-        tx_update_timings(tx);
+        tx->next = cnw_encoder_next(&tx->encoder);
     } else {
-        // LOW->HIGH, no next_bit set. We've just completed our final pulse and turning idle.
+        // LOW->HIGH, nothing more to send. We've just completed our final pulse and turning idle.
         tx_set_high(tx);
-        tx->tx_state = TX_IDLE;
+        tx->busy = 0;
     }
 
     tx->line_state = new_state;
+    if (tx->calibrate) {
+        // Time between interrupts is what we have sent, as latency is the same for every edge
+        tx_measure(tx, start);
+        tx->kind = kind;
+    }
+
+    isr_time(&stats.tx_isr_max, start);
 }
 
 // A version of the above, but for inverted tx pin, therefore tx_set_high()
@@ -209,24 +279,63 @@ void inverted_tx_interrupt (void* arg)
 {
     struct CN_Wired_Transmitter* tx = arg;
     int new_state = !tx->line_state;
-
-    if (!new_state) {
-        // HIGH -> LOW. Space starts
-        tx_timer_reload(tx, tx->t_space);
-        tx_set_high(tx);
-    } else if (tx->next_bit) {
-        // LOW ->HIGH. Bit starts
-        tx_timer_reload(tx, tx->next_bit);
-        tx_set_low(tx);
-        // We've set our line and timer, now we have some time for housekeeping.
-        tx_update_timings(tx);
+    int64_t start = esp_timer_get_time();
+    int kind = tx->next;
+
+    if (kind != CNW_NONE) {
+        tx_timer_reload(tx, tx->ticks[kind]);
+        if (new_state)
+            tx_set_low(tx);
+        else
+            tx_set_high(tx);
+        tx->next = cnw_encoder_next(&tx->encoder);
     } else {
-        // LOW->HIGH, no next_bit set. We've just completed our final pulse and turning idle.
         tx_set_low(tx);
-        tx->tx_state = TX_IDLE;
+        tx->busy = 0;
     }
 
     tx->line_state = new_state;
+    if (tx->calibrate) {
+        tx_measure(tx, start);
+        tx->kind = kind;
+    }
+
+    isr_time(&stats.tx_isr_max, start);
+}
+
+static uint32_t tx_length(const struct CN_Wired_Transmitter* tx, int p)
+{
+    return cnw_nominal[p] + tx->adjust[p];
+}
+
+static void tx_calibrate(struct CN_Wired_Transmitter* tx)
+{
+    // Called when idle, so the interrupt does not touch what we use here
+    for (int p = 0; p < CNW_PULSES; p++) {
+        if (!tx->count[p])
+            continue;
+
+        int error = (int)(tx->sum[p] / tx->count[p]) - cnw_nominal[p];
+
+        // Way off means we were disturbed, e.g. SYNC is started by a task, not an interrupt
+        if (abs(error) < THRESHOLD) {
+            // Halfway each time, so that one odd packet does not throw us
+            int adjust = tx->adjust[p] - error / 2;
+
+            if (adjust > TX_ADJUST_MAX)
+                adjust = TX_ADJUST_MAX;
+            if (adjust < -TX_ADJUST_MAX)
+                adjust = -TX_ADJUST_MAX;
+            tx->adjust[p] = adjust;
+        }
+        tx->sum[p]   = 0;
+        tx->count[p] = 0;
+    }
+}
+
+void cn_wired_calibrate (int enable)
+{
+    tx_obj.calibrate = enable ? 1 : 0;
 }
 
 esp_err_t cn_wired_driver_install (gpio_num_t rx, gpio_num_t tx, int rx_invert, int tx_invert)
@@ -235,14 +344,21 @@ esp_err_t cn_wired_driver_install (gpio_num_t rx, gpio_num_t tx, int rx_invert,
 
     rx_obj.invert   = rx_invert ? 1 : 0;
     rx_obj.state    = 1;
-    rx_obj.rx_bytes = -1; // "Wait for sync" state
+    cnw_decoder_reset(&rx_obj.decoder);
     rx_obj.pin      = rx;
     rx_obj.task     = xTaskGetCurrentTaskHandle();
+    rx_obj.tail     = rx_obj.head;
+
+    memset(&stats, 0, sizeof(stats));
 
     xTaskNotifyStateClear(rx_obj.task);
 
     tx_obj.invert    = tx_invert;
-    tx_obj.tx_state  = TX_IDLE;
+    memset(tx_obj.adjust, 0, sizeof(tx_obj.adjust));
+    memset(tx_obj.count, 0, sizeof(tx_obj.count));
+    tx_obj.adjust[CNW_SYNC] = -20;
+    tx_obj.busy      = 0;
+    tx_obj.rejected  = 0;
     tx_obj.gpio_mask = 1 << tx;
 
     gpio_pad_select_gpio(rx);
@@ -274,58 +390,217 @@ esp_err_t cn_wired_driver_install (gpio_num_t rx, gpio_num_t tx, int rx_invert,
     return err;
 }
 
+int cn_wired_sniff (gpio_num_t rx, int rx_invert, TickType_t timeout)
+{
+    rx_obj.invert      = rx_invert ? 1 : 0;
+    cnw_decoder_reset(&rx_obj.decoder);
+    rx_obj.pin         = rx;
+    rx_obj.task        = xTaskGetCurrentTaskHandle();
+    rx_obj.syncs       = 0;
+
+    gpio_pad_select_gpio(rx);
+
+    if (gpio_set_direction(rx, GPIO_MODE_INPUT) || gpio_set_pull_mode(rx, GPIO_FLOATING))
+        return -1;
+    // Whatever the line is doing now is not a pulse we have timed
+    rx_obj.state       = gpio_get_level(rx) ^ rx_obj.invert;
+    rx_obj.pulse_start = esp_timer_get_time();
+    if (gpio_install_isr_service(0))
+        return -1;
+    if (!gpio_isr_handler_add(rx, rx_interrupt, &rx_obj) && !gpio_set_intr_type(rx, GPIO_INTR_ANYEDGE))
+        vTaskDelay(timeout);
+    gpio_set_intr_type(rx, GPIO_INTR_DISABLE);
+    gpio_uninstall_isr_service();
+    // A complete packet would have been queued and notified us, we don't want that
+    rx_obj.tail = rx_obj.head;
+    xTaskNotifyStateClear(rx_obj.task);
+
+    // Give the pin back to the UART
+    if (rx == GPIO_NUM_3)
+        PIN_FUNC_SELECT(PERIPHS_IO_MUX_U0RXD_U, FUNC_U0RXD);
+
+    return rx_obj.syncs;
+}
+
 void cn_wired_driver_delete (void)
 {
     hw_timer_deinit ();
     gpio_uninstall_isr_service ();
 }
 
-esp_err_t cn_wired_read_bytes (uint8_t *buffer, TickType_t timeout)
+static void ja_pulse_stat(ja_t *j, const char* tag, const struct Pulse_Stat* p)
+{
+    if (!p->count)
+        return;
+    ja_object(j, tag);
+    ja_int(j, "min", p->min);
+    ja_int(j, "avg", p->total / p->count);
+    ja_int(j, "max", p->max);
+    ja_int(j, "count", p->count);
+    ja_close(j);
+}
+
+void cn_wired_stats (ja_t *j)
+{
+    ja_object(j, "cnw");
+    ja_int(j, "syncs", stats.syncs);
+    ja_int(j, "packets", stats.packets);
+    if (stats.partial)
+        ja_int(j, "partial", stats.partial);
+    if (stats.spurious)
+        ja_int(j, "spurious", stats.spurious);
+    if (stats.marginal)
+        ja_int(j, "marginal", stats.marginal);
+    if (rx_obj.dropped)
+        ja_int(j, "dropped", rx_obj.dropped);
+    if (tx_obj.rejected)
+        ja_int(j, "txbusy", tx_obj.rejected);
+    ja_pulse_stat(j, "bit0", &stats.bit0);
+    ja_pulse_stat(j, "bit1", &stats.bit1);
+    ja_pulse_stat(j, "space", &stats.space);
+    ja_int(j, "rxisr", stats.rx_isr_max);
+    ja_int(j, "txisr", stats.tx_isr_max);
+    // Transmit length corrections, in CNW_SYNC... order
+    ja_array(j, "txadjust");
+    for (int p = 0; p < CNW_PULSES; p++)
+        ja_int(j, NULL, tx_obj.adjust[p]);
+    ja_close(j);
+    ja_close(j);
+}
+
+esp_err_t cn_wired_read_packet (cn_wired_packet_t *pkt, TickType_t timeout)
 {
-    if (!xTaskNotifyWait(0x00, ULONG_MAX, NULL, timeout ))
-        return ESP_ERR_TIMEOUT;
+    unsigned int tail = rx_obj.tail;
+
+    // A notification may be left over from a packet we have already taken, so check the queue, not just wait
+    while (rx_obj.head == tail) {
+        if (!ulTaskNotifyTake(pdTRUE, timeout))
+            return ESP_ERR_TIMEOUT;
+    }
 
-    // Drop the prefix 0x80 byte, containing start bit
-    memcpy(buffer, &rx_obj.buffer[1], CNW_PKT_LEN);
-    rx_obj.rx_bytes = -1; // "Wait for sync" state
+    *pkt = rx_obj.ring[tail & (RX_RING - 1)];
+    // The copy must be done before the interrupt can see the entry is free and overwrite it
+    __asm__ __volatile__ ("" ::: "memory");
+    rx_obj.tail = tail + 1;
 
     return ESP_OK;
 }
 
+esp_err_t cn_wired_capture_start (int entries)
+{
+    if (rx_obj.capture)
+        return ESP_OK;
+    if (entries <= 0 || (entries & (entries - 1)))
+        return ESP_ERR_INVALID_ARG;
+
+    uint16_t* capture = malloc(entries * sizeof(*capture));
+
+    if (!capture)
+        return ESP_ERR_NO_MEM;
+
+    rx_obj.capture_mask = entries - 1;
+    rx_obj.capture_tail = rx_obj.capture_head;
+    rx_obj.capture_lost_read = rx_obj.capture_lost;
+    // The interrupt starts capturing once it sees the buffer
+    rx_obj.capture      = capture;
+
+    return ESP_OK;
+}
+
+void cn_wired_capture_stop (void)
+{
+    uint16_t* capture = rx_obj.capture;
+
+    // We are on the same core as the interrupt, so once this is done, it's not using the buffer
+    rx_obj.capture = NULL;
+    free(capture);
+}
+
+int cn_wired_capture_read (uint16_t *buf, int max, unsigned int *lost)
+{
+    unsigned int tail = rx_obj.capture_tail;
+    int n = 0;
+
+    if (!rx_obj.capture)
+        return 0;
+
+    while (n < max && tail != rx_obj.capture_head)
+        buf[n++] = rx_obj.capture[tail++ & rx_obj.capture_mask];
+
+    __asm__ __volatile__ ("" ::: "memory");
+    rx_obj.capture_tail = tail;
+
+    if (lost) {
+        // Only the interrupt writes the counter, so we remember what we have reported
+        unsigned int count = rx_obj.capture_lost;
+
+        *lost = count - rx_obj.capture_lost_read;
+        rx_obj.capture_lost_read = count;
+    }
+
+    return n;
+}
+
+esp_err_t cn_wired_wait_idle (const cn_wired_packet_t *pkt, TickType_t timeout)
+{
+    TickType_t start = xTaskGetTickCount();
+
+    // Notifications are shared with packets, so check what happened, not just wait
+    while (rx_obj.trailer_seq != pkt->seq) {
+        if (rx_obj.rx_seq != pkt->seq)
+            return ESP_FAIL; // The unit has moved on, leave it to the next packet
+        TickType_t waited = xTaskGetTickCount() - start;
+        if (waited >= timeout || !ulTaskNotifyTake(pdTRUE, timeout - waited))
+            return ESP_ERR_TIMEOUT;
+    }
+
+    return ESP_OK;
+}
+
+esp_err_t cn_wired_read_bytes (uint8_t *buffer, TickType_t timeout)
+{
+    cn_wired_packet_t pkt;
+    esp_err_t err = cn_wired_read_packet(&pkt, timeout);
+
+    if (err == ESP_OK)
+        memcpy(buffer, pkt.data, CNW_PKT_LEN);
+
+    return err;
+}
+
 esp_err_t cn_wired_write_bytes (const uint8_t *buffer)
 {
-    if (tx_obj.tx_state != TX_IDLE)
+    if (tx_obj.busy) {
+        tx_obj.rejected++;
         return ESP_FAIL; // Busy, retry plz
+    }
 
-    memcpy(tx_obj.buffer, buffer, CNW_PKT_LEN);
-    tx_obj.tx_state   = TX_DATA;
-    tx_obj.tx_bits    = 0;
-    tx_obj.tx_bytes   = 0;
-    tx_obj.line_state = 0;                         // We start with SYNC low
+    if (tx_obj.calibrate)
+        tx_calibrate(&tx_obj);
 
+    cnw_encoder_start(&tx_obj.encoder, buffer);
+    tx_obj.kind       = cnw_encoder_next(&tx_obj.encoder); // SYNC, which we start here
+    tx_obj.next       = cnw_encoder_next(&tx_obj.encoder);
+    tx_obj.line_state = 0;                         // We start with SYNC low
+    tx_obj.busy       = 1;
+
+    // Use hw_timer_alarm_us() to guarantee that the timer is set up correctly.
+    // This will kickstart the transmitter. When the timer fires, the SYNC pulse
+    // will be over and start bit will be transmitted by our state machine.
+    // Initial adjustment of -20 was fine-tuned by trial and error using DUMP_TIMINGS
+    // feature in Arduino bridge, calibration takes it from there
+    hw_timer_alarm_us (tx_length(&tx_obj, CNW_SYNC), false);
+    tx_obj.last_edge = esp_timer_get_time();
     if (tx_obj.invert)
-    {
-        // Use hw_timer_alarm_us() to guarantee that the timer is set up correctly.
-        // This will kickstart the transmitter. When the timer fires, the SYNC pulse
-        // will be over and start bit will be transmitted by our state machine.
-        // Constant of -20 was fine-tuned by trial and error using DUMP_TIMINGS feature
-        // in Arduino bridge
-        hw_timer_alarm_us (SYNC_LENGTH - 20, false);
         tx_set_high(&tx_obj);
-    } else {
-        hw_timer_alarm_us (SYNC_LENGTH - 20, false);
+    else
         tx_set_low(&tx_obj);
-    }
 
     // hw_timer_alarm_us() has set up clock divider, so that hw_timer_get_clkdiv()
     // now returns a proper value. We rely on this behavior in order to pre-cook
     // bit timings
-    tx_obj.next_bit = timer_ticks(START_LENGTH);
-    tx_obj.t_one    = timer_ticks(BIT_1_LENGTH);
-    tx_obj.t_zero   = timer_ticks(BIT_0_LENGTH);
-    tx_obj.t_space  = timer_ticks(SPACE_LENGTH);
-    tx_obj.t_delay  = timer_ticks(END_DELAY);
-    tx_obj.t_end    = timer_ticks(END_LENGTH);
+    for (int p = 0; p < CNW_PULSES; p++)
+        tx_obj.ticks[p] = timer_ticks(tx_length(&tx_obj, p));
 
     return ESP_OK;
 }
@@ -3,15 +3,46 @@
 
 #include <driver/gpio.h>
 #include "revk.h"
+#include "cn_wired.h"
+#include "json_arena.h"
+
+// A received packet, as queued by the receiver
+typedef struct cn_wired_packet_s
+{
+    uint8_t data[CNW_PKT_LEN];
+    int64_t sync_time; // esp_timer_get_time() at the end of SYNC pulse
+    uint8_t quality;   // Percentage of bits with clean timing, 100 is perfect
+    unsigned int seq;  // Sequence number, counting all packets received
+} cn_wired_packet_t;
 
 esp_err_t cn_wired_driver_install (gpio_num_t rx, gpio_num_t tx, int rx_invert, int tx_invert);
 void cn_wired_driver_delete (void);
 esp_err_t cn_wired_read_bytes (uint8_t *rx, TickType_t timeout);
+// Get the oldest received packet. Packets are queued, so none are lost if we are late to read
+esp_err_t cn_wired_read_packet (cn_wired_packet_t *pkt, TickType_t timeout);
 esp_err_t cn_wired_write_bytes (const uint8_t *buf);
+// Wait for the trailer of a packet we've just read to end, so that we can reply. ESP_FAIL if
+// another packet has come since, ESP_ERR_TIMEOUT if we did not see the trailer
+esp_err_t cn_wired_wait_idle (const cn_wired_packet_t *pkt, TickType_t timeout);
+// Measure what we send and correct transmit timings for this board
+void cn_wired_calibrate (int enable);
+// Listen to the line for a while without taking it over, returns number of SYNC pulses seen,
+// i.e. if there is a CN_WIRED unit talking. Negative on error
+int cn_wired_sniff (gpio_num_t rx, int rx_invert, TickType_t timeout);
 
-static inline void cn_wired_stats (jo_t j)
-{
-    // 8266 driver doesn't have any stats. Empty function for source compatibility.
-}
+// Raw pulse capture, for looking at real world timings without extra hardware. Each entry is how long
+// the line stayed in one state, in microseconds, with CNW_CAPTURE_HIGH set if it was HIGH. Lengths
+// are capped at CNW_CAPTURE_MAX, which is what idle time between packets looks like
+#define CNW_CAPTURE_HIGH 0x8000
+#define CNW_CAPTURE_MAX  0x7FFF
+// Start capturing into a ring of given number of entries (a power of 2), allocated here
+esp_err_t cn_wired_capture_start (int entries);
+void cn_wired_capture_stop (void);
+// Take up to max captured entries, returns number taken. lost is set to the number of entries
+// dropped because the ring was full since last call
+int cn_wired_capture_read (uint16_t *buf, int max, unsigned int *lost);
+
+// Add driver statistics to j, as "cnw" object. Pulse lengths and interrupt times are in microseconds
+void cn_wired_stats (ja_t *j);
 
 #endif
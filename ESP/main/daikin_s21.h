@@ -72,17 +72,18 @@ s21_checksum (uint8_t * buf, int len)
    return c;
 }
 
-// Target temperature is encoded as one character
-static inline float
+// Target temperature is encoded as one character, in 0.5C steps. Temperatures are in 0.01C, see ctemp_t
+static inline int
 s21_decode_target_temp (unsigned char v)
 {
-   return 18.0 + 0.5 * ((signed) v - AC_MIN_TEMP_VALUE);
+   return CTEMP (18) + CTEMP (0.5) * ((signed) v - AC_MIN_TEMP_VALUE);
 }
 
-static inline float
-s21_encode_target_temp (float temp)
+static inline unsigned char
+s21_encode_target_temp (int temp)
 {
-   return lroundf ((temp - 18.0) * 2) + AC_MIN_TEMP_VALUE;
+   temp -= CTEMP (18);
+   return (temp + (temp < 0 ? -CTEMP (0.25) : CTEMP (0.25))) / CTEMP (0.5) + AC_MIN_TEMP_VALUE;
 }
 
 static inline int
@@ -102,10 +103,10 @@ s21_decode_hex_sensor (const unsigned char *payload)
 #undef hex
 }
 
-static inline float
-s21_decode_float_sensor (const unsigned char *payload)
-{
-   return (float) s21_decode_int_sensor (payload) * 0.1;
+static inline int
+s21_decode_temp_sensor (const unsigned char *payload)
+{                               // In 0.01C
+   return s21_decode_int_sensor (payload) * 10;
 }
 
 // Convert between Daikin and Faikin fan speed enums
@@ -1,6 +1,8 @@
 #ifndef _FAIKIN_ENUMS_H
 #define _FAIKIN_ENUMS_H
 
+#include <stdint.h>
+
 #include "cn_wired.h"
 
 // Faikin mode enums
@@ -22,6 +24,23 @@
 #define FAIKIN_FAN_QUIET   6
 #define FAIKIN_FAN_INVALID -1
 
+// Temperatures are kept as integer hundredths of a degree C, as there is no FPU on ESP8266
+typedef int16_t ctemp_t;
+#define CTEMP_NONE INT16_MIN             // Not known
+#define CTEMP(c)   ((int)((c) * 100))    // Constant in degrees C, e.g. CTEMP(0.5)
+
+// Status and control fields, numbered in the order of acextras.m
+enum
+{
+#define	b(name)		CONTROL_##name##_pos,
+#define	t(name)		b(name)
+#define	r(name)		b(name)
+#define	i(name)		b(name)
+#define	e(name,values)	b(name)
+#define	s(name,len)	b(name)
+#include "acextras.m"
+};
+
 // Conversion from/to CN_WIRED protocol values
 static inline int8_t
 cnw_decode_mode(const unsigned char *data)
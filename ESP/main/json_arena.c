@@ -0,0 +1,349 @@
+/* Preallocated buffers for JSON messages */
+/* Copyright ©2022 Adrian Kennard, Andrews & Arnold Ltd. See LICENCE file for details .GPL 3.0 */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "json_arena.h"
+
+// Sizes allow for every field known, and all reported as [min,avg,max]
+#define	JSON_ARENA_STATUS_SIZE	1024
+#define	JSON_ARENA_REPORT_SIZE	1536
+#define	JSON_ARENA_COMMS_SIZE	512     // Longest dump is an X50A frame, in hex
+#define	JSON_ARENA_HEAP_MAX	16384   // Largest message built on the heap
+
+static char status_buf[JSON_ARENA_STATUS_SIZE];
+static char report_buf[JSON_ARENA_REPORT_SIZE];
+static char comms_buf[JSON_ARENA_COMMS_SIZE];
+
+static ja_t slots[JSON_ARENA_SLOTS] = {
+   [JSON_ARENA_STATUS] = {.buf = status_buf,.size = sizeof (status_buf),.slot = JSON_ARENA_STATUS },
+   [JSON_ARENA_REPORT] = {.buf = report_buf,.size = sizeof (report_buf),.slot = JSON_ARENA_REPORT },
+   [JSON_ARENA_COMMS] = {.buf = comms_buf,.size = sizeof (comms_buf),.slot = JSON_ARENA_COMMS },
+};
+
+static uint8_t busy[JSON_ARENA_SLOTS];
+
+static json_arena_stats_t stats[JSON_ARENA_SLOTS] = {
+   [JSON_ARENA_STATUS] = {.size = sizeof (status_buf) },
+   [JSON_ARENA_REPORT] = {.size = sizeof (report_buf) },
+   [JSON_ARENA_COMMS] = {.size = sizeof (comms_buf) },
+};
+
+void *(*json_arena_malloc) (size_t) = malloc;
+void (*json_arena_free) (void *) = free;
+
+static void
+begin (ja_t * j)
+{
+   j->len = j->level = j->comma = j->overflow = 0;
+   j->arrays = 0;
+   j->buf[j->len++] = '{';
+   j->level++;
+}
+
+static ja_t *
+start_heap (int slot, uint16_t size, int count)
+{                               // The ja_t and its buffer in one allocation
+   ja_t *j = json_arena_malloc (sizeof (*j) + size);
+   if (!j)
+      return NULL;
+   memset (j, 0, sizeof (*j));
+   j->buf = (char *) (j + 1);
+   j->size = size;
+   j->slot = slot;
+   j->heap = 1;
+   if (count)
+      stats[slot].heap++;
+   begin (j);
+   return j;
+}
+
+ja_t *
+ja_start (int slot)
+{
+   if (slot < 0 || slot >= JSON_ARENA_SLOTS)
+      return NULL;
+   stats[slot].uses++;
+   if (busy[slot])
+      return start_heap (slot, stats[slot].size, 1);
+   busy[slot] = 1;
+   ja_t *j = &slots[slot];
+   begin (j);
+   return j;
+}
+
+const char *
+ja_finish (ja_t * j)
+{
+   if (!j)
+      return NULL;
+   while (j->level)
+   {                            // Room for these was kept
+      j->level--;
+      j->buf[j->len++] = ((j->arrays >> j->level) & 1) ? ']' : '}';
+   }
+   j->buf[j->len] = 0;
+   json_arena_stats_t *s = &stats[j->slot];
+   if (j->overflow)
+      s->overflows++;
+   else if (!j->heap && j->len > s->high)
+      s->high = j->len;
+   return j->buf;
+}
+
+void
+ja_done (ja_t * j)
+{
+   if (!j)
+      return;
+   if (j->heap)
+      json_arena_free (j);
+   else
+      busy[j->slot] = 0;
+}
+
+static ja_t *
+build (ja_t * j, void (*add) (ja_t *, void *), void *ctx)
+{
+   if (!j)
+      return NULL;
+   add (j, ctx);
+   while (j->overflow && j->size <= JSON_ARENA_HEAP_MAX / 2)
+   {                            // Again, with twice the room
+      int slot = j->slot;
+      uint16_t size = j->size * 2;
+      stats[slot].overflows++;
+      ja_done (j);
+      if (!(j = start_heap (slot, size, 1)))
+         return NULL;
+      add (j, ctx);
+   }
+   return j;
+}
+
+ja_t *
+ja_build (int slot, void (*add) (ja_t *, void *), void *ctx)
+{
+   return build (ja_start (slot), add, ctx);
+}
+
+ja_t *
+ja_build_heap (int slot, void (*add) (ja_t *, void *), void *ctx)
+{
+   if (slot < 0 || slot >= JSON_ARENA_SLOTS)
+      return NULL;
+   return build (start_heap (slot, stats[slot].size, 0), add, ctx);
+}
+
+// Writing. A value is only kept if it fits with room to close what is open and the NUL. After something
+// has not fitted, nothing more is added, as it might belong inside an object or array that was left out
+
+static int
+put (ja_t * j, const char *s, int n)
+{
+   if (j->len + n >= j->size)
+      return 0;
+   memcpy (j->buf + j->len, s, n);
+   j->len += n;
+   return 1;
+}
+
+static int
+put_tag (ja_t * j, const char *tag)
+{
+   if (j->comma && !put (j, ",", 1))
+      return 0;
+   if (!tag)
+      return 1;
+   return put (j, "\"", 1) && put (j, tag, strlen (tag)) && put (j, "\":", 2);
+}
+
+static int
+put_escaped (ja_t * j, const char *s, int n)
+{
+   if (!put (j, "\"", 1))
+      return 0;
+   while (n--)
+   {
+      uint8_t c = *s++;
+      char e[7];
+      int l;
+      if (c == '"' || c == '\\')
+         l = sprintf (e, "\\%c", c);
+      else if (c < 0x20 || c >= 0x7F)
+         l = sprintf (e, "\\u%04X", c);
+      else
+      {
+         e[0] = c;
+         l = 1;
+      }
+      if (!put (j, e, l))
+         return 0;
+   }
+   return put (j, "\"", 1);
+}
+
+static int
+value_start (ja_t * j, const char *tag, uint16_t * mark)
+{
+   *mark = (j ? j->len : 0);
+   if (!j || j->overflow)
+      return 0;
+   return put_tag (j, tag);
+}
+
+static void
+value_end (ja_t * j, uint16_t mark, int ok, int open)
+{
+   if (!j)
+      return;
+   if (ok && j->len + j->level + open + 1 <= j->size && j->level + open <= 32)
+   {
+      j->level += open;
+      j->comma = !open;
+      return;
+   }
+   j->len = mark;
+   j->overflow = 1;
+}
+
+static void
+open_level (ja_t * j, const char *tag, char c)
+{
+   if (!j)
+      return;
+   uint16_t mark;
+   int ok = value_start (j, tag, &mark);
+   uint8_t level = j->level;
+   value_end (j, mark, ok && put (j, &c, 1), 1);
+   if (j->level > level)
+   {                            // Opened
+      if (c == '[')
+         j->arrays |= (1UL << level);
+      else
+         j->arrays &= ~(1UL << level);
+   }
+}
+
+void
+ja_object (ja_t * j, const char *tag)
+{
+   open_level (j, tag, '{');
+}
+
+void
+ja_array (ja_t * j, const char *tag)
+{
+   open_level (j, tag, '[');
+}
+
+void
+ja_close (ja_t * j)
+{
+   if (!j || j->overflow || j->level <= 1)
+      return;                   // The outer object is closed by ja_finish()
+   j->level--;
+   j->buf[j->len++] = ((j->arrays >> j->level) & 1) ? ']' : '}';
+   j->comma = 1;
+}
+
+static void
+literal (ja_t * j, const char *tag, const char *s, int n)
+{
+   uint16_t mark;
+   int ok = value_start (j, tag, &mark);
+   value_end (j, mark, ok && put (j, s, n), 0);
+}
+
+void
+ja_null (ja_t * j, const char *tag)
+{
+   literal (j, tag, "null", 4);
+}
+
+void
+ja_bool (ja_t * j, const char *tag, int v)
+{
+   if (v)
+      literal (j, tag, "true", 4);
+   else
+      literal (j, tag, "false", 5);
+}
+
+void
+ja_int (ja_t * j, const char *tag, int64_t v)
+{
+   char s[21];
+   literal (j, tag, s, sprintf (s, "%lld", (long long) v));
+}
+
+void
+ja_stringn (ja_t * j, const char *tag, const char *s, int len)
+{
+   uint16_t mark;
+   int ok = value_start (j, tag, &mark);
+   value_end (j, mark, ok && put_escaped (j, s, len), 0);
+}
+
+void
+ja_string (ja_t * j, const char *tag, const char *s)
+{
+   ja_stringn (j, tag, s, strlen (s));
+}
+
+void
+ja_stringf (ja_t * j, const char *tag, const char *fmt, ...)
+{
+   char s[100];
+   va_list ap;
+   va_start (ap, fmt);
+   int l = vsnprintf (s, sizeof (s), fmt, ap);
+   va_end (ap);
+   if (l < 0 || (size_t) l >= sizeof (s))
+   {
+      if (j)
+         j->overflow = 1;
+      return;
+   }
+   ja_stringn (j, tag, s, l);
+}
+
+void
+ja_litf (ja_t * j, const char *tag, const char *fmt, ...)
+{
+   uint16_t mark;
+   if (!value_start (j, tag, &mark))
+   {
+      value_end (j, mark, 0, 0);
+      return;
+   }
+   va_list ap;
+   va_start (ap, fmt);
+   int l = vsnprintf (j->buf + j->len, j->size - j->len, fmt, ap);
+   va_end (ap);
+   int ok = (l >= 0 && j->len + l < j->size);
+   if (ok)
+      j->len += l;
+   value_end (j, mark, ok, 0);
+}
+
+void
+ja_base16 (ja_t * j, const char *tag, const void *data, int len)
+{
+   static const char hex[] = "0123456789ABCDEF";
+   uint16_t mark;
+   int ok = value_start (j, tag, &mark) && put (j, "\"", 1);
+   for (const uint8_t * d = data; ok && len--; d++)
+      ok = put (j, &hex[*d >> 4], 1) && put (j, &hex[*d & 15], 1);
+   value_end (j, mark, ok && put (j, "\"", 1), 0);
+}
+
+const json_arena_stats_t *
+json_arena_stats (int slot)
+{
+   if (slot < 0 || slot >= JSON_ARENA_SLOTS)
+      return NULL;
+   return &stats[slot];
+}
@@ -0,0 +1,81 @@
+#ifndef _JSON_ARENA_H
+#define _JSON_ARENA_H
+
+// Fixed buffers for the JSON messages built all the time (status, delta, the environment report, and comms
+// messages). Building these on the heap, growing as fields are added, then freeing them once sent, leaves the
+// small heap in pieces after weeks of uptime. Each message type has its own static buffer instead, reused
+// every time, with a small writer whose formatting is bounded by its size, so building a message never
+// touches the heap. Only used from the daikin task, one message per slot at a time, sent before the slot is
+// used again. A slot that is already in use gets a buffer from the heap, so nesting is safe.
+// Independent of ESP, so it also builds on a host, see Tools/Simulators/heap-check.c
+
+#include <stddef.h>
+#include <stdint.h>
+
+enum
+{
+   JSON_ARENA_STATUS,           // state/status and state/delta
+   JSON_ARENA_REPORT,           // Environment report, every reporting seconds
+   JSON_ARENA_COMMS,            // Comms errors and dumps
+   JSON_ARENA_SLOTS
+};
+
+typedef struct json_arena_stats_s
+{
+   uint32_t uses;               // Messages built
+   uint32_t overflows;          // Messages that did not fit
+   uint32_t heap;               // Messages built on the heap, as they did not fit or the slot was in use, not ja_build_heap()
+   uint16_t size;               // Buffer size
+   uint16_t high;               // Longest message that fitted
+} json_arena_stats_t;
+
+// A message being built. Values that do not fit are left out, and what is there stays valid JSON. As with jo_t,
+// a NULL message can be written to and is ignored
+typedef struct ja_s
+{
+   char *buf;
+   uint16_t size;               // Of buf
+   uint16_t len;                // Used, not counting the NUL
+   uint8_t slot;
+   uint8_t level;               // Open objects and arrays, each needs a byte to close
+   uint32_t arrays;             // Bit for each open level that is an array
+   uint8_t comma:1;             // Something already at this level
+   uint8_t overflow:1;          // Something was left out
+   uint8_t heap:1;              // buf is from json_arena_malloc
+} ja_t;
+
+// Heap, when a message does not fit or its slot is in use. Can be replaced to count allocations
+extern void *(*json_arena_malloc) (size_t);
+extern void (*json_arena_free) (void *);
+
+// Start a message in a slot, as an object. NULL only if the slot is in use and the heap is full
+ja_t *ja_start (int slot);
+
+// Finish, closing what is open, and return the message, NULL if j is NULL
+const char *ja_finish (ja_t * j);
+
+// Done with the message, the slot can be used again
+void ja_done (ja_t * j);
+
+// Build a message with add(), and if it did not fit, again on the heap with twice the room until it does
+ja_t *ja_build (int slot, void (*add) (ja_t *, void *), void *ctx);
+
+// As ja_build(), but always on the heap, for another task building the same message
+ja_t *ja_build_heap (int slot, void (*add) (ja_t *, void *), void *ctx);
+
+// Values, tag is NULL in an array. Tags are not escaped
+void ja_object (ja_t * j, const char *tag);
+void ja_array (ja_t * j, const char *tag);
+void ja_close (ja_t * j);
+void ja_null (ja_t * j, const char *tag);
+void ja_bool (ja_t * j, const char *tag, int v);
+void ja_int (ja_t * j, const char *tag, int64_t v);
+void ja_string (ja_t * j, const char *tag, const char *s);
+void ja_stringn (ja_t * j, const char *tag, const char *s, int len);
+void ja_stringf (ja_t * j, const char *tag, const char *fmt, ...) __attribute__((format (printf, 3, 4)));
+void ja_litf (ja_t * j, const char *tag, const char *fmt, ...) __attribute__((format (printf, 3, 4)));
+void ja_base16 (ja_t * j, const char *tag, const void *data, int len);
+
+const json_arena_stats_t *json_arena_stats (int slot);
+
+#endif
@@ -0,0 +1,70 @@
+/* Poll scheduler for X50A and Altherma_S */
+/* Copyright ©2022 Adrian Kennard, Andrews & Arnold Ltd. See LICENCE file for details .GPL 3.0 */
+
+#include <string.h>
+#include "poll_sched.h"
+
+void
+poll_sched_start (poll_sched_t * s, uint32_t now)
+{
+   s->now = now;
+   s->left = s->budget;
+}
+
+int
+poll_sched_next (poll_sched_t * s)
+{
+   if (!s->left)
+      return -1;
+   int best = -1;
+   int32_t best_late = 0;
+   for (int n = 0; n < s->count; n++)
+   {
+      const poll_sched_state_t *p = &s->state[n];
+      int32_t late = (p->interval ? (int32_t) (s->now - p->due) : INT32_MAX);     // Not polled since reset, whatever the clock says
+      if ((!s->max_naks || p->naks < s->max_naks) && late >= -POLL_SCHED_SLACK_MS && (best < 0 || late > best_late))
+      {
+         best = n;
+         best_late = late;
+      }
+   }
+   if (best >= 0)
+      s->left--;
+   return best;
+}
+
+void
+poll_sched_done (poll_sched_t * s, int n, int ok, int nak, uint16_t hash)
+{
+   const poll_sched_def_t *d = &s->defs[n];
+   poll_sched_state_t *p = &s->state[n];
+   if (!p->interval)
+      p->interval = d->min_interval;
+   if (nak)
+   {
+      if (p->naks < 3)
+         p->naks++;
+   } else if (ok)
+      p->naks = 0;
+   if (ok && p->valid && p->hash == hash)
+   {                            // No change, back off
+      uint32_t i = p->interval * 2;
+      p->interval = (i > d->max_interval ? d->max_interval : i);
+   } else
+      p->interval = d->min_interval;
+   p->valid = (ok ? 1 : 0);
+   p->hash = hash;
+   p->due = s->now + p->interval;
+}
+
+void
+poll_sched_expedite (poll_sched_t * s, int n)
+{
+   s->state[n].due = s->now;
+}
+
+void
+poll_sched_reset (poll_sched_t * s)
+{
+   memset (s->state, 0, sizeof (*s->state) * s->count);
+}
@@ -0,0 +1,56 @@
+#ifndef _POLL_SCHED_H
+#define _POLL_SCHED_H
+
+// Poll scheduler for protocols with a handful of commands, X50A and Altherma_S. Each command has a
+// refresh interval which backs off while its response does not change, and what is most overdue goes
+// first, up to a budget of commands per main loop cycle. A command that NAKs too often is left alone.
+// S21 has its own, in s21_engine.c, as it also deals with priorities and probing.
+// Independent of ESP, so it also builds on a host
+
+#include <stdint.h>
+
+#define	POLL_SCHED_SLACK_MS	200     // Poll early by this much, main loop cycles are not exact
+
+typedef struct poll_sched_def_s
+{
+   uint8_t code;                // Command or register
+   uint16_t min_interval;       // Refresh interval when value changes (ms)
+   uint16_t max_interval;       // Refresh interval when value is stable (ms)
+} poll_sched_def_t;
+
+typedef struct poll_sched_state_s
+{
+   uint32_t due;                // When to poll next
+   uint16_t interval;           // Current refresh interval
+   uint16_t hash;               // Hash of last response
+   uint8_t valid:1;             // Hash is valid
+   uint8_t naks:2;              // NAKs in a row
+} poll_sched_state_t;
+
+typedef struct poll_sched_s
+{
+   const poll_sched_def_t *defs;
+   poll_sched_state_t *state;   // One per def
+   uint8_t count;               // Number of defs
+   uint8_t max_naks;            // NAKs in a row before a command is no longer polled, 0 to never give up
+   uint8_t budget;              // Most commands per cycle
+   uint8_t left;                // Commands left this cycle
+   uint32_t now;                // Start of this cycle (ms)
+} poll_sched_t;
+
+// Start a cycle, now in ms
+void poll_sched_start (poll_sched_t * s, uint32_t now);
+
+// Next command due this cycle, most overdue first, -1 if none or the budget is used
+int poll_sched_next (poll_sched_t * s);
+
+// Record the result of polling command n, and when to poll it next. hash is of the response if ok
+void poll_sched_done (poll_sched_t * s, int n, int ok, int nak, uint16_t hash);
+
+// Poll command n as soon as possible
+void poll_sched_expedite (poll_sched_t * s, int n);
+
+// Start again, polling everything
+void poll_sched_reset (poll_sched_t * s);
+
+#endif
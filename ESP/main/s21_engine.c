@@ -0,0 +1,700 @@
+/* S21 protocol engine */
+/* Copyright ©2022 Adrian Kennard, Andrews & Arnold Ltd. See LICENCE file for details .GPL 3.0 */
+
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include "s21_engine.h"
+
+// These macros are used to report incoming status values from the AC
+#define report_uint8(name,val) s->sink->report_uint8(s->sink->ctx,CONTROL_##name##_pos,val)
+#define report_int(name,val) s->sink->report_int(s->sink->ctx,CONTROL_##name##_pos,val)
+#define report_temp(name,val) s->sink->report_temp(s->sink->ctx,CONTROL_##name##_pos,val)
+#define report_bool(name,val) report_uint8(name, (val ? 1 : 0))
+#define report_string(name,val) s->sink->report_string(s->sink->ctx,CONTROL_##name##_pos,val)
+#define get_uint8(name) s->sink->get_uint8(s->sink->ctx,CONTROL_##name##_pos)
+#define get_temp(name) s->sink->get_temp(s->sink->ctx,CONTROL_##name##_pos)
+
+static void
+s21_event (s21_engine_t * s, int event, const uint8_t * cmd, int cmd_len, const void *data, int len, int value)
+{
+   s21_event_t e = {.cmd = cmd,.cmd_len = cmd_len,.data = data,.len = len,.value = value };
+   s->sink->event (s->sink->ctx, event, &e);
+}
+
+static int
+check_length (s21_engine_t * s, const uint8_t * cmd, int cmd_len, int len, int required, const uint8_t * payload)
+{
+   if (len >= required)
+      return 1;
+   s21_event (s, S21_EV_BADLENGTH, cmd, cmd_len, payload, len, required);
+   return 0;
+}
+
+static void s21_static_store (s21_engine_t * s, const uint8_t * cmd_buf, int len, const uint8_t * payload);
+
+// Payload of v3 responses is variable length, len is what we got
+static int
+s21_v3_response (s21_engine_t * s, const uint8_t * cmd_buf, int len, const uint8_t * payload)
+{
+   s21_static_store (s, cmd_buf, len, payload);
+   if (cmd_buf[0] == 'G' && cmd_buf[1] == 'U' && cmd_buf[2] == '0' && cmd_buf[3] == '5')
+   {                            // GU05 - model name, ASCII, padded with spaces or FF
+      char name[S21_STATIC_LEN + 1];
+      int n = 0;
+      while (n < len && n < S21_STATIC_LEN && payload[n] >= ' ' && payload[n] < 0x7F)
+      {
+         name[n] = payload[n];
+         n++;
+      }
+      while (n && name[n - 1] == ' ')
+         n--;
+      name[n] = 0;
+      if (n)
+         report_string (modelname, name);
+   }
+   if (cmd_buf[0] == 'G' && cmd_buf[1] == 'Y' && cmd_buf[3] == '0')
+   {
+      switch (cmd_buf[2])
+      {
+      case '0':                // GY00 - protocol version, v3+
+         if (check_length (s, cmd_buf, S21_V3_COMMAND_LEN, len, S21_PAYLOAD_LEN, payload))
+         {
+            s->protocol_major = (payload[2] & S21_SHIELD_MASK) + (payload[3] & S21_SHIELD_MASK) * 10;
+            s->protocol_minor = (payload[0] & S21_SHIELD_MASK) + (payload[1] & S21_SHIELD_MASK) * 10;
+         }
+         break;
+      }
+   }
+
+   return RES_OK;
+}
+
+// Response decoders, see s21responses.m
+enum
+{
+   S21_DEC_ONE,                 // Always 1
+   S21_DEC_CHAR,                // Boolean, byte is arg
+   S21_DEC_BIT,                 // Boolean, any of arg bits set
+   S21_DEC_BIT_NO_F6,           // As BIT, only if F6 does not work
+   S21_DEC_NOT_ALL,             // Boolean, not all of arg bits set
+   S21_DEC_MODE,                // Mode
+   S21_DEC_DEMAND,              // Demand, '1' means not set
+   S21_DEC_HALF,                // Temperature in 0.5C steps from 0x80
+   S21_DEC_INT,                 // Integer sensor, times arg
+   S21_DEC_HEX,                 // Hex sensor, times arg
+   S21_DEC_TEMP,                // Temperature sensor
+   S21_DEC_MODEL,               // Reversed string
+   S21_DEC_G1,                  // Special handlers
+   S21_DEC_G8,
+   S21_DEC_V3,
+   S21_DEC_RGFAN,
+};
+
+typedef struct s21_field_s
+{
+   uint8_t cmd[S21_COMMAND_LEN];        // Response code
+   uint8_t len;                 // Minimum payload length
+   uint8_t decoder;
+   uint8_t field;               // CONTROL_xxx_pos
+   uint8_t offset;              // In payload
+   uint8_t arg;
+} s21_field_t;
+
+static const s21_field_t s21_fields[] = {
+#define f(cmd,len,name,decoder,offset,arg)	{#cmd,len,S21_DEC_##decoder,CONTROL_##name##_pos,offset,arg},
+#define x(cmd,len,decoder)			{#cmd,len,S21_DEC_##decoder},
+#include "s21responses.m"
+};
+
+#define	S21_FIELDS	(sizeof (s21_fields) / sizeof (*s21_fields))
+
+// s21_response() finds a response by a plain scan. With this few lines that is a few dozen byte compares,
+// against at least 10ms to get each response at 2400 baud, so an index is not worth its RAM or code
+_Static_assert (S21_FIELDS <= 64, "s21_fields has grown, s21_response() should index it");
+
+static void
+s21_response_g1 (s21_engine_t * s, const uint8_t * payload)
+{                               // Heat, temp and fan depend on mode
+   uint8_t mode = get_uint8 (mode);
+   report_uint8 (heat, mode == FAIKIN_MODE_HEAT);       // Crude - TODO find if anything actually tells us this
+   if (mode == FAIKIN_MODE_HEAT || mode == FAIKIN_MODE_COOL || mode == FAIKIN_MODE_AUTO)
+      report_temp (temp, s21_decode_target_temp (payload[2]));
+   else if (get_temp (temp) != CTEMP_NONE)
+      report_temp (temp, get_temp (temp));      // Does not have temp in other modes
+   if (!s->rgfan)
+   {                            // RG is better, so we only look at G1 if RG does not work
+      if (payload[3] != 'A')    // Set fan speed
+         report_uint8 (fan, "00012345"[payload[3] & 0x7] - '0');        // XXX12345 mapped to A12345Q
+      else if (get_uint8 (fan) == 6)
+         report_uint8 (fan, 6); // Quiet mode set (it returns as auto, so we assume it should be quiet if fan speed is low)
+      else
+         report_uint8 (fan, 0); // Auto as fan too fast to be quiet mode
+   }
+}
+
+static void
+s21_response_rgfan (s21_engine_t * s, const uint8_t * payload)
+{
+   if (strchr ("34567AB", payload[0]))
+   {                            // Sensible FAN, else us F1
+      if (payload[0] >= '3' && payload[0] <= '7')
+         report_uint8 (fan, payload[0] - '3' + 1);      // 1-5
+      else if (payload[0] == 'A')
+         report_uint8 (fan, 0); // Auto
+      else if (payload[0] == 'B')
+         report_uint8 (fan, 6); // Quiet
+      s->rgfan = 1;
+   } else
+      s->rgfan = 0;
+}
+
+static void
+s21_response_model (s21_engine_t * s, int field, int len, const uint8_t * payload)
+{
+   // Normally response length would be 4, but let's try being more creative
+   // and future-proof. Accept the whole payload whatever it is.
+   char model[256];
+   int limit = len >= sizeof (model) ? sizeof (model) - 1 : len;
+   for (int i = 0; i < limit; i++)      // The string is provided in reverse
+      model[i] = payload[len - i - 1];
+   model[limit] = 0;
+   (*s->sink->report_string) (s->sink->ctx, field, model);
+}
+
+// Decode S21 response payload
+int
+s21_response (s21_engine_t * s, const uint8_t * cmd_buf, int len, const uint8_t * payload)
+{
+   const s21_sink_t *k = s->sink;
+
+   if (len >= 1)
+      s21_event (s, S21_EV_RESPONSE, cmd_buf, S21_COMMAND_LEN, payload, len, 0);
+   // Remember to add to polling if we add more handlers
+   const s21_field_t *f = s21_fields,
+      *e = s21_fields + S21_FIELDS;
+   while (f < e && (f->cmd[0] != cmd_buf[0] || f->cmd[1] != cmd_buf[1]))
+      f++;
+   if (f == e)
+      return RES_OK;            // Not one we know
+   int required = 0;
+   for (e = f; e < s21_fields + S21_FIELDS && e->cmd[0] == cmd_buf[0] && e->cmd[1] == cmd_buf[1]; e++)
+      if (e->len > required)
+         required = e->len;
+   if (!check_length (s, cmd_buf, S21_COMMAND_LEN, len, required, payload))
+      return RES_OK;
+   for (; f < e; f++)
+   {
+      const uint8_t *p = payload + f->offset;
+      switch (f->decoder)
+      {
+      case S21_DEC_ONE:
+         (*k->report_uint8) (k->ctx, f->field, 1);
+         break;
+      case S21_DEC_CHAR:
+         (*k->report_uint8) (k->ctx, f->field, *p == f->arg);
+         break;
+      case S21_DEC_BIT_NO_F6:
+         if (!s->F6.bad)
+            break;
+         // Fall through
+      case S21_DEC_BIT:
+         (*k->report_uint8) (k->ctx, f->field, (*p & f->arg) ? 1 : 0);
+         break;
+      case S21_DEC_NOT_ALL:
+         (*k->report_uint8) (k->ctx, f->field, (*p & f->arg) != f->arg);
+         break;
+      case S21_DEC_MODE:
+         (*k->report_uint8) (k->ctx, f->field, "30721003"[*p & 0x7] - '0');
+         break;
+      case S21_DEC_DEMAND:
+         if (*p != '1')
+            (*k->report_int) (k->ctx, f->field, 100 - (*p - '0'));
+         break;
+      case S21_DEC_HALF:
+         (*k->report_temp) (k->ctx, f->field, ((signed) *p - 0x80) * CTEMP (0.5));
+         break;
+      case S21_DEC_INT:
+         (*k->report_int) (k->ctx, f->field, s21_decode_int_sensor (p) * f->arg);
+         break;
+      case S21_DEC_HEX:
+         (*k->report_int) (k->ctx, f->field, s21_decode_hex_sensor (p) * f->arg);
+         break;
+      case S21_DEC_TEMP:
+         {
+            int t = s21_decode_temp_sensor (p);
+            if (t < CTEMP (100))        // Sanity check
+               (*k->report_temp) (k->ctx, f->field, t);
+         }
+         break;
+      case S21_DEC_MODEL:
+         s21_response_model (s, f->field, len, payload);
+         break;
+      case S21_DEC_G1:
+         s21_response_g1 (s, payload);
+         break;
+      case S21_DEC_G8:
+         s->protocol_major = payload[1] & (~0x30);
+         break;
+      case S21_DEC_V3:
+         return s21_v3_response (s, cmd_buf, len - 2, payload + 2);
+      case S21_DEC_RGFAN:
+         s21_response_rgfan (s, payload);
+         break;
+      }
+   }
+   return RES_OK;
+}
+
+static s21_control_t *
+s21_control_find (s21_engine_t * s, uint8_t cmd2)
+{
+   const char *c = strchr (S21_CONTROLS, cmd2);
+   return c && cmd2 ? &s->control[c - S21_CONTROLS] : NULL;
+}
+
+int
+s21_control_differs (s21_engine_t * s, uint8_t cmd2, const char *payload)
+{
+   s21_control_t *c = s21_control_find (s, cmd2);
+   return !c || !c->valid || memcmp (c->payload, payload, S21_PAYLOAD_LEN);
+}
+
+static int
+is_valid_s21_response (const uint8_t * buf, int rxlen, uint8_t cmd, uint8_t cmd2)
+{
+   return rxlen >= S21_MIN_PKT_LEN && buf[S21_STX_OFFSET] == STX && buf[rxlen - 1] == ETX &&
+      buf[S21_CMD0_OFFSET] == cmd && buf[S21_CMD1_OFFSET] == cmd2;
+}
+
+int
+s21_rx_feed (s21_rx_t * rx, const uint8_t * data, int len)
+{
+   int i = 0;
+   while (i < len && rx->state != S21_RX_DONE)
+   {
+      uint8_t c = data[i++];
+      if (rx->state == S21_RX_IDLE)
+      {                         // Skip anything before STX
+         if (c == STX)
+         {
+            rx->buf[0] = c;
+            rx->len = 1;
+            rx->state = S21_RX_BODY;
+         }
+         continue;
+      }
+      rx->buf[rx->len++] = c;
+      if (c == ETX || rx->len == sizeof (rx->buf))
+         rx->state = S21_RX_DONE;
+   }
+   return i;
+}
+
+int
+s21_command (s21_engine_t * s, uint8_t cmd, uint8_t cmd2, int payload_len, const char *payload)
+{
+   const s21_transport_t *t = s->transport;
+   const uint8_t c[S21_COMMAND_LEN] = { cmd, cmd2 };
+   uint8_t buf[256],
+     temp;
+   int txlen = S21_MIN_PKT_LEN + payload_len;
+   if (!s->snoop)
+   {                            // Send
+      buf[S21_STX_OFFSET] = STX;
+      buf[S21_CMD0_OFFSET] = cmd;
+      buf[S21_CMD1_OFFSET] = cmd2;
+      if (payload_len)
+         memcpy (buf + S21_PAYLOAD_OFFSET, payload, payload_len);
+      buf[S21_PAYLOAD_OFFSET + payload_len] = s21_checksum (buf, txlen);
+      buf[S21_PAYLOAD_OFFSET + payload_len + 1] = ETX;
+      s21_event (s, S21_EV_TX, c, S21_COMMAND_LEN, buf, txlen, 0);
+      t->write (t->ctx, buf, txlen);
+   }
+   // Wait ACK. Apparently some models omit it.
+   int read_timeout = s->read_timeout ? : S21_READ_TIMEOUT_MS;
+   int rxlen = t->read (t->ctx, &temp, 1, read_timeout);
+   if (rxlen == 0)
+   {
+      s21_event (s, S21_EV_TIMEOUT, c, S21_COMMAND_LEN, NULL, 0, 0);
+      return RES_TIMEOUT;
+   }
+   if (rxlen != 1 || (temp != ACK && temp != STX))
+   {
+      // Got something else
+      if (rxlen == 1 && temp == NAK)
+      {                         // Got an explicit NAK
+         s21_event (s, S21_EV_NAK, c, S21_COMMAND_LEN, payload, payload_len, 0);
+         return RES_NAK;
+      }
+      // Unexpected reply, protocol broken
+      s21_event (s, S21_EV_NOACK, c, S21_COMMAND_LEN, payload, payload_len, temp);
+      return RES_NOACK;
+   }
+   s21_rx_t rx = { 0 };
+   if (temp == ACK)
+      s21_event (s, S21_EV_ACKED, c, S21_COMMAND_LEN, NULL, 0, 0);
+   if (temp == STX)
+      s21_rx_feed (&rx, &temp, 1);      // No ACK, response started instead.
+   else if (cmd == 'D')
+   {                            // No response expected
+      s21_event (s, S21_EV_ACK, c, S21_COMMAND_LEN, payload, payload_len, 0);
+      s21_control_t *control = s21_control_find (s, cmd2);
+      if (control && payload_len == S21_PAYLOAD_LEN)
+      {                         // The unit has it now
+         memcpy (control->payload, payload, S21_PAYLOAD_LEN);
+         control->valid = 1;
+      }
+      s21_poll_expedite (s, 'F', cmd2);        // Read back what we have set
+      return RES_OK;
+   }
+   // Receive the response till ETX. Take whatever is already buffered in one go, and once
+   // the frame has started wait for at least as many bytes as the shortest frame still needs.
+   int byte_timeout = s->byte_timeout ? : S21_BYTE_TIMEOUT_MS;
+   while (rx.state != S21_RX_DONE)
+   {
+      uint8_t chunk[32];
+      int want = (rx.state == S21_RX_BODY ? S21_MIN_PKT_LEN - rx.len : 1);
+      int avail = t->available ? t->available (t->ctx) : 0;
+      if (want < avail)
+         want = avail;
+      if (want < 1)
+         want = 1;
+      if (want > sizeof (chunk))
+         want = sizeof (chunk);
+      // Waiting for a frame to start uses response timeout, inside a frame it is per byte
+      int got = t->read (t->ctx, chunk, want, rx.state == S21_RX_BODY ? byte_timeout * want : read_timeout);
+      if (got > 0)
+         s21_rx_feed (&rx, chunk, got);
+      if (got < want && rx.state != S21_RX_DONE)
+      {
+         s21_event (s, S21_EV_TIMEOUT, c, S21_COMMAND_LEN, rx.buf, rx.len, 0);
+         return RES_NOACK;
+      }
+   }
+   // Send ACK regardless of packet quality. If we don't ack due to checksum error,
+   // for example, the response will be sent again.
+   // Note not all ACs do that. My FTXF20D doesn't - Sonic-Amiga
+   temp = ACK;
+   t->write (t->ctx, &temp, 1);
+   s21_event (s, S21_EV_RX, rx.buf + S21_CMD0_OFFSET, S21_COMMAND_LEN, rx.buf, rx.len, 0);
+   // Check checksum
+   uint8_t sum = s21_checksum (rx.buf, rx.len);
+   if (sum != rx.buf[rx.len - 2])
+   {                            // Sees checksum of 03 actually sends as 05
+      s21_event (s, S21_EV_BADSUM, c, S21_COMMAND_LEN, rx.buf, rx.len, sum);
+      return RES_BAD;
+   }
+   // For reliability, verify that we've got back the exact transmitted data
+   if (!s->snoop && rx.len == txlen && is_valid_s21_response (rx.buf, rx.len, cmd, cmd2) &&
+       (payload_len == 0 || !memcmp (payload, rx.buf + S21_PAYLOAD_OFFSET, payload_len)))
+   {                            // Loop back
+      s21_event (s, S21_EV_LOOPBACK, c, S21_COMMAND_LEN, rx.buf, rx.len, 0);
+      return RES_OK;
+   }
+   // If we've got an STX, S21 protocol is now confirmed
+   s21_event (s, S21_EV_VALID, c, S21_COMMAND_LEN, rx.buf, rx.len, 0);
+   // An expected S21 reply contains the first character of the command
+   // incremented by 1, the second character is left intact
+   if (!s->snoop && !is_valid_s21_response (rx.buf, rx.len, cmd + 1, cmd2))
+   {                            // Malformed response, no proper S21
+      int bad = 0;
+      if (rx.buf[0] != STX)
+         bad |= S21_BAD_HEAD;
+      if (rx.buf[1] != cmd + 1 || rx.buf[2] != cmd2)
+         bad |= S21_BAD_MISMATCH;
+      s21_event (s, S21_EV_BADHEAD, c, S21_COMMAND_LEN, rx.buf, rx.len, bad);
+      return RES_BAD;
+   }
+   // Note the response, so the poll scheduler can tell if it has changed
+   uint16_t hash = 0;
+   for (int i = S21_CMD0_OFFSET; i < rx.len - 2; i++)
+      hash = hash * 33 + rx.buf[i];
+   s->rx_hash = hash;
+   s->rx_new = 1;
+   return s21_response (s, rx.buf + S21_CMD0_OFFSET, rx.len - S21_MIN_PKT_LEN, rx.buf + S21_PAYLOAD_OFFSET);
+}
+
+#define	S21_POLL(c,p,prio,min,max,flags)	{#c,#p,offsetof(s21_engine_t,c##p),prio,flags,min,max}
+// Poll schedule. Priority 0 is what users see and control (power, mode, set point, fan), then
+// room temperature and the other controls, then sensors, then debug only stuff
+static const s21_poll_def_t s21_polls[] = {
+   S21_POLL (FY, 00, 0, 1000, 1000, S21_POLL_ONCE | S21_POLL_VERSION),
+   S21_POLL (F8,, 0, 1000, 1000, S21_POLL_ONCE | S21_POLL_VERSION),
+   S21_POLL (FC,, 0, 1000, 1000, S21_POLL_ONCE),
+   S21_POLL (F1,, 0, 1000, 1000, 0),
+   S21_POLL (RH,, 1, 2000, 20000, 0),
+   S21_POLL (F5,, 1, 2000, 30000, 0),
+   S21_POLL (F6,, 1, 2000, 30000, 0),
+   S21_POLL (F3,, 1, 2000, 30000, S21_POLL_NO_F6),
+   S21_POLL (F7,, 1, 2000, 30000, 0),
+   S21_POLL (RG,, 1, 2000, 30000, 0),
+   S21_POLL (RL,, 2, 2000, 30000, 0),
+   S21_POLL (Rd,, 2, 2000, 30000, 0),
+   S21_POLL (Ra,, 2, 5000, 60000, 0),
+   S21_POLL (RI,, 2, 5000, 60000, 0),
+   S21_POLL (RN,, 2, 5000, 60000, 0),
+   S21_POLL (F9,, 2, 5000, 60000, S21_POLL_NO_R),
+   S21_POLL (FM,, 2, 10000, 60000, 0),
+   S21_POLL (FU, 05, 2, 1000, 1000, S21_POLL_ONCE | S21_POLL_V3),
+   S21_POLL (FU, 00, 2, 1000, 1000, S21_POLL_ONCE | S21_POLL_V3),
+   S21_POLL (FY, 10, 2, 1000, 1000, S21_POLL_ONCE | S21_POLL_V3),
+   S21_POLL (FY, 20, 2, 1000, 1000, S21_POLL_ONCE | S21_POLL_V3),
+   S21_POLL (F2,, 3, 10000, 60000, S21_POLL_DEBUG),
+   S21_POLL (F4,, 3, 10000, 60000, S21_POLL_DEBUG),
+   S21_POLL (FA,, 3, 10000, 60000, S21_POLL_DEBUG),
+   S21_POLL (FB,, 3, 10000, 60000, S21_POLL_DEBUG),
+   S21_POLL (FG,, 3, 10000, 60000, S21_POLL_DEBUG),
+   S21_POLL (FK,, 3, 10000, 60000, S21_POLL_DEBUG),
+   S21_POLL (FN,, 3, 10000, 60000, S21_POLL_DEBUG),
+   S21_POLL (FP,, 3, 10000, 60000, S21_POLL_DEBUG),
+   S21_POLL (FQ,, 3, 10000, 60000, S21_POLL_DEBUG),
+   S21_POLL (FS,, 3, 10000, 60000, S21_POLL_DEBUG),
+   S21_POLL (FT,, 3, 10000, 60000, S21_POLL_DEBUG),
+   S21_POLL (RM,, 3, 10000, 60000, S21_POLL_DEBUG),
+   S21_POLL (RX,, 3, 10000, 60000, S21_POLL_DEBUG),
+   S21_POLL (RD,, 3, 10000, 60000, S21_POLL_DEBUG),
+   S21_POLL (FU, 02, 3, 1000, 1000, S21_POLL_ONCE | S21_POLL_V3 | S21_POLL_DEBUG),
+   S21_POLL (FU, 04, 3, 1000, 1000, S21_POLL_ONCE | S21_POLL_V3 | S21_POLL_DEBUG),
+   S21_POLL (FU, 15, 3, 1000, 1000, S21_POLL_ONCE | S21_POLL_V3 | S21_POLL_DEBUG),
+   S21_POLL (FU, 25, 3, 1000, 1000, S21_POLL_ONCE | S21_POLL_V3 | S21_POLL_DEBUG),
+   S21_POLL (FU, 35, 3, 1000, 1000, S21_POLL_ONCE | S21_POLL_V3 | S21_POLL_DEBUG),
+   S21_POLL (FU, 45, 3, 1000, 1000, S21_POLL_ONCE | S21_POLL_V3 | S21_POLL_DEBUG),
+   S21_POLL (FX, 00, 3, 1000, 1000, S21_POLL_ONCE | S21_POLL_V3 | S21_POLL_DEBUG),
+   S21_POLL (FX, 10, 3, 1000, 1000, S21_POLL_ONCE | S21_POLL_V3 | S21_POLL_DEBUG),
+   S21_POLL (FX, 20, 3, 1000, 1000, S21_POLL_ONCE | S21_POLL_V3 | S21_POLL_DEBUG),
+   S21_POLL (FX, 30, 3, 1000, 1000, S21_POLL_ONCE | S21_POLL_V3 | S21_POLL_DEBUG),
+   S21_POLL (FX, 40, 3, 1000, 1000, S21_POLL_ONCE | S21_POLL_V3 | S21_POLL_DEBUG),
+   S21_POLL (FX, 50, 3, 1000, 1000, S21_POLL_ONCE | S21_POLL_V3 | S21_POLL_DEBUG),
+   S21_POLL (FX, 60, 3, 1000, 1000, S21_POLL_ONCE | S21_POLL_V3 | S21_POLL_DEBUG),
+   S21_POLL (FX, 70, 3, 1000, 1000, S21_POLL_ONCE | S21_POLL_V3 | S21_POLL_DEBUG),
+   S21_POLL (FX, 90, 3, 1000, 1000, S21_POLL_ONCE | S21_POLL_V3 | S21_POLL_DEBUG),
+   S21_POLL (FX, A0, 3, 1000, 1000, S21_POLL_ONCE | S21_POLL_V3 | S21_POLL_DEBUG),
+   S21_POLL (FX, B0, 3, 1000, 1000, S21_POLL_ONCE | S21_POLL_V3 | S21_POLL_DEBUG),
+   S21_POLL (FX, C0, 3, 1000, 1000, S21_POLL_ONCE | S21_POLL_V3 | S21_POLL_DEBUG),
+   S21_POLL (FX, D0, 3, 1000, 1000, S21_POLL_ONCE | S21_POLL_V3 | S21_POLL_DEBUG),
+   S21_POLL (FX, E0, 3, 1000, 1000, S21_POLL_ONCE | S21_POLL_V3 | S21_POLL_DEBUG),
+   S21_POLL (FX, F0, 3, 1000, 1000, S21_POLL_ONCE | S21_POLL_V3 | S21_POLL_DEBUG),
+   S21_POLL (FX, 01, 3, 1000, 1000, S21_POLL_ONCE | S21_POLL_V3 | S21_POLL_DEBUG),
+   S21_POLL (FX, 11, 3, 1000, 1000, S21_POLL_ONCE | S21_POLL_V3 | S21_POLL_DEBUG),
+   S21_POLL (FX, 21, 3, 1000, 1000, S21_POLL_ONCE | S21_POLL_V3 | S21_POLL_DEBUG),
+   S21_POLL (FX, 31, 3, 1000, 1000, S21_POLL_ONCE | S21_POLL_V3 | S21_POLL_DEBUG),
+   S21_POLL (FX, 41, 3, 1000, 1000, S21_POLL_ONCE | S21_POLL_V3 | S21_POLL_DEBUG),
+   S21_POLL (FX, 51, 3, 1000, 1000, S21_POLL_ONCE | S21_POLL_V3 | S21_POLL_DEBUG),
+   S21_POLL (FX, 61, 3, 1000, 1000, S21_POLL_ONCE | S21_POLL_V3 | S21_POLL_DEBUG),
+   S21_POLL (FX, 71, 3, 1000, 1000, S21_POLL_ONCE | S21_POLL_V3 | S21_POLL_DEBUG),
+   S21_POLL (FX, 81, 3, 1000, 1000, S21_POLL_ONCE | S21_POLL_V3 | S21_POLL_DEBUG),
+};
+
+#undef S21_POLL
+#define	S21_POLLS	(sizeof (s21_polls) / sizeof (*s21_polls))
+_Static_assert (S21_POLLS <= S21_POLL_MAX, "S21_POLL_MAX too small");
+
+static poll_t *
+s21_poll_status (s21_engine_t * s, const s21_poll_def_t * p)
+{
+   return (poll_t *) ((uint8_t *) s + p->status);
+}
+
+static int
+s21_poll_wanted (s21_engine_t * s, const s21_poll_def_t * p)
+{
+   poll_t *status = s21_poll_status (s, p);
+   if (status->bad)
+      return 0;                 // Not supported
+   if ((p->flags & S21_POLL_DEBUG) && !s->debug)
+      return 0;
+   if ((p->flags & S21_POLL_ONCE) && status->ack)
+      return 0;
+   if ((p->flags & S21_POLL_V3) && s->protocol_major < 3)
+      return 0;
+   if ((p->flags & S21_POLL_VERSION) && (s->FY00.ack || s->F8.ack))
+      return 0;
+   if ((p->flags & S21_POLL_NO_F6) && !s->F6.bad && !s->debug)
+      return 0;                 // If F6 works we assume we don't need F3
+   if ((p->flags & S21_POLL_NO_R) && !s->RH.bad && !s->Ra.bad)
+      return 0;                 // Don't use F9
+   return 1;
+}
+
+const s21_poll_def_t *
+s21_poll_next (s21_engine_t * s, uint32_t now)
+{
+   const s21_poll_def_t *best = NULL;
+   int32_t best_late = 0;
+   s->poll_now = now;
+   for (int i = 0; i < S21_POLLS; i++)
+   {
+      const s21_poll_def_t *p = &s21_polls[i];
+      int32_t late = now - s->poll[i].due;
+      if (late < -S21_POLL_SLACK_MS || !s21_poll_wanted (s, p))
+         continue;
+      if (!best || p->priority < best->priority || (p->priority == best->priority && late > best_late))
+      {                         // Most important first, then most overdue
+         best = p;
+         best_late = late;
+      }
+   }
+   return best;
+}
+
+void
+s21_poll_done (s21_engine_t * s, const s21_poll_def_t * p, uint32_t now, int res)
+{
+   s21_poll_state_t *state = &s->poll[p - s21_polls];
+   poll_t *status = s21_poll_status (s, p);
+   if (!state->interval)
+      state->interval = p->min_interval;
+   if (res == RES_OK)
+   {
+      status->ack = 1;
+      status->nak = 0;
+      status->bad = 0;
+      if (s->rx_new && state->valid && s->rx_hash == state->hash)
+      {                         // No change, back off
+         state->interval *= 2;
+         if (state->interval > p->max_interval)
+            state->interval = p->max_interval;
+      } else
+      {
+         state->interval = p->min_interval;
+         s21_control_t *control = (p->cmd[0] == 'F' ? s21_control_find (s, p->cmd[1]) : NULL);
+         if (control && state->valid)
+            control->valid = 0; // Changed on the unit, maybe by remote, so next D command must go out
+      }
+      if (s->rx_new)
+      {
+         state->hash = s->rx_hash;
+         state->valid = 1;
+      }
+   } else
+   {
+      if (res == RES_NAK)
+      {
+         status->nak++;
+         if (!status->nak)
+            status->bad = 1;    // Too many NAKs
+      }
+      state->interval = p->min_interval;
+   }
+   s->rx_new = 0;
+   state->due = now + state->interval;
+}
+
+static void
+s21_static_store (s21_engine_t * s, const uint8_t * cmd_buf, int len, const uint8_t * payload)
+{                               // Keep static values, so they are read once
+   const s21_poll_def_t *p;
+   for (p = s21_polls; p < s21_polls + S21_POLLS; p++)
+      if ((p->flags & S21_POLL_ONCE) && !(p->flags & S21_POLL_DEBUG) && p->cmd[0] + 1 == cmd_buf[0] && p->cmd[1] == cmd_buf[1] &&
+          p->payload[0] == cmd_buf[2] && p->payload[1] == cmd_buf[3])
+         break;
+   if (p == s21_polls + S21_POLLS)
+      return;                   // Not static, or only for debug
+   s21_static_t *v = NULL;
+   for (int i = 0; i < S21_STATIC_MAX && !v; i++)
+      if (!*s->statics[i].cmd || !memcmp (s->statics[i].cmd, cmd_buf, S21_V3_COMMAND_LEN))
+         v = &s->statics[i];
+   if (!v)
+      return;                   // Full
+   memcpy (v->cmd, cmd_buf, S21_V3_COMMAND_LEN);
+   v->len = (len > S21_STATIC_LEN ? S21_STATIC_LEN : len);
+   memcpy (v->data, payload, v->len);
+}
+
+const s21_static_t *
+s21_static_get (s21_engine_t * s, int n)
+{
+   if (n < 0 || n >= S21_STATIC_MAX || !*s->statics[n].cmd)
+      return NULL;
+   return &s->statics[n];
+}
+
+void
+s21_poll_expedite (s21_engine_t * s, uint8_t cmd, uint8_t cmd2)
+{
+   for (int i = 0; i < S21_POLLS; i++)
+      if (s21_polls[i].cmd[0] == cmd && s21_polls[i].cmd[1] == cmd2)
+      {
+         s->poll[i].due = s->poll_now;
+         s->poll[i].interval = s21_polls[i].min_interval;
+      }
+}
+
+void
+s21_poll_reset (s21_engine_t * s)
+{
+   for (int i = 0; i < S21_POLLS; i++)
+   {
+      poll_t *status = s21_poll_status (s, &s21_polls[i]);
+      status->ack = status->nak = status->bad = 0;
+   }
+   memset (s->poll, 0, sizeof (s->poll));
+   memset (s->control, 0, sizeof (s->control));
+   memset (s->statics, 0, sizeof (s->statics));
+   for (int i = 0; i < S21_POLLS; i++)
+      s->poll[i].due = s->poll_now;
+}
+
+int
+s21_caps_save (s21_engine_t * s, char *buf, int len)
+{
+   int pos = 0;
+   if (len)
+      *buf = 0;
+   for (int i = 0; i < S21_POLLS; i++)
+   {
+      const s21_poll_def_t *p = &s21_polls[i];
+      poll_t *status = s21_poll_status (s, p);
+      if ((!status->ack && !status->bad) || (p->flags & S21_POLL_DEBUG))
+         continue;              // Debug only commands are probed each time, so the map stays short
+      int l = snprintf (buf + pos, len - pos, "%s%s%s%s", pos ? " " : "", status->bad ? "-" : "", p->cmd, p->payload);
+      if (l >= len - pos)
+         return 0;              // Does not fit, don't save a partial map
+      pos += l;
+   }
+   return pos;
+}
+
+int
+s21_caps_load (s21_engine_t * s, const char *caps)
+{
+   int count = 0;
+   while (caps && *caps)
+   {
+      while (*caps == ' ')
+         caps++;
+      const char *e = caps;
+      while (*e && *e != ' ')
+         e++;
+      uint8_t bad = (*caps == '-');
+      const char *name = caps + bad;
+      for (int i = 0; i < S21_POLLS; i++)
+      {
+         const s21_poll_def_t *p = &s21_polls[i];
+         int cl = strlen (p->cmd),
+            pl = strlen (p->payload);
+         if (e - name != cl + pl || strncmp (name, p->cmd, cl) || strncmp (name + cl, p->payload, pl))
+            continue;
+         poll_t *status = s21_poll_status (s, p);
+         status->nak = 0;
+         if (bad)
+            status->bad = 1;
+         else if (!(p->flags & S21_POLL_ONCE))
+            status->ack = 1;    // Static values still have to be read once
+         count++;
+         break;
+      }
+      caps = e;
+   }
+   return count;
+}
+
+int
+s21_caps_settled (s21_engine_t * s)
+{
+   for (int i = 0; i < S21_POLLS; i++)
+      if (s21_poll_wanted (s, &s21_polls[i]) && !s21_poll_status (s, &s21_polls[i])->ack)
+         return 0;              // Still probing this one
+   return 1;
+}
@@ -0,0 +1,285 @@
+#ifndef _S21_ENGINE_H
+#define _S21_ENGINE_H
+
+// S21 protocol engine. Framing, ACK/NAK handling, loopback detection and
+// payload decoding live here. The engine knows nothing about UARTs or about
+// the global Faikin state; it talks to the world through a transport (bytes
+// in and out) and a sink (decoded values and protocol events). This allows
+// to build and run it on a host against the simulator.
+
+#include <stdint.h>
+
+#include "daikin_s21.h"
+
+// Command results, also used by other protocol handlers
+enum
+{
+   RES_OK,
+   RES_NAK,
+   RES_NOACK,
+   RES_BAD,
+   RES_WAIT,
+   RES_TIMEOUT
+};
+
+// Timeout value for serial port read, i.e. for a response to start
+#define S21_READ_TIMEOUT_MS 500
+// Timeout between bytes once a frame has started. A byte takes ~5ms at 2400 baud 8E2
+#define S21_BYTE_TIMEOUT_MS 50
+
+// Byte level transport
+typedef struct s21_transport_s
+{
+   // Send len bytes. Returns number of bytes sent or negative on error.
+   int (*write) (void *ctx, const uint8_t * buf, int len);
+   // Read up to len bytes, waiting until all are received or timeout expires.
+   // Returns number of bytes read, 0 on timeout.
+   int (*read) (void *ctx, uint8_t * buf, int len, int timeout_ms);
+   // Number of bytes already received and waiting to be read. Optional.
+   int (*available) (void *ctx);
+   void *ctx;
+} s21_transport_t;
+
+// Protocol events, reported to the sink
+enum
+{
+   S21_EV_TX,                   // Frame sent (data = frame)
+   S21_EV_RX,                   // Frame received (data = frame)
+   S21_EV_ACK,                  // Command without response was ACKed
+   S21_EV_NAK,                  // Command was NAKed
+   S21_EV_NOACK,                // Garbage instead of ACK (value = byte received)
+   S21_EV_TIMEOUT,              // Nothing or incomplete frame received (data = partial frame)
+   S21_EV_BADSUM,               // Checksum error (value = expected checksum, data = frame)
+   S21_EV_BADHEAD,              // Malformed response (value = bitmask of S21_BAD_xxx, data = frame)
+   S21_EV_LOOPBACK,             // Our own frame came back
+   S21_EV_VALID,                // A valid frame came from a real unit
+   S21_EV_BADLENGTH,            // Payload too short (value = expected length, data = payload)
+   S21_EV_RESPONSE,             // Response payload to be decoded (data = payload)
+   S21_EV_ACKED,                // Got ACK, response or nothing follows
+   S21_EV_MAX
+};
+
+// S21_EV_BADHEAD value bits
+#define S21_BAD_HEAD     1
+#define S21_BAD_MISMATCH 2
+
+typedef struct s21_event_s
+{
+   const uint8_t *cmd;          // Command code, if known
+   int cmd_len;
+   const uint8_t *data;         // Event specific data
+   int len;
+   int value;                   // Event specific value
+} s21_event_t;
+
+// Receiver of decoded data. Fields are identified by CONTROL_xxx_pos numbers,
+// see faikin_enums.h
+typedef struct s21_sink_s
+{
+   void (*report_uint8) (void *ctx, int field, uint8_t val);
+   void (*report_int) (void *ctx, int field, int val);
+   void (*report_temp) (void *ctx, int field, int val); // In 0.01C, see ctemp_t
+   void (*report_string) (void *ctx, int field, const char *val);
+   // Current values. Some responses are interpreted relative to what we have
+   uint8_t (*get_uint8) (void *ctx, int field);
+   int (*get_temp) (void *ctx, int field);     // CTEMP_NONE if not known
+   void (*event) (void *ctx, int event, const s21_event_t * e);
+   void *ctx;
+} s21_sink_t;
+
+typedef struct poll_s
+{
+   uint8_t ack:1;               //      We got an ACK so this is valid
+   uint8_t nak:2;               //      Count of NAKs in a row - if too many we set bad
+   uint8_t bad:1;               //      Too many NAKs, assume not supported
+} poll_t;
+
+// Frame assembler, collects STX..ETX from a byte stream
+enum
+{
+   S21_RX_IDLE,                 // Waiting for STX, anything else is skipped
+   S21_RX_BODY,                 // Got STX, waiting for ETX
+   S21_RX_DONE,                 // Got complete frame
+};
+
+typedef struct s21_rx_s
+{
+   uint8_t buf[256];
+   int len;
+   uint8_t state;
+} s21_rx_t;
+
+// Poll scheduler. Each command has a priority and a refresh interval, which backs off
+// from min to max while the response does not change and snaps back to min when it does.
+#define S21_POLL_MAX      72    // Size of poll table
+#define S21_POLL_BUDGET   6     // Max number of polls per main loop cycle
+#define S21_POLL_SLACK_MS 200   // Poll early by this much, main loop cycles are not exact
+
+// Poll flags
+#define S21_POLL_DEBUG    1     // Only when debugging
+#define S21_POLL_ONCE     2     // Static value, stop once we have it
+#define S21_POLL_VERSION  4     // Protocol version, stop once either FY00 or F8 works
+#define S21_POLL_NO_F6    8     // Alternative to F6, only when F6 does not work
+#define S21_POLL_NO_R     16    // Alternative to RH/Ra, only when they do not work
+#define S21_POLL_V3       32    // Protocol v3 or later only
+
+typedef struct s21_poll_def_s
+{
+   char cmd[3];                 // Command
+   char payload[3];             // Payload, if any
+   uint8_t status;              // Offset of poll_t in s21_engine_t
+   uint8_t priority;            // Lower is more important
+   uint8_t flags;
+   uint16_t min_interval;       // Refresh interval when value changes (ms)
+   uint16_t max_interval;       // Refresh interval when value is stable (ms)
+} s21_poll_def_t;
+
+typedef struct s21_poll_state_s
+{
+   uint32_t due;                // When to poll next
+   uint16_t interval;           // Current refresh interval
+   uint16_t hash;               // Hash of last response
+   uint8_t valid:1;             // Hash is valid
+} s21_poll_state_t;
+
+// Static values (S21_POLL_ONCE v3 responses), read once and kept. Debug only ones are not kept, they are
+// seen in the debug output the one time they are read
+#define S21_STATIC_MAX    5     // Number of static values we keep
+#define S21_STATIC_LEN    32    // Longest static value we keep
+typedef struct s21_static_s
+{
+   uint8_t cmd[S21_V3_COMMAND_LEN];     // Response code, e.g. GU05, zero if not used
+   uint8_t len;
+   uint8_t data[S21_STATIC_LEN];
+} s21_static_t;
+
+// Last acknowledged payload of each D command, so we don't send what the unit already has
+#define S21_CONTROLS "13567"    // D commands we track, each has matching F command
+typedef struct s21_control_s
+{
+   uint8_t payload[S21_PAYLOAD_LEN];
+   uint8_t valid:1;
+} s21_control_t;
+
+typedef struct s21_engine_s
+{
+   const s21_transport_t *transport;
+   const s21_sink_t *sink;
+   // Status of S21 messages that get a valid response - this is a count of NAKs, so 0 means working...
+   poll_t FY00;
+   poll_t F1;
+   poll_t F2;
+   poll_t F3;
+   poll_t F4;
+   poll_t F5;
+   poll_t F6;
+   poll_t F7;
+   poll_t F8;
+   poll_t F9;
+   poll_t FA;
+   poll_t FB;
+   poll_t FC;
+   poll_t FG;
+   poll_t FK;
+   poll_t FN;
+   poll_t FM;
+   poll_t FP;
+   poll_t FQ;
+   poll_t FS;
+   poll_t FT;
+   poll_t RD;
+   poll_t RG;
+   poll_t RI;
+   poll_t RM;
+   poll_t RL;
+   poll_t RN;
+   poll_t RH;
+   poll_t RX;
+   poll_t Ra;
+   poll_t Rd;
+   poll_t FU00;
+   poll_t FU02;
+   poll_t FU04;
+   poll_t FU05;
+   poll_t FU15;
+   poll_t FU25;
+   poll_t FU35;
+   poll_t FU45;
+   poll_t FY10;
+   poll_t FY20;
+   poll_t FX00;
+   poll_t FX10;
+   poll_t FX20;
+   poll_t FX30;
+   poll_t FX40;
+   poll_t FX50;
+   poll_t FX60;
+   poll_t FX70;
+   poll_t FX90;
+   poll_t FXA0;
+   poll_t FXB0;
+   poll_t FXC0;
+   poll_t FXD0;
+   poll_t FXE0;
+   poll_t FXF0;
+   poll_t FX01;
+   poll_t FX11;
+   poll_t FX21;
+   poll_t FX31;
+   poll_t FX41;
+   poll_t FX51;
+   poll_t FX61;
+   poll_t FX71;
+   poll_t FX81;
+   uint8_t rgfan:1;             // Use RG for fan
+   uint8_t snoop:1;             // Listen only, do not send
+   uint8_t protocol_major;      // Protocol version
+   uint8_t protocol_minor;
+   uint16_t read_timeout;       // Timeout for a response to start (ms), 0 for S21_READ_TIMEOUT_MS
+   uint16_t byte_timeout;       // Inter-byte timeout (ms), 0 for S21_BYTE_TIMEOUT_MS
+   uint8_t debug:1;             // Also poll debug only commands
+   uint8_t rx_new:1;            // Got a response, rx_hash is valid
+   uint16_t rx_hash;            // Hash of last response payload
+   uint32_t poll_now;           // Time of last s21_poll_next()
+   s21_poll_state_t poll[S21_POLL_MAX];
+   s21_control_t control[sizeof (S21_CONTROLS) - 1];
+   s21_static_t statics[S21_STATIC_MAX];
+} s21_engine_t;
+
+// Feed bytes to frame assembler. Returns number of bytes consumed, stops after ETX
+int s21_rx_feed (s21_rx_t * rx, const uint8_t * data, int len);
+
+// Send a command and process the response
+int s21_command (s21_engine_t * s, uint8_t cmd, uint8_t cmd2, int payload_len, const char *payload);
+
+// Decode a response payload. cmd points to the response command code
+int s21_response (s21_engine_t * s, const uint8_t * cmd, int len, const uint8_t * payload);
+
+// Get next command due to be polled, NULL if nothing is due. now is in ms
+const s21_poll_def_t *s21_poll_next (s21_engine_t * s, uint32_t now);
+
+// Record result (RES_xxx) of polling a command and schedule next poll
+void s21_poll_done (s21_engine_t * s, const s21_poll_def_t * p, uint32_t now, int res);
+
+// Poll a command as soon as possible, e.g. to confirm a change we made
+void s21_poll_expedite (s21_engine_t * s, uint8_t cmd, uint8_t cmd2);
+
+// Check if D command payload differs from what the unit has last acknowledged
+int s21_control_differs (s21_engine_t * s, uint8_t cmd2, const char *payload);
+
+// Get the nth static value we have, NULL when there are no more
+const s21_static_t *s21_static_get (s21_engine_t * s, int n);
+
+// Forget what commands work and start polling from scratch, e.g. when protocol was lost
+void s21_poll_reset (s21_engine_t * s);
+
+// Capability map, i.e. which polled commands work, as text, e.g. "FY00 F1 F5 -F2 -RG", where "-" means
+// not supported. This can be stored, and loaded next time, so that a known unit does not need probing.
+// Save returns length of text, 0 if nothing known yet
+int s21_caps_save (s21_engine_t * s, char *buf, int len);
+// Load capability map, returns number of commands loaded. Unknown commands are ignored
+int s21_caps_load (s21_engine_t * s, const char *caps);
+// Check if we know about every command we want to poll, i.e. the map is complete
+int s21_caps_settled (s21_engine_t * s);
+
+#endif
@@ -0,0 +1,68 @@
+// S21 responses
+// Each line maps part of a response payload to a field (see acfields.m), or to a special handler.
+// Lines for the same response must be together, and are applied in order.
+// len is minimum payload length, the whole response is ignored if shorter than any of its lines need.
+
+#ifndef f
+#define f(cmd,len,name,decoder,offset,arg)      // Field: decoder (S21_DEC_xxx) is applied to payload[offset] with arg
+#endif
+
+#ifndef x
+#define x(cmd,len,decoder)      // Special handler, for things that are not simply a field
+#endif
+
+// G1 - basic status
+f(G1,4,online,ONE,0,0)
+f(G1,4,power,CHAR,0,'1')
+f(G1,4,mode,MODE,1,0)           // FHCA456D mapped from AXDCHXF
+x(G1,4,G1)                      // Heat, temp and fan depend on mode and on RG
+
+// G3 - seems to be an alternative to G6, which does not give powerful if F6 works
+f(G3,4,powerful,BIT_NO_F6,3,0x02)
+
+// G5 - swing status
+f(G5,1,swingv,BIT,0,0x01)
+f(G5,1,swingh,BIT,0,0x02)
+
+// G6 - "powerful" mode and some others
+f(G6,4,powerful,BIT,0,0x02)
+f(G6,4,comfort,BIT,0,0x40)
+f(G6,4,quiet,BIT,0,0x80)
+f(G6,4,streamer,BIT,1,0x80)
+f(G6,4,sensor,BIT,3,0x08)
+f(G6,4,led,NOT_ALL,3,0x0C)
+
+// G7 - "demand" and "eco" mode
+f(G7,2,demand,DEMAND,0,0)
+f(G7,2,econo,BIT,1,0x02)
+
+// G8 - protocol version
+x(G8,2,G8)
+
+// G9 - temperatures, in 0.5C steps
+f(G9,2,home,HALF,0,0)
+f(G9,2,outside,HALF,1,0)
+
+// GC - model, as a reversed string of any length
+f(GC,1,model,MODEL,0,0)
+
+// GM - power meter, 100Wh units
+f(GM,4,Wh,HEX,0,100)
+
+// GY and GU - v3 responses, command length is 4
+x(GY,2,V3)
+x(GU,2,V3)
+
+// SG - fan, better than G1 if it works
+x(SG,1,RGFAN)
+
+// Sensors
+f(SL,3,fanrpm,INT,0,10)
+f(Sd,3,comp,INT,0,1)
+f(SN,3,anglev,INT,0,1)
+f(SH,4,home,TEMP,0,0)
+f(Sa,4,outside,TEMP,0,0)
+f(SI,4,liquid,TEMP,0,0)         // Liquid ???
+
+#undef	f
+#undef	x
@@ -0,0 +1,260 @@
+/* CN_WIRED waveform bench. Runs Faikin's CN_WIRED encoder and decoder against each other over a simulated
+   line with jitter, glitches and clock drift, and measures packet error rate */
+
+#define _GNU_SOURCE
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "main/cn_wired_codec.h"
+
+static int packets    = 10000; // Number of packets per run
+static double jitter  = 0;     // Edge jitter, standard deviation in microseconds
+static double glitch  = 0;     // Probability of a glitch in a packet
+static int glitch_len = 50;    // Glitch length in microseconds
+static double drift   = 0;     // Sender clock error, percent, positive is slow
+static unsigned seed  = 1;
+static int sweep      = 0;     // Print a table of error rate against jitter and drift
+
+// A line state as the receiving interrupt sees it
+typedef struct {
+   int high;
+   double length;
+} state_t;
+
+#define MAX_STATES (CNW_PKT_BITS * 2 + 16)
+
+typedef struct {
+   unsigned int sent;
+   unsigned int ok;
+   unsigned int corrupt;  // Decoded, but not what was sent
+   unsigned int lost;     // Not decoded at all
+   unsigned int trailers;
+   unsigned int partial;
+   unsigned int marginal; // Bits outside threshold
+   unsigned long quality; // Sum of quality of decoded packets
+   unsigned long edges;
+   double decode_ns;      // CPU time in decoder
+} result_t;
+
+static double gaussian(void)
+{
+   // Box-Muller
+   double u1 = (rand() + 1.0) / (RAND_MAX + 2.0);
+   double u2 = (rand() + 1.0) / (RAND_MAX + 2.0);
+
+   return sqrt(-2 * log(u1)) * cos(2 * M_PI * u2);
+}
+
+static double now_ns(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+   return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// Make line states of one packet, preceded by idle line, as they arrive at the receiver
+static int make_waveform(const uint8_t *data, double jit, double drf, state_t *out)
+{
+   cnw_encoder_t enc;
+   double edge[MAX_STATES + 1];
+   int kind[MAX_STATES];
+   int n = 0;
+   double t = 0;
+
+   cnw_encoder_start(&enc, data);
+   for (int k; (k = cnw_encoder_next(&enc)) != CNW_NONE && n < MAX_STATES; n++) {
+      edge[n] = t;
+      kind[n] = k;
+      t += cnw_nominal[k] * (1 + drf / 100);
+   }
+   edge[n] = t;
+   // Every edge moves on its own, so neighbouring lengths are affected in opposite ways
+   for (int i = 0; i <= n; i++)
+      edge[i] += jit * gaussian();
+
+   int m = 0;
+
+   out[m].high = 1; // Idle
+   out[m++].length = 100000;
+   for (int i = 0; i < n; i++) {
+      double length = edge[i + 1] - edge[i];
+
+      if (length < 1)
+         length = 1;
+      out[m].high = (kind[i] != CNW_SYNC && kind[i] != CNW_SPACE && kind[i] != CNW_END);
+      out[m++].length = length;
+   }
+   out[m].high = 1; // Back to idle
+   out[m++].length = 100000;
+
+   if (glitch > 0 && (double)rand() / RAND_MAX < glitch && m > 3) {
+      // Split a random state with a short spike of the opposite level
+      int i = 1 + rand() % (m - 2);
+      state_t s = out[i];
+
+      if (s.length > glitch_len + 2) {
+         double before = (s.length - glitch_len) * rand() / RAND_MAX;
+
+         memmove(&out[i + 3], &out[i + 1], (m - i - 1) * sizeof(*out));
+         out[i].length = before;
+         out[i + 1].high = !s.high;
+         out[i + 1].length = glitch_len;
+         out[i + 2].high = s.high;
+         out[i + 2].length = s.length - glitch_len - before;
+         m += 2;
+      }
+   }
+   return m;
+}
+
+static void run(double jit, double drf, result_t *r)
+{
+   cnw_decoder_t dec;
+   state_t states[MAX_STATES + 8];
+
+   memset(r, 0, sizeof(*r));
+   cnw_decoder_reset(&dec);
+   srand(seed);
+   for (int p = 0; p < packets; p++) {
+      uint8_t data[CNW_PKT_LEN];
+      int got = 0;
+
+      for (int i = 0; i < CNW_PKT_LEN; i++)
+         data[i] = rand();
+      int n = make_waveform(data, jit, drf, states);
+
+      uint32_t length[MAX_STATES + 8];
+      int ev[MAX_STATES + 8];
+
+      for (int i = 0; i < n; i++)
+         length[i] = lround(states[i].length);
+      // The last state is still going, the receiver has not seen it end
+      n--;
+      double start = now_ns();
+
+      for (int i = 0; i < n; i++)
+         ev[i] = cnw_decode(&dec, states[i].high, length[i]);
+      r->decode_ns += now_ns() - start;
+      r->edges += n;
+
+      r->sent++;
+      for (int i = 0; i < n; i++) {
+         if (ev[i] & CNW_EV_PARTIAL)
+            r->partial++;
+         if (ev[i] & CNW_EV_MARGINAL)
+            r->marginal++;
+         if (ev[i] & CNW_EV_TRAILER)
+            r->trailers++;
+         if (ev[i] & CNW_EV_PACKET) {
+            got = 1;
+            r->quality += cnw_quality(&dec);
+            if (memcmp(dec.data, data, CNW_PKT_LEN))
+               r->corrupt++;
+            else
+               r->ok++;
+         }
+      }
+      if (!got)
+         r->lost++;
+   }
+}
+
+static double error_rate(const result_t *r)
+{
+   return r->sent ? 100.0 * (r->sent - r->ok) / r->sent : 0;
+}
+
+static void usage(const char *progname)
+{
+   printf("Usage: %s [options]\n"
+          "Options:\n"
+          " -h or --help                - this help\n"
+          " -n or --packets <n>         - number of packets (default %d)\n"
+          " -j or --jitter <us>         - edge jitter, standard deviation in microseconds (default %.0f)\n"
+          " -g or --glitch <p>          - probability of a glitch in a packet, 0 to 1 (default %.2f)\n"
+          " -G or --glitch-len <us>     - glitch length (default %d)\n"
+          " -d or --drift <percent>     - sender clock error, positive is slow (default %.1f)\n"
+          " -s or --seed <n>            - random seed (default %u)\n"
+          " -w or --sweep               - print error rate against jitter and drift\n",
+          progname, packets, jitter, glitch, glitch_len, drift, seed);
+}
+
+static const char *get_string_arg(int argc, const char **argv)
+{
+   if (argc < 2) {
+      fprintf(stderr, "%s option requires a value\n", argv[0]);
+      exit(255);
+   }
+   return argv[1];
+}
+
+int main(int argc, const char *argv[])
+{
+   const char *progname = *argv++;
+
+   for (argc--; argc; argc--, argv++) {
+      const char *opt = argv[0];
+
+      if (!strcmp(opt, "-h") || !strcmp(opt, "--help")) {
+         usage(progname);
+         return 255;
+      } else if (!strcmp(opt, "-n") || !strcmp(opt, "--packets")) {
+         packets = atoi(get_string_arg(argc--, argv++));
+      } else if (!strcmp(opt, "-j") || !strcmp(opt, "--jitter")) {
+         jitter = atof(get_string_arg(argc--, argv++));
+      } else if (!strcmp(opt, "-g") || !strcmp(opt, "--glitch")) {
+         glitch = atof(get_string_arg(argc--, argv++));
+      } else if (!strcmp(opt, "-G") || !strcmp(opt, "--glitch-len")) {
+         glitch_len = atoi(get_string_arg(argc--, argv++));
+      } else if (!strcmp(opt, "-d") || !strcmp(opt, "--drift")) {
+         drift = atof(get_string_arg(argc--, argv++));
+      } else if (!strcmp(opt, "-s") || !strcmp(opt, "--seed")) {
+         seed = atoi(get_string_arg(argc--, argv++));
+      } else if (!strcmp(opt, "-w") || !strcmp(opt, "--sweep")) {
+         sweep = 1;
+      } else {
+         fprintf(stderr, "%s: unknown option\n", opt);
+         return 255;
+      }
+   }
+
+   printf("Threshold %dus, bit 0 %dus, bit 1 %dus, space %dus, sync %dus\n", CNW_THRESHOLD, CNW_BIT_0_LENGTH,
+          CNW_BIT_1_LENGTH, CNW_SPACE_LENGTH, CNW_SYNC_LENGTH);
+
+   if (sweep) {
+      static const double drifts[] = { -10, -5, -2, 0, 2, 5, 10 };
+
+      printf("Packet error rate (%%), %d packets each, glitch %.2f\n", packets, glitch);
+      printf("jitter\\drift");
+      for (int d = 0; d < sizeof(drifts) / sizeof(*drifts); d++)
+         printf(" %+6.0f%%", drifts[d]);
+      printf("\n");
+      for (int j = 0; j <= CNW_THRESHOLD; j += CNW_THRESHOLD / 8) {
+         printf("%10dus ", j);
+         for (int d = 0; d < sizeof(drifts) / sizeof(*drifts); d++) {
+            result_t r;
+
+            run(j, drifts[d], &r);
+            printf(" %7.2f", error_rate(&r));
+         }
+         printf("\n");
+      }
+      return 0;
+   }
+
+   result_t r;
+
+   run(jitter, drift, &r);
+   printf("Jitter %.0fus, drift %.1f%%, glitch %.2f of %dus\n", jitter, drift, glitch, glitch_len);
+   printf("Packets: sent=%u ok=%u corrupt=%u lost=%u partial=%u trailers=%u\n", r.sent, r.ok, r.corrupt, r.lost,
+          r.partial, r.trailers);
+   printf("Packet error rate %.3f%%\n", error_rate(&r));
+   printf("Marginal bits %.3f%%, average quality %.1f%%\n", r.sent ? 100.0 * r.marginal / r.sent / CNW_PKT_BITS : 0,
+          r.ok + r.corrupt ? (double)r.quality / (r.ok + r.corrupt) : 0);
+   printf("Decoder %.0fns per edge\n", r.edges ? r.decode_ns / r.edges : 0);
+   return 0;
+}
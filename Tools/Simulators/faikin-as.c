@@ -0,0 +1,418 @@
+/* Daikin Altherma simulator for protocol S testing */
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "osal.h"
+
+#define AS_REQ      0x02 // Request: 0x02, register, checksum
+#define AS_NAK      0x15
+#define AS_DATA_LEN 16   // Reply: register, 16 bytes of data, checksum
+#define AS_REGS     "PSTU"
+
+static const char *port     = NULL; // Serial port to use
+static const char *settings = NULL; // Settings file to load
+static int debug            = 0;    // Dump requests and replies (short form)
+static int dump             = 0;    // Raw dump
+
+// Register decoders, the same as Faikin's, see ESP/main/Faikin.c
+enum {
+   AS_DEC_TEMP,
+   AS_DEC_BYTE,
+   AS_DEC_WORD,
+   AS_DEC_BIT,
+};
+
+// Faikin's own register map, so that named state options are where Faikin looks for them
+static const struct {
+   char reg[2];
+   const char *name;
+   int decoder;
+   int offset;
+   int arg;
+} as_fields[] = {
+#define f(reg, name, decoder, offset, arg) {#reg, #name, AS_DEC_##decoder, offset, arg},
+#include "main/asregisters.m"
+};
+
+#define AS_FIELDS (sizeof(as_fields) / sizeof(*as_fields))
+
+// State of a simulated unit: raw data of each register, and how it behaves
+static struct {
+   unsigned char data[sizeof(AS_REGS) - 1][AS_DATA_LEN];
+   int nak[sizeof(AS_REGS) - 1]; // Register not supported
+   int vary;                     // Change temperatures every this many replies, 0 for never
+} state;
+
+static int reg_index(char reg)
+{
+   const char *p = strchr(AS_REGS, reg);
+
+   return reg && p ? p - AS_REGS : -1;
+}
+
+static void set_field(int n, double v)
+{
+   unsigned char *d = state.data[reg_index(as_fields[n].reg[0])] + as_fields[n].offset;
+   int arg = as_fields[n].arg ? as_fields[n].arg : 1;
+   int raw;
+
+   switch (as_fields[n].decoder) {
+   case AS_DEC_TEMP:
+      raw = (int)(v * 10 + (v < 0 ? -0.5 : 0.5));
+      d[0] = raw;
+      d[1] = raw >> 8;
+      break;
+   case AS_DEC_BYTE:
+      d[0] = (int)v / arg;
+      break;
+   case AS_DEC_WORD:
+      raw = (int)v / arg;
+      d[0] = raw;
+      d[1] = raw >> 8;
+      break;
+   case AS_DEC_BIT:
+      if (v)
+         d[0] |= arg;
+      else
+         d[0] &= ~arg;
+      break;
+   }
+}
+
+static unsigned char checksum(const unsigned char *buf, int len)
+{
+   unsigned char cs = 0;
+
+   for (int i = 0; i < len; i++)
+      cs += buf[i];
+   return ~cs;
+}
+
+// A whole reply in hex, as in the "dump" field of Faikin's rx messages: register, data, checksum
+static int set_reply(const char *hex)
+{
+   unsigned char reply[AS_DATA_LEN + 2];
+   int len = 0;
+
+   while (len < sizeof(reply) && isxdigit((unsigned char)hex[0]) && isxdigit((unsigned char)hex[1])) {
+      sscanf(hex, "%2hhx", &reply[len++]);
+      hex += 2;
+   }
+   if (*hex || len != sizeof(reply)) {
+      fprintf(stderr, "reply: expecting %d bytes in hex\n", (int)sizeof(reply));
+      return -1;
+   }
+   int r = reg_index(reply[0]);
+
+   if (r < 0) {
+      fprintf(stderr, "reply: unknown register 0x%02X\n", reply[0]);
+      return -1;
+   }
+   if (checksum(reply, AS_DATA_LEN + 1) != reply[AS_DATA_LEN + 1]) {
+      fprintf(stderr, "reply: bad checksum 0x%02X, expected 0x%02X\n", reply[AS_DATA_LEN + 1],
+              checksum(reply, AS_DATA_LEN + 1));
+      return -1;
+   }
+   memcpy(state.data[r], reply + 1, AS_DATA_LEN);
+   return 0;
+}
+
+static void usage(const char *progname)
+{
+   printf("Usage: %s <simulator options> <state options>\n"
+          "Available simulator options:\n"
+          " -p or --port <name> - serial port to use (mandatory option)\n"
+          " -s or --settings <filename> - Load initial state data from the file\n"
+          " -v or --debug - Enable dumping all requests\n"
+          " -V or --verbose - Enable dumping all protocol data\n",
+          progname);
+   printf("Supported state options:\n");
+   for (int n = 0; n < AS_FIELDS; n++)
+      printf(" %s <%s> - register %c, offset %d\n", as_fields[n].name,
+             as_fields[n].decoder == AS_DEC_BIT ? "bool" : as_fields[n].decoder == AS_DEC_TEMP ? "float" : "int",
+             as_fields[n].reg[0], as_fields[n].offset);
+   printf(" nak <register> - Register is not supported, reply with NAK\n"
+          " vary <int> - Change temperatures by 0.1C every given number of replies, 0 = never\n");
+   for (const char *r = AS_REGS; *r; r++)
+      printf(" %c <b0> <b1> ... - Raw data (%d bytes) of register %c\n", *r, AS_DATA_LEN, *r);
+   printf(" reply <hex> - Whole reply as in Faikin's dump, register, data and checksum\n");
+   printf("State options, given on command line, override options, specified in the settings file\n");
+}
+
+static const char *get_string_arg(int argc, const char **argv)
+{
+   if (argc < 2) {
+      fprintf(stderr, "%s option requires a value\n", argv[0]);
+      exit(255);
+   }
+   return argv[1];
+}
+
+static unsigned int parse_program_option(const char *progname, int argc, const char **argv)
+{
+   const char *opt;
+
+   if (argc < 1)
+      return 0;
+
+   opt = argv[0];
+
+   if (!strcmp(opt, "-h") || !strcmp(opt, "--help")) {
+      usage(progname);
+      exit(255);
+   } else if (!strcmp(opt, "-p") || !strcmp(opt, "--port")) {
+      port = get_string_arg(argc, argv);
+      return 2;
+   } else if (!strcmp(opt, "-s") || !strcmp(opt, "--settings")) {
+      settings = get_string_arg(argc, argv);
+      return 2;
+   } else if (!strcmp(opt, "-v") || !strcmp(opt, "--debug")) {
+      debug = 1;
+      return 1;
+   } else if (!strcmp(opt, "-V") || !strcmp(opt, "--verbose")) {
+      dump = 1;
+      return 1;
+   } else if (opt[0] == '-') {
+      fprintf(stderr, "%s: unknown option\n", opt);
+      exit(255);
+   }
+   return 0;
+}
+
+// Parse one state option, returns number of arguments used, -1 on error
+static int parse_item(int argc, const char **argv)
+{
+   const char *opt = argv[0];
+   char *endp = NULL;
+   int r = reg_index(opt[1] ? 0 : opt[0]);
+
+   if (r >= 0) {
+      if (argc < AS_DATA_LEN + 1) {
+         fprintf(stderr, "%s: %u data bytes are required; only %u given\n", opt, AS_DATA_LEN, argc - 1);
+         return -1;
+      }
+      for (int i = 0; i < AS_DATA_LEN; i++) {
+         state.data[r][i] = strtoul(argv[i + 1], &endp, 0);
+         if (endp && *endp) {
+            fprintf(stderr, "%s: Invalid integer value: %s\n", opt, argv[i + 1]);
+            return -1;
+         }
+      }
+      return AS_DATA_LEN + 1;
+   }
+
+   if (argc < 2) {
+      fprintf(stderr, "%s: value is required\n", opt);
+      return -1;
+   }
+
+   if (!strcmp(opt, "nak")) {
+      r = reg_index(argv[1][1] ? 0 : argv[1][0]);
+      if (r < 0) {
+         fprintf(stderr, "%s: Unknown register %s\n", opt, argv[1]);
+         return -1;
+      }
+      state.nak[r] = 1;
+      return 2;
+   }
+   if (!strcmp(opt, "reply"))
+      return set_reply(argv[1]) < 0 ? -1 : 2;
+   if (!strcmp(opt, "vary")) {
+      state.vary = strtoul(argv[1], &endp, 0);
+   } else {
+      int n;
+
+      for (n = 0; n < AS_FIELDS && strcmp(opt, as_fields[n].name); n++)
+         ;
+      if (n == AS_FIELDS) {
+         fprintf(stderr, "Unknown option %s\n", opt);
+         return -1;
+      }
+      if (!strcasecmp(argv[1], "on") || !strcasecmp(argv[1], "true"))
+         set_field(n, 1);
+      else if (!strcasecmp(argv[1], "off") || !strcasecmp(argv[1], "false"))
+         set_field(n, 0);
+      else
+         set_field(n, strtod(argv[1], &endp));
+   }
+   if (endp && *endp) {
+      fprintf(stderr, "%s: Invalid value: %s\n", opt, argv[1]);
+      return -1;
+   }
+   return 2;
+}
+
+static void load_settings(const char *filename)
+{
+   char line[1024];
+   FILE *f = fopen(filename, "r");
+
+   if (!f) {
+      perror("Failed to open settings file");
+      exit(255);
+   }
+
+   while (fgets(line, sizeof(line), f)) {
+      // Longest line is raw register data
+      const size_t max_command_line_length = AS_DATA_LEN + 1;
+      char *p = line;
+      const char *argv[max_command_line_length];
+      int argc = 0;
+
+      for (int i = 0; i < max_command_line_length; i++) {
+         while (isspace(*p))
+            p++;
+         if (!*p || *p == '#')
+            break;
+         argv[argc++] = p;
+         while (*p && !isspace(*p))
+            p++;
+         if (!*p)
+            break;
+         *p++ = 0;
+      }
+
+      if (argc && parse_item(argc, argv) < 0) {
+         fprintf(stderr, "Malformed data in settings file\n");
+         fclose(f);
+         exit(255);
+      }
+   }
+
+   fclose(f);
+}
+
+static void hexdump(const char *header, const unsigned char *buf, unsigned int len)
+{
+   if (dump) {
+      printf("%s:", header);
+      for (int i = 0; i < len; i++)
+         printf(" %02X", buf[i]);
+      printf("\n");
+   }
+}
+
+static void vary_temps(int step)
+{
+   // Walk every temperature up and down by 0.1C, so that Faikin sees the values change
+   for (int n = 0; n < AS_FIELDS; n++) {
+      if (as_fields[n].decoder == AS_DEC_TEMP) {
+         unsigned char *d = state.data[reg_index(as_fields[n].reg[0])] + as_fields[n].offset;
+         int16_t raw = d[0] + (d[1] << 8);
+
+         raw += (step & 1) ? -1 : 1;
+         d[0] = raw;
+         d[1] = raw >> 8;
+      }
+   }
+}
+
+int main(int argc, const char *argv[])
+{
+   int nargs;
+   const char *progname = *argv++;
+
+   argc--;
+
+   do {
+      nargs = parse_program_option(progname, argc, argv);
+      argc -= nargs;
+      argv += nargs;
+   } while (nargs);
+
+   if (!port) {
+      fprintf(stderr, "Serial port is not given; use -p or --port option\n");
+      return 255;
+   }
+
+   // Load settings file first
+   if (settings)
+      load_settings(settings);
+
+   // Whatever specified on the command line, overrides settings file
+   while (argc) {
+      nargs = parse_item(argc, argv);
+      if (nargs < 0) {
+         fprintf(stderr, "Invalid state option given on command line\n");
+         return 255;
+      }
+      argc -= nargs;
+      argv += nargs;
+   }
+
+   int p = open(port, O_RDWR);
+
+   if (p < 0) {
+      fprintf(stderr, "Cannot open %s: %s", port, strerror(errno));
+      exit(255);
+   }
+
+   if (set_serial(p, 9600, CS8, EVENPARITY, ONESTOPBIT)) {
+      fputs("Failed to set up serial port\n", stderr);
+      exit(255);
+   }
+
+   unsigned char buf[3];
+   unsigned int replies = 0;
+   int len = 0;
+
+   while (1) {
+      int l = read(p, buf + len, sizeof(buf) - len);
+
+      if (l < 0) {
+         perror("Error reading from serial port");
+         exit(255);
+      }
+      len += l;
+      if (len && buf[0] != AS_REQ) {
+         printf("Garbage byte received: 0x%02X\n", buf[0]);
+         memmove(buf, buf + 1, --len);
+         continue;
+      }
+      if (len < sizeof(buf))
+         continue;
+      len = 0;
+      hexdump("Rx", buf, sizeof(buf));
+
+      if (checksum(buf, 2) != buf[2]) {
+         printf("Bad checksum 0x%02X, expected 0x%02X\n", buf[2], checksum(buf, 2));
+         continue;
+      }
+
+      unsigned char response[AS_DATA_LEN + 2] = {0};
+      int r = reg_index(buf[1]);
+
+      if (r < 0 || state.nak[r]) {
+         if (debug)
+            printf("%c -> NAK\n", buf[1]);
+         response[0] = AS_NAK;
+      } else {
+         if (state.vary && !(++replies % state.vary))
+            vary_temps(replies / state.vary);
+         response[0] = buf[1];
+         memcpy(response + 1, state.data[r], AS_DATA_LEN);
+         if (debug) {
+            printf("%c ->", buf[1]);
+            for (int i = 0; i < AS_DATA_LEN; i++)
+               printf(" %02X", state.data[r][i]);
+            printf("\n");
+         }
+      }
+      response[AS_DATA_LEN + 1] = checksum(response, AS_DATA_LEN + 1);
+      hexdump("Tx", response, sizeof(response));
+
+      if (write(p, response, sizeof(response)) != sizeof(response)) {
+         perror("Serial write failed");
+         exit(255);
+      }
+   }
+
+   return 0;
+}
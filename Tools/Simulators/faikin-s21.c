@@ -493,7 +493,7 @@ main(int argc, const char *argv[])
 	     case '1':
 		    state->power = buf[S21_PAYLOAD_OFFSET + 0] - '0'; // ASCII char
 			state->mode  = buf[S21_PAYLOAD_OFFSET + 1] - '0'; // See AC_MODE_*
-			state->temp  = s21_decode_target_temp(buf[S21_PAYLOAD_OFFSET + 2]);
+			state->temp  = s21_decode_target_temp(buf[S21_PAYLOAD_OFFSET + 2]) / 100.0;
 			state->fan   = s21_decode_fan(buf[S21_PAYLOAD_OFFSET + 3]);
 
 			printf(" Set power %d mode %d temp %.1f fan %d\n", state->power, state->mode, state->temp, state->fan);
@@ -787,7 +787,7 @@ main(int argc, const char *argv[])
 		    response[3] = state->power + '0'; // sent as ASCII
 			response[4] = state->mode + '0';
 			// 18.0 + 0.5 * (signed) (payload[2] - '@')
-			response[5] = s21_encode_target_temp(state->temp);
+			response[5] = s21_encode_target_temp(lroundf(state->temp * 100));
 			response[6] = s21_encode_fan(state->fan);
 
 			s21_reply(p, response, buf, S21_PAYLOAD_LEN);
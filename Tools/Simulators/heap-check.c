@@ -0,0 +1,420 @@
+/* Heap fragmentation check. Runs millions of Faikin main loop cycles against a model of the small
+   ESP8266 heap (first fit, 8 byte blocks, coalescing on free), once building the status, report and comms
+   messages on the heap as before, growing as fields are added, and once with the real ja_* writer of
+   ESP/main/json_arena.c, whose heap use goes to the model heap. The rest of the system (MQTT, web, HA state
+   built by the library) keeps allocating in both. Prints how fragmented the heap gets, and checks that the
+   arena never touches the heap */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "main/json_arena.h"
+
+#define HEAP_SIZE  (40 * 1024)    // Typical free heap once WiFi and MQTT are up
+#define UNIT       8              // Block size, and size of a block header
+#define UNITS      (HEAP_SIZE / UNIT)
+#define JO_STEP    100            // Heap JSON grows by this much at a time
+#define LIVE_MAX   64             // Long lived allocations by the rest of the system
+
+static long cycles = 1000000;
+static int report_every = 600;    // Cycles per environment report
+static unsigned seed = 1;
+static int verbose = 0;
+
+// Model heap. Each block starts with a header unit, size in units including the header, and a free flag
+static struct {
+   uint16_t size;
+   uint8_t free;
+} heap[UNITS];
+
+static struct {
+   long allocs, fails, moves;
+   long arena_allocs;             // By json_arena.c
+   long arena_cycles;             // Cycles in which json_arena.c allocated
+   int min_largest;               // Smallest largest free block seen after a cycle
+   int min_free;
+   int frag;                      // Worst fragmentation, percent of free space not in the largest block
+} result;
+
+static int units;                 // In use by the heap, the rest is static buffers
+
+static void heap_init(int reserved)
+{
+   memset(heap, 0, sizeof(heap));
+   units = UNITS - (reserved + UNIT - 1) / UNIT;
+   heap[0].size = units;
+   heap[0].free = 1;
+}
+
+static int heap_alloc(int bytes)
+{
+   int need = 1 + (bytes + UNIT - 1) / UNIT;
+
+   result.allocs++;
+   for (int b = 0; b < units; b += heap[b].size)
+      if (heap[b].free && heap[b].size >= need) {
+         if (heap[b].size > need) {
+            heap[b + need].size = heap[b].size - need;
+            heap[b + need].free = 1;
+            heap[b].size = need;
+         }
+         heap[b].free = 0;
+         return b;
+      }
+   result.fails++;
+   return -1;
+}
+
+static void heap_free(int b)
+{
+   int prev = -1;
+
+   if (b < 0)
+      return;
+   heap[b].free = 1;
+   for (int p = 0; p < b; p += heap[p].size)
+      prev = p;
+   int next = b + heap[b].size;
+
+   if (next < units && heap[next].free)
+      heap[b].size += heap[next].size;
+   if (prev >= 0 && heap[prev].free)
+      heap[prev].size += heap[b].size;
+}
+
+static int heap_realloc(int b, int bytes)
+{
+   if (b < 0)
+      return heap_alloc(bytes);
+   int need = 1 + (bytes + UNIT - 1) / UNIT;
+   int next = b + heap[b].size;
+
+   if (next < units && heap[next].free && heap[b].size + heap[next].size >= need) {
+      // Grow in place
+      int spare = heap[b].size + heap[next].size - need;
+
+      heap[b].size = need;
+      if (spare) {
+         heap[b + need].size = spare;
+         heap[b + need].free = 1;
+      }
+      return b;
+   }
+   int n = heap_alloc(bytes);
+
+   if (n >= 0)
+      result.moves++;
+   heap_free(b);
+   return n;
+}
+
+static void heap_measure(void)
+{
+   int free = 0, largest = 0;
+
+   for (int b = 0; b < units; b += heap[b].size)
+      if (heap[b].free) {
+         free += heap[b].size;
+         if (heap[b].size > largest)
+            largest = heap[b].size;
+      }
+   if (free && 100 - 100 * largest / free > result.frag)
+      result.frag = 100 - 100 * largest / free;
+   if (largest * UNIT < result.min_largest)
+      result.min_largest = largest * UNIT;
+   if (free * UNIT < result.min_free)
+      result.min_free = free * UNIT;
+}
+
+static int between(int lo, int hi)
+{
+   return lo + rand() % (hi - lo + 1);
+}
+
+// A JSON message built on the heap, grown as fields are added, like jo_object_alloc()
+static int heap_json(int len)
+{
+   int b = -1;
+
+   for (int have = 0; have < len; have += JO_STEP)
+      b = heap_realloc(b, have + JO_STEP);
+   return b;
+}
+
+// json_arena.c heap, on the model heap. The real memory is needed too, as the writer fills it in
+typedef union {
+   int b;
+   long double align;
+} model_hdr_t;
+
+static void *model_malloc(size_t bytes)
+{
+   int b = heap_alloc(bytes);
+
+   result.arena_allocs++;
+   if (b < 0)
+      return NULL;
+   model_hdr_t *h = malloc(sizeof(*h) + bytes);
+
+   h->b = b;
+   return h + 1;
+}
+
+static void model_free(void *p)
+{
+   model_hdr_t *h = (model_hdr_t *) p - 1;
+
+   heap_free(h->b);
+   free(h);
+}
+
+// Status fields, about len long, as ja_status()
+static void add_status(ja_t *j, void *ctx)
+{
+   int len = *(int *)ctx;
+
+   ja_string(j, "protocol", "S21");
+   for (int n = 0; j->len < len && !j->overflow; n++) {
+      char tag[8];
+
+      sprintf(tag, "s%d", n);
+      switch (n % 4) {
+      case 0:
+         ja_bool(j, tag, n & 1);
+         break;
+      case 1:
+         ja_litf(j, tag, "%d.%d", n % 30, n % 10);
+         break;
+      case 2:
+         ja_int(j, tag, n * 7);
+         break;
+      default:
+         ja_stringf(j, tag, "%c", 'A' + n % 26);
+      }
+   }
+}
+
+// Report fields, about len long, as ja_report(), mostly [min,avg,max]
+static void add_report(ja_t *j, void *ctx)
+{
+   int len = *(int *)ctx;
+
+   ja_string(j, "protocol", "S21");
+   ja_stringf(j, "ts", "%04d-%02d-%02dT%02d:%02d:%02dZ", 2024, 1, 2, 3, 4, 5);
+   for (int n = 0; j->len < len && !j->overflow; n++) {
+      char tag[8];
+
+      sprintf(tag, "r%d", n);
+      ja_array(j, tag);
+      for (int v = 0; v < 3; v++)
+         ja_litf(j, NULL, "%d.%02d", 15 + n % 10 + v, n * 7 % 100);
+      ja_close(j);
+   }
+}
+
+// A message built with the ja_* writer, as the main loop does, returns its length as sent
+static int arena_json(int slot, int len)
+{
+   ja_t *j;
+   uint8_t dump[120];
+
+   if (slot == JSON_ARENA_COMMS) {
+      // Comms dump, as ja_comms(), at most an X50A frame
+      j = ja_start(slot);
+      ja_string(j, "protocol", "S21");
+      memset(dump, 0x5A, sizeof(dump));
+      ja_base16(j, "dump", dump, len < (int)sizeof(dump) ? len : (int)sizeof(dump));
+   } else
+      j = ja_build(slot, slot == JSON_ARENA_STATUS ? add_status : add_report, &len);
+   const char *m = ja_finish(j);
+   int n = (m ? strlen(m) : 0);
+
+   ja_done(j);
+   return n;
+}
+
+// Sending copies the message in to the MQTT client, freed once it has gone
+static void send(int len, int *out)
+{
+   *out = heap_alloc(len + 40);
+}
+
+static void run(int arena)
+{
+   struct {
+      int b;
+      long until;
+   } live[LIVE_MAX];
+   int outbox[4];
+
+   memset(&result, 0, sizeof(result));
+   result.min_largest = result.min_free = HEAP_SIZE;
+   int reserved = 0;
+
+   if (arena)                     // The buffers come out of the same RAM
+      for (int slot = 0; slot < JSON_ARENA_SLOTS; slot++)
+         reserved += json_arena_stats(slot)->size;
+   heap_init(reserved);
+   json_arena_malloc = model_malloc;
+   json_arena_free = model_free;
+   srand(seed);
+   for (int n = 0; n < LIVE_MAX; n++)
+      live[n].b = -1, live[n].until = 0;
+   for (long c = 0; c < cycles; c++) {
+      int sent = 0;
+      long allocs = result.arena_allocs;
+
+      // Rest of the system, allocations that stay around for a while
+      for (int n = 0; n < LIVE_MAX; n++)
+         if (live[n].b >= 0 && c >= live[n].until) {
+            heap_free(live[n].b);
+            live[n].b = -1;
+         }
+      // Status, when something has changed
+      if (rand() % 3 == 0) {
+         int len = between(500, 900);
+         int jo = -1,
+             j = -1;
+
+         if (arena)
+            len = arena_json(JSON_ARENA_STATUS, len);
+         else {
+            jo = heap_alloc(40);           // jo_t itself
+            j = heap_json(len);
+         }
+         send(len, &outbox[sent++]);
+         // Other tasks run while the message is held, and allocate around it
+         if (rand() % 4 == 0) {
+            int n = rand() % LIVE_MAX;
+
+            if (live[n].b < 0) {
+               live[n].b = heap_alloc(between(16, 320));
+               live[n].until = c + between(1, 20000);
+            }
+         }
+         heap_free(j);
+         heap_free(jo);
+         // HA state, built by the library on the heap in both cases
+         int ha = heap_json(between(300, 500));
+
+         send(400, &outbox[sent++]);
+         heap_free(ha);
+      }
+      // Environment report
+      if (c % report_every == report_every - 1) {
+         int len = between(800, 1400);
+         int jo = -1,
+             j = -1;
+
+         if (arena)
+            len = arena_json(JSON_ARENA_REPORT, len);
+         else {
+            jo = heap_alloc(40);
+            j = heap_json(len);
+         }
+         send(len, &outbox[sent++]);
+         heap_free(j);
+         heap_free(jo);
+      }
+      // Comms dumps and errors, sent one at a time
+      for (int d = (rand() % 8 ? 0 : between(1, 4)); d; d--) {
+         int len = between(4, 100),
+             jo = -1,
+             j = -1;
+         int out;
+
+         if (arena)
+            len = arena_json(JSON_ARENA_COMMS, len);
+         else {
+            jo = heap_alloc(40);
+            j = heap_json(40 + len * 2);
+         }
+         send(len, &out);
+         heap_free(j);
+         heap_free(jo);
+         heap_free(out);
+      }
+      while (sent)
+         heap_free(outbox[--sent]);
+      if (result.arena_allocs != allocs)
+         result.arena_cycles++;
+      heap_measure();
+      if (verbose && c % (cycles / 10) == 0)
+         printf("  cycle %ld, smallest largest free block so far %d\n", c, result.min_largest);
+   }
+}
+
+static void usage(const char *progname)
+{
+   printf("Usage: %s [options]\n"
+          "Options:\n"
+          " -h or --help                - this help\n"
+          " -c or --cycles <n>          - main loop cycles (default %ld)\n"
+          " -r or --report <n>          - cycles per environment report (default %d)\n"
+          " -s or --seed <n>            - random seed (default %u)\n"
+          " -v or --verbose             - progress\n",
+          progname, cycles, report_every, seed);
+}
+
+static const char *get_string_arg(int argc, const char **argv)
+{
+   if (argc < 2) {
+      fprintf(stderr, "%s option requires a value\n", argv[0]);
+      exit(255);
+   }
+   return argv[1];
+}
+
+int main(int argc, const char *argv[])
+{
+   const char *progname = *argv++;
+
+   for (argc--; argc; argc--, argv++) {
+      const char *opt = argv[0];
+
+      if (!strcmp(opt, "-h") || !strcmp(opt, "--help")) {
+         usage(progname);
+         return 255;
+      } else if (!strcmp(opt, "-c") || !strcmp(opt, "--cycles")) {
+         cycles = atol(get_string_arg(argc--, argv++));
+      } else if (!strcmp(opt, "-r") || !strcmp(opt, "--report")) {
+         report_every = atoi(get_string_arg(argc--, argv++));
+      } else if (!strcmp(opt, "-s") || !strcmp(opt, "--seed")) {
+         seed = atoi(get_string_arg(argc--, argv++));
+      } else if (!strcmp(opt, "-v") || !strcmp(opt, "--verbose")) {
+         verbose = 1;
+      } else {
+         fprintf(stderr, "%s: unknown option\n", opt);
+         return 255;
+      }
+   }
+   if (cycles < 10 || report_every < 1) {
+      fprintf(stderr, "At least 10 cycles, and a report every cycle or more\n");
+      return 255;
+   }
+
+   const char *names[] = { "heap", "arena" };
+   long fails[2];
+
+   printf("%ld cycles, %d byte heap\n", cycles, HEAP_SIZE);
+   printf("%-6s %10s %8s %8s %10s %10s %6s\n", "JSON", "allocs", "moves", "failed", "min-free", "min-block", "frag%");
+   for (int arena = 0; arena < 2; arena++) {
+      run(arena);
+      printf("%-6s %10ld %8ld %8ld %10d %10d %6d\n", names[arena], result.allocs, result.moves, result.fails, result.min_free,
+             result.min_largest, result.frag);
+      fails[arena] = result.fails;
+   }
+   for (int slot = 0; slot < JSON_ARENA_SLOTS; slot++) {
+      const json_arena_stats_t *s = json_arena_stats(slot);
+
+      printf("Arena slot %d: size %u, longest %u, used %u times, %u overflows, %u on the heap\n", slot, s->size, s->high,
+             s->uses, s->overflows, s->heap);
+   }
+   printf("Arena heap allocations %ld, in %ld cycles\n", result.arena_allocs, result.arena_cycles);
+   // With the arena, nothing may run out, and building the messages must never touch the heap
+   int fail = (fails[1] || result.arena_allocs || result.arena_cycles);
+
+   printf("%s\n", fail ? "FAILED" : "OK");
+   return fail ? 1 : 0;
+}
@@ -0,0 +1,328 @@
+/* History ring check. Feeds a simulated air conditioner day to Faikin's per-minute history
+   (ESP/main/ac_history.c), checks every sample still held reads back exactly, both from the ring and
+   from the /history binary form, also when they are read a piece at a time while samples are added,
+   and prints how many hours HISTORY_SIZE holds */
+
+#define _GNU_SOURCE
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "main/ac_history.h"
+
+static int days      = 3;   // Days to simulate
+static int gap_every = 0;   // Skip a few minutes every this many minutes, 0 for never
+static unsigned seed = 1;
+static int verbose   = 0;   // Print samples read back
+
+static ac_history_t h;
+static int32_t (*sent)[HISTORY_VALUES]; // Every sample, by minute
+static char *have;                       // ... was added
+static int minutes, fed;                 // Minutes to simulate, and how many done
+
+static double noise(double amp)
+{
+   return amp * (2.0 * rand() / RAND_MAX - 1);
+}
+
+static int32_t tenths(double c, double step)
+{
+   // Sensors report in steps, e.g. 0.5C
+   return lround(round(c / step) * step * 10);
+}
+
+// A heat pump in winter, on in the morning and the evening
+static void simulate(int minute, int32_t *v)
+{
+   static double home = 18, liquid = 10, comp, fan;
+   static int32_t wh;
+   double hour = (minute % 1440) / 60.0;
+   double outside = 5 - 4 * cos((hour - 3) * M_PI / 12) + noise(0.3);
+   int power = (hour >= 6.5 && hour < 9) || (hour >= 17 && hour < 23);
+
+   for (int n = 0; n < HISTORY_VALUES; n++)
+      v[n] = CTEMP_NONE;
+   if (power) {
+      home += (21 - home) * 0.02 + noise(0.02);
+      comp += (20 + (21 - home) * 15 - comp) * 0.2 + noise(2);
+      fan = comp > 30 ? 1100 : 800;
+      liquid += (30 + comp / 4 - liquid) * 0.3 + noise(0.5);
+      wh += 5 + comp / 4;
+   } else {
+      home += (outside - home) * 0.002;
+      comp = fan = 0;
+      liquid += (outside - liquid) * 0.1;
+   }
+   v[HISTORY_home] = tenths(home, 0.5);
+   v[HISTORY_inlet] = tenths(home + 1, 0.1);
+   v[HISTORY_outside] = tenths(outside, 0.5);
+   v[HISTORY_liquid] = tenths(liquid, 0.1);
+   v[HISTORY_temp] = 210;
+   v[HISTORY_comp] = lround(comp);
+   v[HISTORY_fanrpm] = lround(fan / 10) * 10;
+   v[HISTORY_Wh] = wh;
+   v[HISTORY_demand] = 100;
+   v[HISTORY_waterflow] = v[HISTORY_anglev] = 0;
+   v[HISTORY_mode] = 1;
+   v[HISTORY_fan] = 0;
+   v[HISTORY_BOOLS] = (1 << HISTORY_B_online) | (power << HISTORY_B_power) | (power << HISTORY_B_heat);
+}
+
+// Add the next minute, unless it is one of the gaps
+static void feed(void)
+{
+   int m = fed++;
+   int32_t v[HISTORY_VALUES];
+
+   simulate(m, v);
+   if (gap_every && m % gap_every < 3)
+      return;
+   memcpy(sent[m], v, sizeof(v));
+   have[m] = 1;
+   ac_history_add(&h, m, v);
+}
+
+static uint32_t get_varint(const uint8_t **p)
+{
+   uint32_t v = 0;
+   int shift = 0;
+
+   do
+      v |= (uint32_t)(**p & 0x7F) << shift, shift += 7;
+   while (*(*p)++ & 0x80);
+   return v;
+}
+
+static int32_t unzigzag(uint32_t v)
+{
+   return (int32_t)(v >> 1) ^ -(int32_t)(v & 1);
+}
+
+static int check(const char *what, uint32_t minute, const int32_t *v, int *fail)
+{
+   if (!have[minute] || memcmp(sent[minute], v, sizeof(sent[minute]))) {
+      if ((*fail)++ < 10)
+         printf("%s: minute %u differs\n", what, minute);
+      return 0;
+   }
+   return 1;
+}
+
+// Make the binary form in pieces, as /history sends it, adding a minute after each piece. -1 if overtaken
+static int export(uint8_t **buf, int piece, int feeds)
+{
+   ac_history_export_t e = { 0 };
+   int len = 0,
+       l;
+
+   *buf = NULL;
+   do {
+      *buf = realloc(*buf, len + piece);
+      l = ac_history_export(&h, &e, *buf + len, piece);
+      if (l > 0)
+         len += l;
+      for (int n = 0; n < feeds && l > 0 && fed < minutes + 1440; n++)
+         feed();
+   } while (l > 0);
+   return l < 0 ? -1 : len;
+}
+
+// Read back the binary form, as a web page or script would
+static int check_export(const char *what, int piece, int feeds, int *fail)
+{
+   uint8_t *buf;
+   int expected = h.records + 1;
+   int len = export(&buf, piece, feeds);
+
+   if (len < 0) {
+      printf("%s: overtaken\n", what);
+      (*fail)++;
+      free(buf);
+      return len;
+   }
+   if (memcmp(buf, "FKH1", 4)) {
+      printf("%s: bad magic\n", what);
+      (*fail)++;
+      free(buf);
+      return len;
+   }
+   const uint8_t *p = buf + 4 + strlen((char *)buf + 4) + 1;
+   int values = get_varint(&p);
+   int samples = get_varint(&p);
+
+   if (values != HISTORY_VALUES || samples != expected) {
+      printf("%s: %d values, %d samples, expected %d and %d\n", what, values, samples, HISTORY_VALUES, expected);
+      (*fail)++;
+      free(buf);
+      return len;
+   }
+   uint32_t minute = get_varint(&p);
+   uint32_t mask = get_varint(&p);
+   int32_t v[HISTORY_VALUES];
+
+   for (int n = 0; n < HISTORY_VALUES; n++)
+      v[n] = unzigzag(get_varint(&p));
+   check(what, minute, v, fail);
+   for (int s = 1; s < samples; s++) {
+      uint32_t head = get_varint(&p);
+
+      minute++;
+      if (head & 1)
+         minute += get_varint(&p);
+      if (head & 2)
+         mask = get_varint(&p);
+      for (int n = 0; n < HISTORY_VALUES; n++)
+         if (mask & (1UL << n))
+            v[n] += unzigzag(get_varint(&p));
+      check(what, minute, v, fail);
+   }
+   if (p != buf + len) {
+      printf("%s: %d bytes left over\n", what, (int)(buf + len - p));
+      (*fail)++;
+   }
+   free(buf);
+   return len;
+}
+
+// Walk the ring while adding a minute every few samples. It is overtaken at first, so misses a few
+static void check_walk(int *fail)
+{
+   ac_history_iter_t i;
+   int n = 0;
+   uint32_t last = 0;
+
+   if (!ac_history_first(&h, &i))
+      return;
+   for (int f = 0; f < 3; f++)
+      feed();                    // So the oldest samples go before we get to them
+   do {
+      if ((n && i.s.minute <= last) || !check("Walk", i.s.minute, i.s.v, fail)) {
+         if (n && i.s.minute <= last)
+            printf("Walk: minute %u after %u\n", i.s.minute, last);
+         (*fail)++;
+         return;
+      }
+      last = i.s.minute;
+      if (!(++n % 4) && fed < minutes + 1440)
+         feed();
+   } while (ac_history_next(&h, &i));
+   if (last != h.last.minute) {
+      printf("Walk: ended at minute %u, newest is %u\n", last, h.last.minute);
+      (*fail)++;
+   }
+}
+
+static void usage(const char *progname)
+{
+   printf("Usage: %s [options]\n"
+          "Options:\n"
+          " -h or --help                - this help\n"
+          " -d or --days <n>            - days to simulate (default %d)\n"
+          " -g or --gap <n>             - miss a few minutes every n minutes (default never)\n"
+          " -s or --seed <n>            - random seed (default %u)\n"
+          " -v or --verbose             - print samples read back\n",
+          progname, days, seed);
+}
+
+static const char *get_string_arg(int argc, const char **argv)
+{
+   if (argc < 2) {
+      fprintf(stderr, "%s option requires a value\n", argv[0]);
+      exit(255);
+   }
+   return argv[1];
+}
+
+int main(int argc, const char *argv[])
+{
+   const char *progname = *argv++;
+
+   for (argc--; argc; argc--, argv++) {
+      const char *opt = argv[0];
+
+      if (!strcmp(opt, "-h") || !strcmp(opt, "--help")) {
+         usage(progname);
+         return 255;
+      } else if (!strcmp(opt, "-d") || !strcmp(opt, "--days")) {
+         days = atoi(get_string_arg(argc--, argv++));
+      } else if (!strcmp(opt, "-g") || !strcmp(opt, "--gap")) {
+         gap_every = atoi(get_string_arg(argc--, argv++));
+      } else if (!strcmp(opt, "-s") || !strcmp(opt, "--seed")) {
+         seed = atoi(get_string_arg(argc--, argv++));
+      } else if (!strcmp(opt, "-v") || !strcmp(opt, "--verbose")) {
+         verbose = 1;
+      } else {
+         fprintf(stderr, "%s: unknown option\n", opt);
+         return 255;
+      }
+   }
+   if (days < 1) {
+      fprintf(stderr, "At least one day\n");
+      return 255;
+   }
+
+   minutes = days * 1440;
+   sent = calloc(minutes + 1440, sizeof(*sent));        // And a day more for adding while reading
+   have = calloc(minutes + 1440, 1);
+   srand(seed);
+   ac_history_reset(&h);
+   while (fed < minutes)
+      feed();
+
+   ac_history_iter_t i;
+   int fail = 0,
+       samples = 0;
+   uint32_t first = 0,
+            last = 0;
+
+   if (ac_history_first(&h, &i)) {
+      first = i.s.minute;
+      do {
+         if (verbose) {
+            printf("%02u:%02u", i.s.minute / 60 % 24, i.s.minute % 60);
+            for (int n = 0; n < HISTORY_VALUES; n++)
+               printf(" %d", i.s.v[n]);
+            printf("\n");
+         }
+         check("Ring", i.s.minute, i.s.v, &fail);
+         last = i.s.minute;
+         samples++;
+      } while (ac_history_next(&h, &i));
+   }
+   int expected = 0;
+
+   for (int m = first; m <= last; m++)
+      expected += have[m];
+   if (samples != expected) {
+      printf("Ring: %d samples between first and last, expected %d\n", samples, expected);
+      fail++;
+   }
+   int len = check_export("Export", 37, 0, &fail);
+
+   // Then as if read over a slow link, while the main loop goes on
+   printf("Values per sample %d, ring %d bytes, struct %zu bytes\n", HISTORY_VALUES, HISTORY_SIZE, sizeof(h));
+   printf("Holding %u samples, %.1f hours, %.2f bytes per sample, binary form %d bytes\n", h.records + 1,
+          (last - first + 1) / 60.0, (double)h.used / (h.records ? h.records : 1), len);
+   check_export("Export while adding", 512, 1, &fail);        // Pieces as /history sends them
+   check_walk(&fail);
+   uint8_t *buf;
+
+   if (export(&buf, 1, 1) >= 0) {
+      printf("Export a byte a minute: not overtaken\n");
+      fail++;
+   }
+   free(buf);
+   ac_history_reset(&h);
+   if (export(&buf, 512, 0) <= 0 || ac_history_first(&h, &i)) {
+      printf("Reset: not empty\n");
+      fail++;
+   }
+   free(buf);
+   if (last != minutes - 1 && !(gap_every && (minutes - 1) % gap_every < 3)) {
+      printf("Newest sample is missing\n");
+      fail++;
+   }
+   printf("%s\n", fail ? "FAILED" : "OK");
+   return fail ? 1 : 0;
+}
@@ -0,0 +1,222 @@
+/* Poll scheduler check. Runs Faikin's X50A and Altherma_S poll scheduler (ESP/main/poll_sched.c) against a
+   model unit, once a second as the main loop does, and checks that everything is polled first, that stable
+   values back off to their longest interval and changing ones stay at their shortest, that the budget is
+   kept without starving anything, that NAKs drop a command, and that the clock wrapping makes no difference */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "main/poll_sched.h"
+
+#define CYCLE_MS 1000             // Main loop
+
+// As as_polls in Faikin.c
+static const poll_sched_def_t polls[] = {
+   {'P', 1000, 5000},
+   {'T', 2000, 10000},
+   {'U', 2000, 10000},
+   {'S', 10000, 60000},
+};
+
+#define POLLS (sizeof(polls) / sizeof(*polls))
+#define NAKS  2                   // As AS_NAKS
+
+static int cycles = 3600;
+static unsigned seed = 1;
+static int verbose = 0;
+
+static poll_sched_state_t state[POLLS];
+static poll_sched_t sched = {.defs = polls,.state = state,.count = POLLS,.max_naks = NAKS };
+
+static int fail;
+
+static void failed(const char *fmt, const char *what, int n, long a, long b)
+{
+   if (fail++ < 10) {
+      printf("%s: %c ", what, polls[n].code);
+      printf(fmt, a, b);
+      printf("\n");
+   }
+}
+
+// The model unit. change is the percentage of replies that differ from the last, nak makes a command unsupported
+typedef struct {
+   int change[POLLS];
+   int nak[POLLS];
+   int dead;                      // Nothing replies
+} unit_t;
+
+enum { OK, NAK, TIMEOUT };
+
+static int reply(const unit_t *u, int n, uint16_t *hash)
+{
+   static uint16_t value[POLLS];
+
+   if (u->dead)
+      return TIMEOUT;
+   if (u->nak[n])
+      return NAK;
+   if (rand() % 100 < u->change[n])
+      value[n]++;
+   *hash = value[n];
+   return OK;
+}
+
+// Run cycles, polling as daikin_as_poll() does, and check the gaps between polls of each command
+static void run(const char *what, const unit_t *u, uint32_t start, int budget, int count, long *polled, long *gap)
+{
+   uint32_t last[POLLS] = { 0 };
+
+   memset(polled, 0, sizeof(*polled) * POLLS);
+   memset(gap, 0, sizeof(*gap) * POLLS);
+   sched.budget = budget;
+   poll_sched_reset(&sched);
+   for (int c = 0; c < count; c++) {
+      uint32_t now = start + c * CYCLE_MS;
+      int done = 0,
+          n;
+
+      poll_sched_start(&sched, now);
+      while ((n = poll_sched_next(&sched)) >= 0) {
+         uint16_t hash = 0;
+         int r = reply(u, n, &hash);
+
+         if (polled[n] && (long)(now - last[n]) > gap[n])
+            gap[n] = now - last[n];
+         polled[n]++;
+         last[n] = now;
+         done++;
+         if (verbose)
+            printf("%s %6d %c %s\n", what, c, polls[n].code, r == OK ? "ok" : r == NAK ? "nak" : "timeout");
+         poll_sched_done(&sched, n, r == OK, r == NAK, hash);
+         if (r == TIMEOUT)
+            break;
+      }
+      if (done > budget)
+         failed("%ld polls in a cycle, budget %ld", what, 0, done, budget);
+      if (!c && !u->dead && done != (budget < POLLS ? budget : POLLS))
+         failed("%ld polls in the first cycle, expected %ld", what, 0, done, budget < POLLS ? budget : POLLS);
+   }
+}
+
+static void report(const char *what, const long *polled, const long *gap)
+{
+   printf("%-12s", what);
+   for (int n = 0; n < POLLS; n++)
+      printf(" %c %5ld polls %3lds max gap", polls[n].code, polled[n], gap[n] / 1000);
+   printf("\n");
+}
+
+static void usage(const char *progname)
+{
+   printf("Usage: %s [options]\n"
+          "Options:\n"
+          " -h or --help                - this help\n"
+          " -c or --cycles <n>          - main loop cycles per run (default %d)\n"
+          " -s or --seed <n>            - random seed (default %u)\n"
+          " -v or --verbose             - print every poll\n",
+          progname, cycles, seed);
+}
+
+static const char *get_string_arg(int argc, const char **argv)
+{
+   if (argc < 2) {
+      fprintf(stderr, "%s option requires a value\n", argv[0]);
+      exit(255);
+   }
+   return argv[1];
+}
+
+int main(int argc, const char *argv[])
+{
+   const char *progname = *argv++;
+
+   for (argc--; argc; argc--, argv++) {
+      const char *opt = argv[0];
+
+      if (!strcmp(opt, "-h") || !strcmp(opt, "--help")) {
+         usage(progname);
+         return 255;
+      } else if (!strcmp(opt, "-c") || !strcmp(opt, "--cycles")) {
+         cycles = atoi(get_string_arg(argc--, argv++));
+      } else if (!strcmp(opt, "-s") || !strcmp(opt, "--seed")) {
+         seed = atoi(get_string_arg(argc--, argv++));
+      } else if (!strcmp(opt, "-v") || !strcmp(opt, "--verbose")) {
+         verbose = 1;
+      } else {
+         fprintf(stderr, "%s: unknown option\n", opt);
+         return 255;
+      }
+   }
+   if (cycles < 600) {
+      fprintf(stderr, "At least 600 cycles, so that everything backs off\n");
+      return 255;
+   }
+   srand(seed);
+
+   long polled[POLLS], gap[POLLS], wrapped[POLLS], wrapgap[POLLS];
+   unit_t stable = { 0 }, busy = { 0 }, naks = { 0 }, dead = {.dead = 1 };
+
+   // Nothing changes, so everything backs off to its longest interval, and no further
+   run("Stable", &stable, 0, POLLS, cycles, polled, gap);
+   report("Stable", polled, gap);
+   for (int n = 0; n < POLLS; n++) {
+      long expect = (cycles * (long)CYCLE_MS) / polls[n].max_interval;
+
+      if (gap[n] > polls[n].max_interval + CYCLE_MS || gap[n] < polls[n].max_interval - POLL_SCHED_SLACK_MS)
+         failed("gap %ldms, longest interval %ldms", "Stable", n, gap[n], polls[n].max_interval);
+      if (polled[n] > expect + 20)
+         failed("%ld polls, expected about %ld", "Stable", n, polled[n], expect);
+   }
+
+   // The same, with the millisecond clock wrapping part way
+   run("Wrapped", &stable, -(cycles / 2) * CYCLE_MS, POLLS, cycles, wrapped, wrapgap);
+   for (int n = 0; n < POLLS; n++)
+      if (wrapped[n] != polled[n] || wrapgap[n] != gap[n])
+         failed("%ld polls across the clock wrapping, %ld without", "Wrapped", n, wrapped[n], polled[n]);
+
+   // Every reply differs, so nothing backs off
+   for (int n = 0; n < POLLS; n++)
+      busy.change[n] = 100;
+   run("Changing", &busy, 0, POLLS, cycles, polled, gap);
+   report("Changing", polled, gap);
+   for (int n = 0; n < POLLS; n++)
+      if (gap[n] > polls[n].min_interval + CYCLE_MS)
+         failed("gap %ldms, shortest interval %ldms", "Changing", n, gap[n], polls[n].min_interval);
+
+   // Only one command a cycle, so most overdue first must still get to everything
+   for (int n = 0; n < POLLS; n++)
+      busy.change[n] = 30;
+   run("Budget 1", &busy, 0, 1, cycles, polled, gap);
+   report("Budget 1", polled, gap);
+   for (int n = 0; n < POLLS; n++)
+      if (!polled[n] || gap[n] > polls[n].max_interval + POLLS * CYCLE_MS)
+         failed("gap %ldms, longest interval %ldms", "Budget 1", n, gap[n], polls[n].max_interval);
+
+   // S is not supported, it is given up after NAKS, and the rest carry on
+   naks.nak[3] = 1;
+   run("NAK S", &naks, 0, POLLS, cycles, polled, gap);
+   report("NAK S", polled, gap);
+   if (polled[3] != NAKS)
+      failed("%ld polls, expected %ld", "NAK S", 3, polled[3], NAKS);
+   for (int n = 0; n < 3; n++)
+      if (gap[n] > polls[n].max_interval + CYCLE_MS)
+         failed("gap %ldms, longest interval %ldms", "NAK S", n, gap[n], polls[n].max_interval);
+
+   // Nobody there, a timeout ends the cycle, so one command a cycle, and timeouts are not NAKs
+   run("Dead", &dead, 0, POLLS, cycles, polled, gap);
+   report("Dead", polled, gap);
+   long total = 0;
+
+   for (int n = 0; n < POLLS; n++)
+      total += polled[n];
+   if (total > cycles)
+      failed("%ld polls in %ld cycles", "Dead", 0, total, cycles);
+   for (int n = 0; n < POLLS; n++)
+      if (state[n].naks)
+         failed("%ld NAKs counted, after %ld timeouts", "Dead", n, state[n].naks, polled[n]);
+
+   printf("%s\n", fail ? "FAILED" : "OK");
+   return fail ? 1 : 0;
+}
@@ -0,0 +1,460 @@
+/* S21 engine benchmark. Runs Faikin's S21 protocol engine against the simulator (or a real A/C) */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+
+#include "main/s21_engine.h"
+#include "main/bus_stats.h"
+#include "osal.h"
+
+static const char *port      = NULL;            // Serial port to use instead of a simulator
+static const char *simulator = "./faikin-s21";  // Simulator to run on a pty
+static const char *settings  = NULL;            // Settings file for the simulator
+static int cycles            = 10;              // Number of poll cycles to run
+static int debug             = 0;               // Print protocol events
+static int byte_timeout      = 0;               // Inter-byte timeout, 0 for default
+static int fixed             = 0;               // Use old fixed poll sequence instead of scheduler
+static int all               = 0;               // Also poll debug only commands, as Faikin does with debug set
+static const char *caps      = NULL;            // Capability map to start with, as stored by Faikin
+
+// Names of all the fields, for printing
+static const char *const field_name[] = {
+#define b(name)         #name,
+#define t(name)         b(name)
+#define r(name)         b(name)
+#define i(name)         b(name)
+#define e(name,values)  b(name)
+#define s(name,len)     b(name)
+#include "main/acextras.m"
+};
+
+#define NUM_FIELDS (sizeof(field_name) / sizeof(field_name[0]))
+
+enum {
+   FIELD_NONE,
+   FIELD_UINT8,
+   FIELD_INT,
+   FIELD_TEMP,
+   FIELD_STRING
+};
+
+// Our own copy of decoded state
+static struct {
+   uint8_t type;
+   uint8_t u8;
+   int i;
+   int t;
+   char s[64];
+} field[NUM_FIELDS];
+
+// Protocol event counters
+static unsigned int events[S21_EV_MAX];
+// Transport read calls, i.e. how many times we wake up per command
+static unsigned int reads;
+// Bytes on the wire, both directions
+static unsigned int bus_bytes;
+// Commands sent, total and per command
+static unsigned int commands;
+static struct {
+   char cmd[5];
+   unsigned int count;
+} polled[S21_POLL_MAX];
+
+static const char *const event_name[] = {
+   "tx", "rx", "ack", "nak", "noack", "timeout", "badsum", "badhead", "loopback", "valid", "badlength", "response", "acked"
+};
+// Per command timing, same as Faikin collects
+static bus_stat_t *stat;
+static double sent, acked;
+
+static double now(clockid_t clk)
+{
+   struct timespec ts;
+
+   clock_gettime(clk, &ts);
+   return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static int fd_write(void *ctx, const uint8_t *buf, int len)
+{
+   bus_bytes += len;
+   return write(*(int *)ctx, buf, len);
+}
+
+static int fd_read(void *ctx, uint8_t *buf, int len, int timeout_ms)
+{
+   int fd = *(int *)ctx;
+   int got = 0;
+
+   reads++;
+   double end = now(CLOCK_MONOTONIC) + timeout_ms;
+
+   while (got < len) {
+      struct pollfd pfd = {.fd = fd, .events = POLLIN};
+      int left = end - now(CLOCK_MONOTONIC);
+
+      if (left <= 0 || poll(&pfd, 1, left) <= 0)
+         break;
+      int l = read(fd, buf + got, len - got);
+
+      if (l <= 0)
+         break;
+      got += l;
+   }
+   bus_bytes += got;
+   return got;
+}
+
+static int fd_available(void *ctx)
+{
+   int len = 0;
+
+   ioctl(*(int *)ctx, FIONREAD, &len);
+   return len;
+}
+
+static void report_uint8(void *ctx, int f, uint8_t val)
+{
+   field[f].type = FIELD_UINT8;
+   field[f].u8 = val;
+}
+
+static void report_int(void *ctx, int f, int val)
+{
+   field[f].type = FIELD_INT;
+   field[f].i = val;
+}
+
+static void report_temp(void *ctx, int f, int val)
+{
+   field[f].type = FIELD_TEMP;
+   field[f].t = val;
+}
+
+static void report_string(void *ctx, int f, const char *val)
+{
+   field[f].type = FIELD_STRING;
+   strncpy(field[f].s, val, sizeof(field[f].s) - 1);
+}
+
+static uint8_t get_uint8(void *ctx, int f)
+{
+   return field[f].u8;
+}
+
+static int get_temp(void *ctx, int f)
+{
+   return field[f].type == FIELD_TEMP ? field[f].t : CTEMP_NONE;
+}
+
+static void event(void *ctx, int ev, const s21_event_t *e)
+{
+   events[ev]++;
+   if (ev == S21_EV_TX) {
+      sent = now(CLOCK_MONOTONIC);
+      acked = 0;
+   } else if (ev == S21_EV_ACKED) {
+      acked = now(CLOCK_MONOTONIC);
+      if (stat)
+         bus_stats_time(&stat->ack, (acked - sent) * 1000);
+   } else if (ev == S21_EV_RX && stat) {
+      bus_stats_time(&stat->reply, (now(CLOCK_MONOTONIC) - (acked ? acked : sent)) * 1000);
+   }
+   if (debug && ev != S21_EV_TX && ev != S21_EV_RX && ev != S21_EV_VALID && ev != S21_EV_RESPONSE &&
+       ev != S21_EV_ACKED) {
+      printf("%c%c: %s", e->cmd ? e->cmd[0] : '?', e->cmd ? e->cmd[1] : '?', event_name[ev]);
+      for (int i = 0; i < e->len; i++)
+         printf(" %02X", e->data[i]);
+      printf("\n");
+   }
+}
+
+static int sim_fd = -1;
+
+static const s21_transport_t transport = {
+   .write = fd_write,
+   .read  = fd_read,
+   .available = fd_available,
+   .ctx   = &sim_fd
+};
+
+static const s21_sink_t sink = {
+   .report_uint8  = report_uint8,
+   .report_int    = report_int,
+   .report_temp   = report_temp,
+   .report_string = report_string,
+   .get_uint8     = get_uint8,
+   .get_temp      = get_temp,
+   .event         = event
+};
+
+// Old fixed sequence: these every cycle, plus one of R commands in turn
+static const char *const fixed_list[] = {"F1", "F5", "F6", "F7", "FM"};
+static const char *const fixed_rcycle[] = {"RH", "RI", "Ra", "RL", "Rd", "RN", "RG"};
+
+#define NUM_FIXED (sizeof(fixed_list) / sizeof(fixed_list[0]))
+#define NUM_RCYCLE (sizeof(fixed_rcycle) / sizeof(fixed_rcycle[0]))
+
+static int command(s21_engine_t *s21, const char *cmd, const char *payload)
+{
+   char name[5]; // Polls have no real payload, it's the rest of a v3 command
+   int i;
+
+   snprintf(name, sizeof(name), "%s%s", cmd, payload);
+   for (i = 0; i < S21_POLL_MAX - 1 && polled[i].count && strcmp(polled[i].cmd, name); i++)
+      ;
+   strcpy(polled[i].cmd, name);
+   polled[i].count++;
+   commands++;
+   stat = bus_stats_find(name);
+   return s21_command(s21, cmd[0], cmd[1], strlen(payload), payload);
+}
+
+static void usage(const char *progname)
+{
+   printf("Usage: %s [options]\n"
+          "Options:\n"
+          " -h or --help                - this help\n"
+          " -p or --port <port>         - serial port to use instead of simulator\n"
+          " -S or --simulator <path>    - simulator to run on a pty (default %s)\n"
+          " -s or --settings <file>     - settings file for the simulator\n"
+          " -n or --cycles <n>          - number of poll cycles (default %d)\n"
+          " -b or --byte-timeout <ms>   - inter-byte timeout (default %d)\n"
+          " -f or --fixed               - use old fixed poll sequence instead of scheduler\n"
+          " -c or --caps <map>          - start with a capability map, as printed by a previous run\n"
+          " -a or --all                 - also poll debug only commands\n"
+          " -v or --debug               - print protocol errors\n", progname, simulator, cycles, S21_BYTE_TIMEOUT_MS);
+}
+
+static const char *get_string_arg(int argc, const char **argv)
+{
+   if (argc < 2) {
+      fprintf(stderr, "%s option requires a value\n", argv[0]);
+      exit(255);
+   }
+   return argv[1];
+}
+
+static pid_t start_simulator(void)
+{
+   int master = posix_openpt(O_RDWR | O_NOCTTY);
+
+   if (master < 0 || grantpt(master) || unlockpt(master)) {
+      perror("Failed to create pty");
+      exit(255);
+   }
+
+   const char *slave_name = ptsname(master);
+   int slave = open(slave_name, O_RDWR | O_NOCTTY);
+   struct termios t;
+
+   // Raw mode right away; the simulator will set its own parameters
+   if (slave < 0 || tcgetattr(slave, &t)) {
+      perror("Failed to open pty");
+      exit(255);
+   }
+   cfmakeraw(&t);
+   tcsetattr(slave, TCSANOW, &t);
+
+   pid_t pid = fork();
+
+   if (pid < 0) {
+      perror("fork");
+      exit(255);
+   }
+   if (!pid) {
+      const char *argv[] = {simulator, "-p", slave_name, settings ? "-s" : NULL, settings, NULL};
+
+      if (!debug) {
+         int null = open("/dev/null", O_WRONLY);
+
+         dup2(null, 1);
+      }
+      execv(simulator, (char **)argv);
+      perror("Failed to run simulator");
+      _exit(255);
+   }
+
+   // Keep the slave open, so that the master never sees a hangup
+   sim_fd = master;
+   usleep(200000); // Let the simulator start up
+   return pid;
+}
+
+int main(int argc, const char *argv[])
+{
+   const char *progname = *argv++;
+   pid_t sim = 0;
+
+   for (argc--; argc; argc--, argv++) {
+      const char *opt = argv[0];
+
+      if (!strcmp(opt, "-h") || !strcmp(opt, "--help")) {
+         usage(progname);
+         return 255;
+      } else if (!strcmp(opt, "-p") || !strcmp(opt, "--port")) {
+         port = get_string_arg(argc--, argv++);
+      } else if (!strcmp(opt, "-S") || !strcmp(opt, "--simulator")) {
+         simulator = get_string_arg(argc--, argv++);
+      } else if (!strcmp(opt, "-s") || !strcmp(opt, "--settings")) {
+         settings = get_string_arg(argc--, argv++);
+      } else if (!strcmp(opt, "-n") || !strcmp(opt, "--cycles")) {
+         cycles = atoi(get_string_arg(argc--, argv++));
+      } else if (!strcmp(opt, "-b") || !strcmp(opt, "--byte-timeout")) {
+         byte_timeout = atoi(get_string_arg(argc--, argv++));
+      } else if (!strcmp(opt, "-f") || !strcmp(opt, "--fixed")) {
+         fixed = 1;
+      } else if (!strcmp(opt, "-c") || !strcmp(opt, "--caps")) {
+         caps = get_string_arg(argc--, argv++);
+      } else if (!strcmp(opt, "-a") || !strcmp(opt, "--all")) {
+         all = 1;
+      } else if (!strcmp(opt, "-v") || !strcmp(opt, "--debug")) {
+         debug = 1;
+      } else {
+         fprintf(stderr, "%s: unknown option\n", opt);
+         return 255;
+      }
+   }
+
+   if (port) {
+      sim_fd = open(port, O_RDWR | O_NOCTTY);
+      if (sim_fd < 0) {
+         fprintf(stderr, "Cannot open %s: %s\n", port, strerror(errno));
+         return 255;
+      }
+      if (set_serial(sim_fd, 2400, CS8, EVENPARITY, TWOSTOPBITS)) {
+         fputs("Failed to set up serial port\n", stderr);
+         return 255;
+      }
+   } else {
+      sim = start_simulator();
+   }
+
+   s21_engine_t s21 = {
+      .transport = &transport,
+      .sink      = &sink,
+      .byte_timeout = byte_timeout,
+      .debug     = all
+   };
+   double total = 0, min = INFINITY, max = 0, cpu = 0;
+   unsigned int results[RES_TIMEOUT + 1] = {0};
+   // Like Faikin, with a known map we poll everything in the first cycle as nothing needs probing
+   int budget = caps && s21_caps_load(&s21, caps) ? S21_POLL_MAX : S21_POLL_BUDGET;
+   int settled = -1;
+
+   // Each cycle stands for one second of Faikin main loop, time is virtual
+   for (int c = 0; c < cycles; c++) {
+      double start = now(CLOCK_MONOTONIC);
+      double start_cpu = now(CLOCK_PROCESS_CPUTIME_ID);
+
+      if (fixed) {
+         for (int i = 0; i < NUM_FIXED; i++)
+            results[command(&s21, fixed_list[i], "")]++;
+         results[command(&s21, fixed_rcycle[c % NUM_RCYCLE], "")]++;
+      } else {
+         uint32_t ms = c * 1000;
+         const s21_poll_def_t *p;
+
+         for (int n = 0; n < budget && (p = s21_poll_next(&s21, ms)); n++) {
+            int r = command(&s21, p->cmd, p->payload);
+
+            results[r]++;
+            s21_poll_done(&s21, p, ms, r);
+         }
+         budget = S21_POLL_BUDGET;
+         if (settled < 0 && s21_caps_settled(&s21))
+            settled = c + 1;
+      }
+
+      double t = now(CLOCK_MONOTONIC) - start;
+
+      cpu += now(CLOCK_PROCESS_CPUTIME_ID) - start_cpu;
+      total += t;
+      if (t < min)
+         min = t;
+      if (t > max)
+         max = t;
+   }
+
+   if (sim) {
+      kill(sim, SIGTERM);
+      waitpid(sim, NULL, 0);
+   }
+
+   printf("Decoded state:\n");
+   for (int f = 0; f < NUM_FIELDS; f++) {
+      switch (field[f].type) {
+      case FIELD_UINT8:
+         printf(" %-12s %u\n", field_name[f], field[f].u8);
+         break;
+      case FIELD_INT:
+         printf(" %-12s %d\n", field_name[f], field[f].i);
+         break;
+      case FIELD_TEMP:
+         printf(" %-12s %.1f\n", field_name[f], field[f].t / 100.0);
+         break;
+      case FIELD_STRING:
+         printf(" %-12s %s\n", field_name[f], field[f].s);
+         break;
+      }
+   }
+   if (s21.protocol_minor)
+      printf(" %-12s %d.%02d\n", "protocol", s21.protocol_major, s21.protocol_minor);
+   else
+      printf(" %-12s %d\n", "protocol", s21.protocol_major);
+
+   const s21_static_t *v;
+
+   for (int n = 0; (v = s21_static_get(&s21, n)); n++) {
+      printf(" %-12.4s", (const char *)v->cmd);
+      for (int i = 0; i < v->len; i++)
+         printf("%02X", v->data[i]);
+      printf("\n");
+   }
+
+   printf("Results: ok=%u nak=%u noack=%u bad=%u timeout=%u\n", results[RES_OK], results[RES_NAK],
+          results[RES_NOACK], results[RES_BAD], results[RES_TIMEOUT]);
+   printf("Reads: %u (%.1f per command)\n", reads, commands ? (double)reads / commands : 0);
+   printf("Polled:");
+   for (int i = 0; i < S21_POLL_MAX && polled[i].count; i++)
+      printf(" %s=%u", polled[i].cmd, polled[i].count);
+   printf("\n");
+   if (!fixed) {
+      char map[200];
+
+      s21_caps_save(&s21, map, sizeof(map));
+      printf("Capabilities: %s\n", map);
+      if (settled > 0)
+         printf("Full state after %d cycles\n", settled);
+      else
+         printf("Still probing after %d cycles\n", cycles);
+   }
+   printf("Events:");
+   for (int i = 0; i < S21_EV_MAX; i++)
+      if (events[i])
+         printf(" %s=%u", event_name[i], events[i]);
+   printf("\n");
+   printf("Longest ACK/reply:");
+   for (int i = 0; i < bus_stats_count; i++)
+      printf(" %s=%u/%ums", bus_stats[i].cmd, bus_stats[i].ack.max, bus_stats[i].reply.max);
+   printf("\n");
+   if (cycles > 0) {
+      printf("%d cycles, %.1f commands per cycle: min %.1fms avg %.1fms max %.1fms, CPU %.3fms per cycle\n", cycles,
+             (double)commands / cycles, min, total / cycles, max, cpu / cycles);
+      // 2400 baud 8E2 is 12 bits per byte
+      printf("Bus busy %.1f%% of the time at 2400 baud\n", bus_bytes * 12 * 100.0 / 2400 / cycles);
+   }
+   return 0;
+}
@@ -0,0 +1,326 @@
+/* Environment report statistics check. Feeds the same random samples to Faikin's stats (ESP/main/ac_stats.c)
+   and to the layout they replaced, which is kept here, and checks that the reports are byte-identical */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "main/ac_stats.h"
+
+static int periods  = 1000; // Number of reports
+static int samples  = 2000; // Most samples in a report
+static unsigned seed = 1;
+static int verbose  = 0;    // Print reports
+
+// The previous layout, stats interleaved with live values, as in the daikin struct
+static struct {
+   uint32_t statscount;
+#define b(name) uint8_t name; uint32_t total##name;
+#define t(name) ctemp_t name; ctemp_t min##name; int32_t total##name; ctemp_t max##name; uint32_t count##name;
+#define r(name) ctemp_t min##name; ctemp_t max##name;
+#define i(name) int name; int min##name; int total##name; int max##name;
+#define e(name, values) uint8_t name;
+#define s(name, len) char name[len];
+#include "main/acextras.m"
+} old;
+
+// The live values of the new layout, grouped by size, as in the daikin struct
+typedef struct {
+#define i(name) int name;
+#include "main/acextras.m"
+#define t(name) ctemp_t name;
+#define r(name) ctemp_t min##name; ctemp_t max##name;
+#include "main/acextras.m"
+#define b(name) uint8_t name;
+#define e(name, values) uint8_t name;
+#define s(name, len) char name[len];
+#include "main/acextras.m"
+} live_t;
+
+static live_t live;
+static ac_stats_t stats;
+
+// Report text, in the same form as Faikin's JSON
+static char report[2][8192];
+static int report_len;
+
+static void out(char *r, const char *fmt, ...)
+{
+   va_list ap;
+
+   va_start(ap, fmt);
+   report_len += vsnprintf(r + report_len, sizeof(report[0]) - report_len, fmt, ap);
+   va_end(ap);
+}
+
+static void out_tag(char *r, const char *tag)
+{
+   if (report_len && r[report_len - 1] != '[')
+      out(r, ",");
+   if (tag)
+      out(r, "\"%s\":", tag);
+}
+
+static void out_centi(char *r, const char *tag, int v)
+{
+   // jo_centi() with 2 places
+   out_tag(r, tag);
+   out(r, "%s%d.%02d", v < 0 ? "-" : "", abs(v) / 100, abs(v) % 100);
+}
+
+static void out_int(char *r, const char *tag, int v)
+{
+   out_tag(r, tag);
+   out(r, "%d", v);
+}
+
+static void out_bool(char *r, const char *tag, int v)
+{
+   out_tag(r, tag);
+   out(r, v ? "true" : "false");
+}
+
+static void out_array(char *r, const char *tag)
+{
+   out_tag(r, tag);
+   out(r, "[");
+}
+
+static int ctemp_round(int t, int step)
+{
+   return (t + (t < 0 ? -step / 2 : step / 2)) / step * step;
+}
+
+static void old_sample(void)
+{
+#define b(name) if (old.name) old.total##name++;
+#define t(name)                                                                                                       \
+   if (old.name != CTEMP_NONE) {                                                                                      \
+      if (!old.count##name || old.min##name > old.name)                                                               \
+         old.min##name = old.name;                                                                                    \
+      if (!old.count##name || old.max##name < old.name)                                                               \
+         old.max##name = old.name;                                                                                    \
+      old.total##name += old.name;                                                                                    \
+      old.count##name++;                                                                                              \
+   }
+#define i(name)                                                                                                       \
+   if (!old.statscount || old.min##name > old.name)                                                                   \
+      old.min##name = old.name;                                                                                       \
+   if (!old.statscount || old.max##name < old.name)                                                                   \
+      old.max##name = old.name;                                                                                       \
+   old.total##name += old.name;
+#include "main/acextras.m"
+   old.statscount++;
+}
+
+static void old_report(char *r, uint64_t known, int fixstatus)
+{
+#define b(name)                                                                                                       \
+   if (known & (1ULL << CONTROL_##name##_pos)) {                                                                      \
+      if (!old.total##name)                                                                                           \
+         out_bool(r, #name, 0);                                                                                       \
+      else if (fixstatus || old.total##name == old.statscount)                                                        \
+         out_bool(r, #name, 1);                                                                                       \
+      else                                                                                                            \
+         out_centi(r, #name, (old.total##name * 100 + old.statscount / 2) / old.statscount);                          \
+   }                                                                                                                  \
+   old.total##name = 0;
+#define t(name)                                                                                                       \
+   if (old.count##name) {                                                                                             \
+      if (fixstatus || old.min##name == old.max##name)                                                                \
+         out_centi(r, #name, old.min##name);                                                                          \
+      else {                                                                                                          \
+         out_array(r, #name);                                                                                         \
+         out_centi(r, NULL, old.min##name);                                                                           \
+         out_centi(r, NULL, ctemp_round(old.total##name, old.count##name) / (int)old.count##name);                    \
+         out_centi(r, NULL, old.max##name);                                                                           \
+         out(r, "]");                                                                                                 \
+      }                                                                                                               \
+   }                                                                                                                  \
+   old.min##name = CTEMP_NONE;                                                                                        \
+   old.total##name = 0;                                                                                               \
+   old.max##name = CTEMP_NONE;                                                                                        \
+   old.count##name = 0;
+#define i(name)                                                                                                       \
+   if (known & (1ULL << CONTROL_##name##_pos)) {                                                                      \
+      if (fixstatus || old.min##name == old.max##name)                                                                \
+         out_int(r, #name, old.total##name / old.statscount);                                                         \
+      else {                                                                                                          \
+         out_array(r, #name);                                                                                         \
+         out_int(r, NULL, old.min##name);                                                                             \
+         out_int(r, NULL, old.total##name / old.statscount);                                                          \
+         out_int(r, NULL, old.max##name);                                                                             \
+         out(r, "]");                                                                                                 \
+      }                                                                                                               \
+      old.min##name = 0;                                                                                              \
+      old.total##name = 0;                                                                                            \
+      old.max##name = 0;                                                                                              \
+   }
+#include "main/acextras.m"
+   old.statscount = 0;
+}
+
+// Same as Faikin.c
+static void new_sample(void)
+{
+   if (!ac_stats_full(&stats)) {
+#define b(name) ac_stats_bool(&stats, STATS_B_##name, live.name);
+#define t(name) ac_stats_temp(&stats, STATS_T_##name, live.name);
+#define i(name) ac_stats_int(&stats, STATS_I_##name, live.name);
+#include "main/acextras.m"
+      ac_stats_next(&stats);
+   }
+}
+
+static void new_report(char *r, uint64_t known, int fixstatus)
+{
+#define b(name)                                                                                                       \
+   if (known & (1ULL << CONTROL_##name##_pos)) {                                                                      \
+      if (!stats.btrue[STATS_B_##name])                                                                               \
+         out_bool(r, #name, 0);                                                                                       \
+      else if (fixstatus || stats.btrue[STATS_B_##name] == stats.samples)                                             \
+         out_bool(r, #name, 1);                                                                                       \
+      else                                                                                                            \
+         out_centi(r, #name, ac_stats_bool_frac(&stats, STATS_B_##name));                                             \
+   }
+#define t(name)                                                                                                       \
+   if (stats.tcount[STATS_T_##name]) {                                                                                \
+      if (fixstatus || stats.tmin[STATS_T_##name] == stats.tmax[STATS_T_##name])                                      \
+         out_centi(r, #name, stats.tmin[STATS_T_##name]);                                                             \
+      else {                                                                                                          \
+         out_array(r, #name);                                                                                         \
+         out_centi(r, NULL, stats.tmin[STATS_T_##name]);                                                              \
+         out_centi(r, NULL, ac_stats_temp_avg(&stats, STATS_T_##name));                                               \
+         out_centi(r, NULL, stats.tmax[STATS_T_##name]);                                                              \
+         out(r, "]");                                                                                                 \
+      }                                                                                                               \
+   }
+#define i(name)                                                                                                       \
+   if (known & (1ULL << CONTROL_##name##_pos)) {                                                                      \
+      if (fixstatus || stats.imin[STATS_I_##name] == stats.imax[STATS_I_##name])                                      \
+         out_int(r, #name, ac_stats_int_avg(&stats, STATS_I_##name));                                                 \
+      else {                                                                                                          \
+         out_array(r, #name);                                                                                         \
+         out_int(r, NULL, stats.imin[STATS_I_##name]);                                                                \
+         out_int(r, NULL, ac_stats_int_avg(&stats, STATS_I_##name));                                                  \
+         out_int(r, NULL, stats.imax[STATS_I_##name]);                                                                \
+         out(r, "]");                                                                                                 \
+      }                                                                                                               \
+   }
+#include "main/acextras.m"
+   ac_stats_reset(&stats);
+}
+
+static int random_temp(int prev)
+{
+   // Mostly a slow walk, sometimes not known, sometimes a jump, including below zero
+   int r = rand() % 100;
+
+   if (!r)
+      return CTEMP_NONE;
+   if (r == 1 || prev == CTEMP_NONE)
+      return rand() % CTEMP(80) - CTEMP(20);
+   return prev + rand() % 21 - 10;
+}
+
+static void random_values(void)
+{
+#define b(name) live.name = old.name = (rand() % 4 == 0);
+#define t(name) live.name = old.name = random_temp(live.name);
+// Not negative: the old layout divided an int total by an unsigned count, which only worked for positive values
+#define i(name) live.name = old.name = rand() % 3 ? rand() % 2000 : rand() % 100000;
+#include "main/acextras.m"
+}
+
+static void usage(const char *progname)
+{
+   printf("Usage: %s [options]\n"
+          "Options:\n"
+          " -h or --help                - this help\n"
+          " -n or --periods <n>         - number of reports (default %d)\n"
+          " -m or --samples <n>         - most samples in a report (default %d)\n"
+          " -s or --seed <n>            - random seed (default %u)\n"
+          " -v or --verbose             - print reports\n",
+          progname, periods, samples, seed);
+}
+
+static const char *get_string_arg(int argc, const char **argv)
+{
+   if (argc < 2) {
+      fprintf(stderr, "%s option requires a value\n", argv[0]);
+      exit(255);
+   }
+   return argv[1];
+}
+
+int main(int argc, const char *argv[])
+{
+   const char *progname = *argv++;
+
+   for (argc--; argc; argc--, argv++) {
+      const char *opt = argv[0];
+
+      if (!strcmp(opt, "-h") || !strcmp(opt, "--help")) {
+         usage(progname);
+         return 255;
+      } else if (!strcmp(opt, "-n") || !strcmp(opt, "--periods")) {
+         periods = atoi(get_string_arg(argc--, argv++));
+      } else if (!strcmp(opt, "-m") || !strcmp(opt, "--samples")) {
+         samples = atoi(get_string_arg(argc--, argv++));
+      } else if (!strcmp(opt, "-s") || !strcmp(opt, "--seed")) {
+         seed = atoi(get_string_arg(argc--, argv++));
+      } else if (!strcmp(opt, "-v") || !strcmp(opt, "--verbose")) {
+         verbose = 1;
+      } else {
+         fprintf(stderr, "%s: unknown option\n", opt);
+         return 255;
+      }
+   }
+   if (samples < 1 || samples > STATS_MAX_SAMPLES) {
+      fprintf(stderr, "Samples must be 1 to %u, the old layout did not stop at %u\n", STATS_MAX_SAMPLES,
+              STATS_MAX_SAMPLES);
+      return 255;
+   }
+
+   size_t old_size = sizeof(old);
+   size_t new_size = sizeof(live_t) + sizeof(ac_stats_t);
+
+   printf("Fields: %d bool, %d temperature, %d integer\n", STATS_B, STATS_T, STATS_I);
+   printf("Old layout %zu bytes, new layout %zu bytes (live %zu, stats %zu), saving %zu bytes\n", old_size, new_size,
+          sizeof(live_t), sizeof(ac_stats_t), old_size - new_size);
+
+   srand(seed);
+#define t(name) live.name = old.name = CTEMP_NONE;
+#include "main/acextras.m"
+   ac_stats_reset(&stats);
+
+   // Fields known stay known, as status_known does once the protocol is detected. The old layout kept adding
+   // i() fields that were not known, so the reports would not match if a field became known part way through
+   uint64_t known = seed & 1 ? ~0ULL : ((uint64_t)rand() << 32 | rand());
+   int fail = 0;
+
+   for (int p = 0; p < periods; p++) {
+      int n = 1 + rand() % samples;
+      int fixstatus = (p % 4 == 3);
+
+      for (int i = 0; i < n; i++) {
+         random_values();
+         old_sample();
+         new_sample();
+      }
+      report_len = 0;
+      old_report(report[0], known, fixstatus);
+      report_len = 0;
+      new_report(report[1], known, fixstatus);
+      if (verbose)
+         printf("%d: {%s}\n", p, report[1]);
+      if (strcmp(report[0], report[1])) {
+         printf("Report %d differs (%d samples)\nold: {%s}\nnew: {%s}\n", p, n, report[0], report[1]);
+         fail++;
+      }
+   }
+
+   printf("%d reports, %d differ\n", periods, fail);
+   return fail ? 1 : 0;
+}